@@ -38,8 +38,8 @@ class Authority
         virtual ~Authority() { }
 
         virtual string getName()= 0;
-        // try to authorize using given credentials. write maximum access level to 'level' on success.
-        virtual bool authorize(const string& credentials, AccessLevel &level)= 0;
+        // try to authorize using given credentials. write maximum access level to 'level' and the user name to 'user' on success.
+        virtual bool authorize(const string& credentials, AccessLevel &level, string &user)= 0;
 };
 
 
@@ -179,7 +179,7 @@ class PasswordAuth: public Authority
 
         string getName() { return "password"; }
 
-        bool authorize(const string& credentials, AccessLevel &level)
+        bool authorize(const string& credentials, AccessLevel &level, string &user)
         {
             // load valid user/password combinations and group info into cache, if necessary.
             refreshFileCache();
@@ -203,6 +203,7 @@ class PasswordAuth: public Authority
             flog(LOG_AUTH, _("PasswordAuth: success, user %s, level %s\n"), it->first.c_str(), gAccessLevelNames[it->second.accessLevel]);
 
             level= it->second.accessLevel;
+            user= it->first;
 
             return true;
         }
@@ -24,13 +24,110 @@
 #define DEFAULT_HTTP_PORT   8090
 
 // listen backlog: how large may the queue of incoming connections grow
-#define LISTEN_BACKLOG      100
+#define LISTEN_BACKLOG      1024
 
 // default filenames for htpasswd file, group file, and core binary
 #define DEFAULT_HTPASSWD_FILENAME   "gspasswd.conf"
 #define DEFAULT_GROUP_FILENAME      "gsgroups.conf"
 #define DEFAULT_CORE_PATH           "./graphcore/graphcore"
 
+// relay data sets from core pipes to TCP clients using splice(), where available.
+// define NO_SPLICE to always copy data sets through the server.
+#if defined(__linux__) && !defined(NO_SPLICE)
+#define USE_SPLICE
+#endif
+// maximum number of bytes moved per splice() call
+#define RELAY_CHUNKSIZE     (1024*1024)
+// bytes read back from the end of each relayed chunk to look for the end of the data set
+#define RELAY_TAILSIZE      256
+
+// build the io_uring main loop. needs linux 6.0 or later at runtime, define NO_IO_URING to leave it out.
+#if defined(__linux__) && !defined(NO_IO_URING)
+#define USE_IO_URING
+#endif
+// io_uring submission and completion queue sizes
+#define URING_ENTRIES       1024
+#define URING_CQ_ENTRIES    16384
+// receive buffers shared by all client connections. buffers are handed back as soon as their data is split into lines.
+#define URING_RECV_BUFFERS  256
+#define URING_RECV_BUFSIZE  (16*1024)
+
+// outbound backpressure: when this many KiB of output are pending for a client, the server stops reading
+// from the core which produces it, until the client has drained its output below the low watermark.
+#define DEFAULT_WRITEBUFFER_HIGH_KB 8192
+#define DEFAULT_WRITEBUFFER_LOW_KB  2048
+
+// client output beyond this many KiB can be spilled to an unlinked temporary file in $TMPDIR, so that
+// the core can go on without being held up by a slow client. 0 disables spilling.
+#define DEFAULT_SPILL_THRESHOLD_KB  0
+// maximum size of a spill file. beyond that, output stays in memory and the watermarks above apply.
+#define SPILL_FILE_LIMIT    (1024*1024*1024)
+// disk space of spilled data which was sent is given back in steps of this size.
+#define SPILL_PUNCH_SIZE    (1024*1024)
+
+// inbound backpressure: reading from a client stops while this many lines or bytes are queued for it,
+// waiting for its core to finish a command. reading resumes once the queue has drained to half.
+#define INPUT_QUEUE_MAX_LINES   (256*1024)
+#define INPUT_QUEUE_MAX_BYTES   (16*1024*1024)
+// a worker thread stops reading from a client while this many bytes of its input wait for the main thread.
+#define SHARD_INPUT_LIMIT       (1024*1024)
+// data sets sent by clients are buffered in chunks of this size until they can be passed on to the core.
+#define DATASET_CHUNKSIZE       (64*1024)
+// a client which streams a data set to a core is not read from while this many bytes wait to be written to the core.
+// reading resumes when the core has caught up to CORE_WRITEBUFFER_LOW.
+#define CORE_WRITEBUFFER_HIGH   (4*1024*1024)
+#define CORE_WRITEBUFFER_LOW    (1024*1024)
+
+// flood control: lines, bytes and core commands per second which a session may send, per access level.
+// all sessions of one user together may send FLOOD_USER_FACTOR times as much. 0 means unlimited, which is the
+// default for all levels: limits are set with -r.
+// idle sessions save up tokens for FLOOD_BURST_SECONDS. clients over their limit are not read from until they are back in budget.
+#define FLOOD_LIMITS_READ       { 0, 0, 0 }
+#define FLOOD_LIMITS_WRITE      { 0, 0, 0 }
+#define FLOOD_LIMITS_ADMIN      { 0, 0, 0 }
+#define FLOOD_USER_FACTOR       4
+#define FLOOD_BURST_SECONDS     2
+
+// weighted fair queueing of core commands. clients with queued commands take turns on a core; in each turn, a
+// client's commands go first until it has used the core for FAIRQ_QUANTUM seconds times its weight.
+// weights are given per access level, and multiplied by FAIRQ_HTTP_FACTOR for HTTP sessions, which are mostly
+// interactive lookups.
+#define FAIRQ_QUANTUM           0.005
+#define FAIRQ_WEIGHTS           { 1, 2, 4 }
+#define FAIRQ_HTTP_FACTOR       2
+
+// cost estimates of core commands, for shortest expected job first scheduling: a running average of the time
+// commands with the same name and argument shape took, in which the latest counts COST_EWMA_WEIGHT. a shape
+// which was not seen yet is estimated by the command name, or COST_DEFAULT seconds. numeric arguments after
+// the first one are part of the shape up to COST_SHAPE_MAXARG, bigger ones by their magnitude. each core
+// tracks up to COST_TABLE_SIZE shapes.
+#define COST_EWMA_WEIGHT        0.2
+#define COST_DEFAULT            0.001
+#define COST_SHAPE_MAXARG       16
+#define COST_TABLE_SIZE         4096
+// with shortest expected job first scheduling, a command which has waited for a second counts as that much
+// shorter. a command goes before one SJF_AGING times as long once it has waited for as long as that one takes.
+#define SJF_AGING               0.1
+
+// replies to read commands are cached in up to this many KiB, see ResultCache. replies with data sets
+// bigger than RESULT_CACHE_MAX_ENTRY bytes are not cached.
+#define DEFAULT_RESULT_CACHE_KB     65536
+#define RESULT_CACHE_MAX_ENTRY      (1024*1024)
+
+// recycled objects kept for reuse: sessions of each connection type, command queue entries, and empty
+// output chunks per thread. objects beyond these numbers are freed.
+#define SESSION_POOL_SIZE       1024
+#define COMMAND_POOL_SIZE       4096
+#define WRITER_SPARE_CHUNKS     256
+// recycled command queue entries keep command buffers up to this size.
+#define COMMAND_POOL_MAXLINE    1024
+
+// the most read replicas a graph can be created with.
+#define MAX_GRAPH_REPLICAS      16
+
+// per-session statistics are collected over periods of this many seconds.
+#define SESSION_STATS_PERIOD    10
+
 
 // the command status codes, including those used in the core.
 enum CommandStatus
@@ -53,6 +150,23 @@ enum ConnectionType
 };
 
 
+// how a core picks the next command from those its clients have queued.
+enum SchedulingMode
+{
+    SCHED_FAIR= 0,      // clients take turns, by deficit round robin
+    SCHED_SHORTEST      // shortest expected command first, with aging
+};
+
+
+// the main loop implementations.
+enum MainLoop
+{
+    MAINLOOP_SELECT= 0,
+    MAINLOOP_LIBEVENT,
+    MAINLOOP_URING
+};
+
+
 // log levels for flog(). LOG_CRIT is always printed, other levels can be individually enabled on the command line.
 enum Loglevel
 {
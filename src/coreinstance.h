@@ -22,21 +22,72 @@
 struct CommandQEntry
 {
 	string command;         // command
-	deque<string> dataset;  // data set, if any
+	CommandTokens tokens;   // the command, split into words
+	deque<string> dataset;  // data set, if any. lines are stored back to back in chunks of up to DATASET_CHUNKSIZE bytes.
 	uint32_t clientID;      // who runs this command
 	bool acceptsData;       // command accepts an input data set (colon)?
 	bool dataFinished;      // data set was terminated with empty line?
+	bool sent;              // command was written to the core, the data set is passed on as it arrives
+	bool discardReply;      // copy of a command for a replica. the client gets the reply of another core
+	bool ordered;           // run in the same order relative to other ordered commands on every replica
+	uint64_t orderSeq;      // position among ordered commands queued on a core
     double sendBeginTime;   // when did the client begin to send this command
-
-	CommandQEntry(): clientID(0), acceptsData(false), dataFinished(true)
+    string costKey;         // name and argument shape, see CommandCosts
+    double expectedCost;    // estimated run time in seconds
+    double waitingSince;    // when it became the first queued command of its client
+    string cacheKey;        // the reply goes into the result cache under this key, if not empty
+    bool invalidatesCache;  // a write command: the graph's cached replies are dropped once it has run
+    string flightKey;       // identical read commands have the same key, and are run once for all their clients
+    vector<uint32_t> followers; // other clients which sent the same command and get the reply too
+
+	CommandQEntry(): clientID(0), acceptsData(false), dataFinished(true), sent(false), discardReply(false), ordered(false), orderSeq(0),
+	    expectedCost(0), waitingSince(0), invalidatesCache(false)
 	{ }
     
-    CommandQEntry(uint32_t clientID_, string command_): command(command_), clientID(clientID_), acceptsData(false), dataFinished(true)
+    // entries are recycled together with their buffers: they are made with create() and given back with recycle().
+    // the command line is copied into the entry, a newline is added if it has none, and it is parsed once.
+    static CommandQEntry *create(uint32_t clientID, const char *line, size_t len)
+    {
+        CommandQEntry *ce= pool().get();
+        if(!ce) ce= new CommandQEntry();
+        ce->command.assign(line, len);
+        if(!len || line[len-1]!='\n') ce->command+= '\n';
+        ce->clientID= clientID;
+        ce->sent= ce->discardReply= ce->ordered= ce->invalidatesCache= false;
+        ce->cacheKey.clear();
+        ce->flightKey.clear();
+        ce->followers.clear();
+        ce->sendBeginTime= getTime();
+        ce->tokens.parse(ce->command);
+        ce->acceptsData= ce->tokens.dataset;
+        ce->dataFinished= !ce->tokens.dataset;
+        return ce;
+    }
+
+    static CommandQEntry *create(uint32_t clientID, const string& line)
+    {
+        return create(clientID, line.data(), line.size());
+    }
+
+    // a copy of a complete command, to be run by a replica. the reply is discarded.
+    CommandQEntry *replicaCopy()
     {
-        sendBeginTime= getTime();
-        if(lineIndicatesDataset(command))
-            acceptsData= true, 
-            dataFinished= false;
+        CommandQEntry *ce= create(clientID, command);
+        ce->dataset= dataset;
+        ce->dataFinished= dataFinished;
+        ce->sendBeginTime= sendBeginTime;
+        ce->discardReply= true;
+        ce->ordered= ordered;
+        ce->invalidatesCache= invalidatesCache;
+        return ce;
+    }
+
+    static void recycle(CommandQEntry *ce)
+    {
+        if(!ce) return;
+        ce->dataset.clear();
+        if(ce->command.capacity()>COMMAND_POOL_MAXLINE) string().swap(ce->command);
+        if(!pool().put(ce)) delete ce;
     }
 
 	bool flushable()
@@ -44,20 +95,127 @@ struct CommandQEntry
 	    return (!acceptsData) || dataFinished;
 	}
     
-    void appendToDataset(const string& line)
+    // append a line, including its newline, to the data set.
+    void appendToDataset(const char *line, size_t len)
     {
         if(!acceptsData || dataFinished)
             return;
-        dataset.push_back(line);
-        if(Cli::splitString(line.c_str()).size()==0)
+        if(dataset.empty() || dataset.back().size()+len>DATASET_CHUNKSIZE)
+        {
+            // the first chunk grows as needed, so small data sets stay small. big ones get full chunks.
+            dataset.push_back(string());
+            if(dataset.size()>1) dataset.back().reserve(max(len, (size_t)DATASET_CHUNKSIZE));
+        }
+        dataset.back().append(line, len);
+        if(endsDataset(line, len))
             dataFinished= true;
     }
+
+    // a blank line terminates a data set.
+    static bool endsDataset(const char *line, size_t len)
+    {
+        size_t i;
+        for(i= 0; i<len && (line[i]==' ' || line[i]=='\t' || line[i]=='\n'); i++) ;
+        return i==len;
+    }
+
+    void appendToDataset(const string& line)
+    {
+        appendToDataset(line.data(), line.size());
+    }
+
+    private:
+    // only used from the main thread, the shards don't see command queue entries.
+    static ObjectPool<CommandQEntry> &pool()
+    {
+        static ObjectPool<CommandQEntry> p(COMMAND_POOL_SIZE);
+        return p;
+    }
+};
+
+// running estimates of how long core commands take, by command name and argument shape.
+class CommandCosts
+{
+    public:
+        // the shape of a command: its name, the number of arguments, numeric arguments after the first one (like a
+        // traversal depth) up to COST_SHAPE_MAXARG or else their magnitude, redirection, and the magnitude of the data
+        // set. the first argument is mostly a node ID, which doesn't say much about the cost.
+        static void shape(const CommandQEntry& ce, string& key)
+        {
+            const CommandTokens& t= ce.tokens;
+            StrRef name= t.name(ce.command);
+            key.assign(name.data, name.size);
+            char buf[32];
+            snprintf(buf, sizeof(buf), " %u", t.nwords? t.nwords-1: 0);
+            key+= buf;
+            for(unsigned i= 2; i<t.nwords && i<CommandTokens::MAXWORDS; i++)
+            {
+                StrRef w= t.word(ce.command, i);
+                uint64_t v= 0;
+                size_t k;
+                for(k= 0; k<w.size && isdigit(w.data[k]) && v<=UINT32_MAX; k++) v= v*10 + (w.data[k]-'0');
+                if(!w.size || k<w.size)
+                    key+= " *";
+                else
+                {
+                    if(v<=COST_SHAPE_MAXARG) snprintf(buf, sizeof(buf), " %u", (unsigned)v);
+                    else snprintf(buf, sizeof(buf), " ~%u", magnitude(v));
+                    key+= buf;
+                }
+            }
+            if(t.redirected) key+= " >";
+            if(ce.acceptsData)
+            {
+                size_t size= 0;
+                for(size_t i= 0; i<ce.dataset.size(); i++) size+= ce.dataset[i].size();
+                snprintf(buf, sizeof(buf), " :%u", (ce.dataFinished? magnitude(size): 0));
+                key+= buf;
+            }
+        }
+
+        // estimated run time in seconds.
+        double estimate(const string& key)
+        {
+            costs_t::iterator it= costs.find(key);
+            if(it!=costs.end()) return it->second;
+            nameKey.assign(key, 0, key.find(' '));
+            it= costs.find(nameKey);
+            return (it!=costs.end()? it->second: COST_DEFAULT);
+        }
+
+        // a command of this shape took 'seconds' to run.
+        void update(const string& key, double seconds)
+        {
+            nameKey.assign(key, 0, key.find(' '));
+            add(key, seconds);
+            add(nameKey, seconds);
+        }
+
+    private:
+        typedef unordered_map<string,double> costs_t;
+        costs_t costs;
+        string nameKey;
+
+        void add(const string& key, double seconds)
+        {
+            costs_t::iterator it= costs.find(key);
+            if(it!=costs.end())
+                it->second+= COST_EWMA_WEIGHT*(seconds-it->second);
+            else if(costs.size()<COST_TABLE_SIZE)
+                costs[key]= seconds;
+        }
+
+        static unsigned magnitude(uint64_t v)
+        {
+            unsigned n= 0;
+            while(v) v>>= 1, n++;
+            return n;
+        }
 };
 
 class LineRecvQ
 {
 	public:
-		// todo: figure out how to use move semantics
 		deque<string> nextLines(const string& str)
 		{
 			deque<string> lineQueue;
@@ -66,7 +224,7 @@ class LineRecvQ
 				readbuf+= *it;
 				if(*it=='\n')
 				{
-					lineQueue.push_back(readbuf);
+					lineQueue.push_back(std::move(readbuf));
 					readbuf.clear();
 				}
 			}
@@ -93,23 +251,34 @@ class LineRecvQ
 class CoreInstance: public NonblockWriter
 {
     public:
-        string linebuf;     // data read from core gets buffered here.
+        string linebuf;     // incomplete status line read from core gets buffered here.
 		LineRecvQ stderrQ;	// data read from core stderr gets buffered here.
 
         CoreInstance(uint32_t _id, const string& _corePath):
-            instanceID(_id), lastClientID(0), expectingReply(false), expectingDataset(false), corePath(_corePath),
-            processRunning(false)
+            primaryID(0), instanceID(_id), commandQ(FAIRQ_QUANTUM), sendingClientID(0), commandSendTime(0), orderedQueued(0), orderedSent(0),
+            scheduling(SCHED_FAIR), resultCache(NULL), cacheGraphID(0), runningInvalidatesCache(false), capturing(false),
+            lastClientID(0), replyDiscarded(false), expectingReply(false), expectingDataset(false), datasetLineBlank(true),
+            corePath(_corePath), processRunning(false), bareNewlines(false)
         {
+            readEvent= stderrReadEvent= writeEvent= NULL;
             pipeToCore[0]= pipeToCore[1]= -1;
             pipeFromCore[0]= pipeFromCore[1]= -1;
             pipeFromCoreStderr[0]= pipeFromCoreStderr[1]= -1;
+            outputWaiting= false;
+#ifdef USE_SPLICE
+            relayPipe[0]= relayPipe[1]= -1;
+#endif
         }
 
         virtual ~CoreInstance()
         {
+            commandQ.forEach(CommandQEntry::recycle);
             close(pipeToCore[1]);
             close(pipeFromCore[0]);
             close(pipeFromCoreStderr[0]);
+#ifdef USE_SPLICE
+            if(relayPipe[0]>=0) close(relayPipe[0]), close(relayPipe[1]);
+#endif
         }
 
         void writeFailed(int _errno)
@@ -205,6 +374,7 @@ class CoreInstance: public NonblockWriter
                 fprintf(toCore, "protocol-version\n");
                 if(fgets(line, 1024, fromCore))
                 {
+                    bareNewlines= !strchr(line, '\r');
                     chomp(line);
                     // check that the protocol-version command succeeded.
                     if(strncmp(SUCCESS_STR, line, strlen(SUCCESS_STR))!=0)
@@ -266,39 +436,156 @@ class CoreInstance: public NonblockWriter
         // find *last* command for this client in queue
         CommandQEntry *findLastClientCommand(uint32_t clientID)
         {
-            for(commandQ_t::reverse_iterator it= commandQ.rbegin(); it!=commandQ.rend(); ++it)
-                if(it->clientID==clientID)
-                    return & (*it);
-            return 0;
+            return commandQ.last(clientID);
+        }
+
+        // write out as many commands from queue to core process as possible.
+        // clients take turns as commandQ decides. ordered commands are sent in the order they were queued.
+        // a data set is passed on as far as it has arrived. the chunks are moved into the write buffer, except for
+        // the last one while more data is expected, which is copied and reused.
+        // commands behind a data set which is not complete wait until it is.
+        void flushCommandQ()
+        {
+            auto eligible= [this] (CommandQEntry *ce) { return !ce->ordered || ce->orderSeq==orderedSent; };
+            // shortest expected job first: the command with the shortest expected run time goes first, less SJF_AGING
+            // seconds for every second it has waited, so long commands get their turn too.
+            double now= getTime();
+            auto urgency= [now] (CommandQEntry *ce) { return SJF_AGING*(now-ce->waitingSince) - ce->expectedCost; };
+            while( commandQ.size() && (!expectingReply) && (!expectingDataset) )
+            {
+                uint32_t id= sendingClientID;
+                if(!id)
+                    id= (scheduling==SCHED_SHORTEST? commandQ.best(urgency, eligible): commandQ.next(eligible));
+                if(!id)
+                    break;
+                CommandQEntry &c= *commandQ.front(id);
+                if(!c.sent)
+                {
+                    write(c.command);
+                    lastClientID= c.clientID;
+                    replyDiscarded= c.discardReply;
+                    c.sent= true;
+                    commandSendTime= now;
+                    runningCostKey= c.costKey;
+                    runningCacheKey= c.cacheKey;
+                    runningInvalidatesCache= c.invalidatesCache;
+                    capturing= (resultCache && c.cacheKey.size() && !c.discardReply);
+                    runningFlightKey= c.flightKey;
+                    runningFollowers.swap(c.followers);
+                    c.followers.clear();
+                    flights_t::iterator f= (c.flightKey.size()? flights.find(c.flightKey): flights.end());
+                    if(f!=flights.end() && f->second==&c) flights.erase(f);
+                    captureStatus.clear();
+                    captureData.clear();
+                    if(c.ordered) orderedSent++;
+                }
+                while(c.dataset.size()>1 || (c.dataset.size() && c.dataFinished))
+                {
+                    write(std::move(c.dataset.front()));
+                    c.dataset.pop_front();
+                }
+                if(c.dataset.size())
+                {
+                    write(c.dataset.front());
+                    c.dataset.front().clear();
+                }
+                if(!c.flushable())
+                {
+                    sendingClientID= id;
+                    break;
+                }
+                sendingClientID= 0;
+                expectingReply= true;
+                expectingDataset= false;
+                commandQ.pop(id);
+                CommandQEntry::recycle(&c);
+                if(commandQ.last(id)) commandQ.front(id)->waitingSince= now;
+            }
         }
 
-        // try writing out commands from queue to core process
-        void flushCommandQ(class Graphserv &app);
+        // append a line to the data set of a queued command and pass it on, if the command was already sent.
+        // returns true if the data set is complete. ce must not be used after that, it may have been removed from the queue.
+        bool appendToDataset(CommandQEntry *ce, const char *line, size_t len)
+        {
+            ce->appendToDataset(line, len);
+            bool finished= ce->dataFinished;
+            flushCommandQ();
+            return finished;
+        }
 
-        // queue a command for execution.
-        void queueCommand(string &cmd, uint32_t clientID, bool hasDataSet)
+        // queue a command for execution. the queue takes ce over and recycles it once it was sent and its
+        // data set is complete. the client's share of the core is proportional to weight.
+        CommandQEntry *queueCommand(CommandQEntry *ce, unsigned weight= 1)
         {
-            CommandQEntry ce;
-            ce.acceptsData= hasDataSet;
-            ce.dataFinished= false;
-            ce.clientID= clientID;
-            ce.command= cmd;
-            ce.sendBeginTime= getTime();
-            commandQ.push_back(ce);
+            if(ce->ordered) ce->orderSeq= orderedQueued++;
+            CommandCosts::shape(*ce, ce->costKey);
+            ce->expectedCost= max(costs.estimate(ce->costKey), 1e-6);
+            ce->waitingSince= getTime();
+            commandQ.push(ce->clientID, ce, weight);
+            if(ce->flightKey.size()) flights[ce->flightKey]= ce;
+            return ce;
         }
-        
-        void queueCommand(CommandQEntry *ce)
+
+        // run a read command together with an identical one which is queued, or which was sent and hasn't
+        // replied yet. returns true if the client was added to that command's followers; ce can be recycled then.
+        bool joinFlight(CommandQEntry *ce)
+        {
+            if(ce->flightKey.empty()) return false;
+            if(expectingReply && !replyDiscarded && ce->flightKey==runningFlightKey)
+                runningFollowers.push_back(ce->clientID);
+            else
+            {
+                flights_t::iterator it= flights.find(ce->flightKey);
+                if(it==flights.end()) return false;
+                it->second->followers.push_back(ce->clientID);
+            }
+            following[ce->clientID]++;
+            return true;
+        }
+
+        // the clients which were following the commands whose replies have finished since the last call.
+        // they are swapped into 'ids'.
+        void takeFinishedFollowers(vector<uint32_t>& ids)
+        {
+            ids.clear();
+            ids.swap(finishedFollowers);
+        }
+
+        // how the next command is picked from those the clients have queued.
+        void setScheduling(SchedulingMode mode) { scheduling= mode; }
+
+        // replies go into this cache, under the ID of the graph, which is the primary instance's.
+        void setResultCache(ResultCache *cache, uint32_t graphID)
         {
-            commandQ.push_back(*ce);
+            resultCache= cache;
+            cacheGraphID= graphID;
+        }
+
+        // true if the core is not busy with a command and has queued commands which flushCommandQ() can send.
+        bool commandsReady()
+        {
+            return commandQ.size() && !expectingReply && !expectingDataset;
         }
 
         // return the client which executed the last command; i. e. the client which current output from
-        // core will be sent to.
+        // core will be sent to. 0 if the output is discarded.
         uint32_t getLastClientID()
+        {
+            return (replyDiscarded? 0: lastClientID);
+        }
+
+        // the client which executed the last command, even if its output is discarded.
+        uint32_t getCommandClientID()
         {
             return lastClientID;
         }
 
+        // number of commands queued or running.
+        size_t outstandingCommands()
+        {
+            return commandQ.size() + (expectingReply || expectingDataset);
+        }
+
         // true if this core is running a command for this client or has a command for this client in its queue.
         bool hasDataForClient(uint32_t clientID)
         {
@@ -306,11 +593,24 @@ class CoreInstance: public NonblockWriter
 //                 lastClientID==clientID, expectingReply, expectingDataset, findLastClientCommand(clientID));
             return (lastClientID==clientID && 
                 (expectingReply||expectingDataset)) 
-                    || findLastClientCommand(clientID);
+                    || findLastClientCommand(clientID)
+                    || following.find(clientID)!=following.end();
         }
 
-        // handle a line of text which was sent from the core process.
-        void lineFromCore(string &line, class Graphserv &app);
+        // handle output of the core process, up to the end of one reply. returns the number of bytes used.
+        size_t dataFromCore(char *data, size_t size, class Graphserv &app);
+
+#ifdef USE_SPLICE
+        // true if the data set currently expected from the core can be moved straight to the client socket.
+        bool canRelayTo(class SessionContext *sc);
+
+        // move data set bytes from the core's stdout pipe to the client socket using splice().
+        ssize_t relayDataset(class SessionContext *sc);
+#endif
+
+        // set while the core's output is not read because the client it goes to is not keeping up:
+        // a relay is waiting for the client socket to become writable, or the client has too much output pending.
+        bool outputWaiting;
 
         // whether the process is running. false means it has not started yet or was terminated.
         bool isRunning() { return processRunning; }
@@ -326,6 +626,11 @@ class CoreInstance: public NonblockWriter
         
         event *readEvent, *stderrReadEvent, *writeEvent;
 
+        // read replicas: other core processes which serve the same graph. clients connect to the primary
+        // instance, which has the list of its replicas. replicas know their primary.
+        vector<uint32_t> replicaIDs;
+        uint32_t primaryID;     // nonzero for replicas
+
     private:
         uint32_t instanceID;
         string lastError;
@@ -336,17 +641,104 @@ class CoreInstance: public NonblockWriter
         int pipeFromCore[2];    	// writable from core (core's stdout)
         int pipeFromCoreStderr[2];  // writable from core (core's stderr)
 
-        typedef deque<CommandQEntry> commandQ_t;
+        // commands of each client in order. clients are charged the time the core spends on their commands.
+        typedef FairQueue<CommandQEntry*> commandQ_t;
         commandQ_t commandQ;
+        uint32_t sendingClientID;   // client whose command was sent while its data set is still arriving
+        double commandSendTime;     // when the current command was sent
+        uint64_t orderedQueued, orderedSent;    // ordered commands queued and sent so far
+        SchedulingMode scheduling;
+        CommandCosts costs;         // learned from the commands this core has run
+        string runningCostKey;      // shape of the current command
+
+        ResultCache *resultCache;
+        uint32_t cacheGraphID;
+        string runningCacheKey;     // of the current command
+        bool runningInvalidatesCache;
+        bool capturing;             // the reply is copied, to go into the result cache
+        string captureStatus, captureData;
+
+        // single flight: queued read commands by key, the key and followers of the current command, and how many
+        // commands each client is following.
+        typedef unordered_map<string,CommandQEntry*> flights_t;
+        flights_t flights;
+        string runningFlightKey;
+        vector<uint32_t> runningFollowers;
+        vector<uint32_t> finishedFollowers;
+        unordered_map<uint32_t,unsigned> following;
+
+        // copy a part of the reply while it is cacheable.
+        void captureReply(const char *data, size_t size)
+        {
+            if(!capturing) return;
+            if(captureData.size()+size>RESULT_CACHE_MAX_ENTRY)
+            {
+                capturing= false;
+                captureData.clear();
+                return;
+            }
+            captureData.append(data, size);
+        }
+
+        // the reply to the current command is complete. the client is charged the time it took,
+        // which also goes into the estimates for commands of its shape. the result cache is updated.
+        void replyFinished()
+        {
+            double t= getTime()-commandSendTime;
+            commandQ.charge(lastClientID, t);
+            costs.update(runningCostKey, t);
+            if(capturing)
+                resultCache->insert(runningCacheKey, captureStatus, captureData);
+            if(resultCache && runningInvalidatesCache)
+                resultCache->invalidate(cacheGraphID);
+            capturing= false;
+            for(uint32_t id: runningFollowers)
+            {
+                unordered_map<uint32_t,unsigned>::iterator it= following.find(id);
+                if(it!=following.end() && !--it->second) following.erase(it);
+            }
+            finishedFollowers.insert(finishedFollowers.end(), runningFollowers.begin(), runningFollowers.end());
+            runningFollowers.clear();
+            runningFlightKey.clear();
+        }
 
         uint32_t lastClientID;  // ID of client who executed the last command. ie: client who should receive output
+        bool replyDiscarded;    // the last command was a replica's copy, its output goes nowhere
 
         bool expectingReply;    // currently expecting a status reply from core (ok/failure/error)
         bool expectingDataset;  //          ''         a data set from core
+        bool datasetLineBlank;      // the data set line received so far is empty or has only blanks
+
+        // find the end of a data set in core output: a line which is empty or has only spaces, tabs or CRs.
+        // returns the number of bytes up to and including its newline, or 0 if the data set goes on.
+        size_t datasetEnd(const char *data, size_t size)
+        {
+            const char *p= data, *end= data+size;
+            while(p<end)
+            {
+                if(datasetLineBlank)
+                {
+                    while(p<end && (*p==' ' || *p=='\t' || *p=='\r')) p++;
+                    if(p==end) return 0;
+                    if(*p=='\n') return p+1-data;
+                    datasetLineBlank= false;
+                }
+                const char *nl= (const char*)memchr(p, '\n', end-p);
+                if(!nl) return 0;
+                p= nl+1;
+                datasetLineBlank= true;
+            }
+            return 0;
+        }
 
         string corePath;
 
         bool processRunning;
+        bool bareNewlines;      // the core's lines end with '\n' alone, so its data sets can be relayed as they are
+
+#ifdef USE_SPLICE
+        int relayPipe[2];       // core output is tee()d here so the end of a relayed data set can be found
+#endif
 
         friend class ccInfo;
         friend class ccShutdown;
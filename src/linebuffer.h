@@ -0,0 +1,105 @@
+// Graph Processor server component.
+// (c) Wikimedia Deutschland, written by Johannes Kroll in 2011, 2012
+// buffered line input.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LINEBUFFER_H
+#define LINEBUFFER_H
+
+// splits input from a non-blocking fd into lines.
+// data is read in large chunks into a scratch buffer shared by all LineBuffers. complete lines are
+// handed to the caller as (pointer, length) ranges directly from that buffer. only an incomplete
+// line at the end of a chunk is copied and kept in the LineBuffer until its newline arrives,
+// so idle connections cost next to nothing.
+class LineBuffer
+{
+    public:
+        enum { READSIZE= 64*1024 };
+
+        // read one chunk from fd and call fn(char *line, size_t length) for each complete line.
+        // lines include the terminating newline, carriage returns are removed.
+        // fn returns false to stop processing; the rest of the chunk is then discarded.
+        // returns the result of read(): 0 on EOF, <0 on error.
+        template<typename Fn> ssize_t readLines(int fd, Fn fn)
+        {
+            char *buf= scratchBuffer();
+            ssize_t sz= ::read(fd, buf, READSIZE);
+            if(sz>0) splitLines(buf, sz, fn);
+            return sz;
+        }
+
+        // split a chunk of data into lines, see readLines(). 'data' is modified in place.
+        template<typename Fn> void splitLines(char *data, size_t size, Fn fn)
+        {
+            char *p= data, *end= data+size;
+            if(!partial.empty())
+            {
+                char *nl= (char*)memchr(p, '\n', end-p);
+                if(!nl)
+                {
+                    partial.append(p, end-p);
+                    return;
+                }
+                partial.append(p, nl+1-p);
+                p= nl+1;
+                partial.resize(stripCR(&partial[0], partial.size()));
+                bool cont= fn(&partial[0], partial.size());
+                partial.clear();
+                if(!cont) return;
+            }
+            while(p<end)
+            {
+                char *nl= (char*)memchr(p, '\n', end-p);
+                if(!nl)
+                {
+                    partial.assign(p, end-p);
+                    return;
+                }
+                char *line= p;
+                p= nl+1;
+                if(!fn(line, stripCR(line, p-line)))
+                    return;
+            }
+        }
+
+        // number of bytes buffered (incomplete line).
+        size_t size() { return partial.size(); }
+
+        void clear() { partial.clear(); }
+
+        // remove carriage returns in place (someone is feeding us DOS newlines?). returns new length.
+        static size_t stripCR(char *s, size_t len)
+        {
+            char *cr= (char*)memchr(s, '\r', len);
+            if(!cr) return len;
+            char *out= cr;
+            for(char *in= cr; in<s+len; in++)
+                if(*in!='\r') *out++= *in;
+            return out-s;
+        }
+
+    private:
+        string partial;     // incomplete line from the end of the last chunk
+
+        // the shared read buffer. only used from the main thread, shards read into their own buffers.
+        static char *scratchBuffer()
+        {
+            static char buf[READSIZE];
+            return buf;
+        }
+};
+
+
+#endif // LINEBUFFER_H
@@ -20,6 +20,7 @@
 #include <vector>
 #include <queue>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <fcntl.h>
 #include <string>
@@ -27,6 +28,10 @@
 #include <cstdio>
 #include <stdarg.h>
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <atomic>
 #include <errno.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -34,10 +39,16 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <limits.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <exception>
@@ -48,8 +59,11 @@
 #include "clibase.h"
 #include "const.h"
 #include "utils.h"
+#include "linebuffer.h"
+#include "uring.h"
 #include "auth.h"
 #include "coreinstance.h"
+#include "shard.h"
 #include "session.h"
 #include "servcli.h"
 #include "servapp.h"
@@ -65,57 +79,167 @@
 
 /////////////////////////////////////////// CoreInstance ///////////////////////////////////////////
 
-// handle a line of text arriving from a core.
-void CoreInstance::lineFromCore(string &line, class Graphserv &app)
+// handle output arriving from a core, up to the end of one reply.
+// status lines are collected and forwarded line by line. data sets are forwarded in whole chunks;
+// the only thing looked for is the blank line which terminates the data set, see datasetEnd().
+// the clients following the command get the same output, each session adds its own headers.
+// returns the number of bytes used.
+size_t CoreInstance::dataFromCore(char *data, size_t size, class Graphserv &app)
 {
-    SessionContext *sc= app.findClient(lastClientID);
-    // check state and forward status line or data set to client.
+    SessionContext *sc= app.findClient(getLastClientID());
+    if(expectingDataset)
+    {
+        size_t end= datasetEnd(data, size);
+        bool term= (end!=0);
+        size_t len= (term? end: size);
+        captureReply(data, len);
+        if(term)
+            expectingDataset= false;        // save flag to determine when a command is finished.
+        auto forward= [&] (SessionContext *s)
+        {
+            s->forwardDatasetChunk(data, len, term);    // virtual function does http-specific stuff, if any
+            if(term) s->setCorked(false);
+        };
+        if(sc) forward(sc);
+        for(uint32_t id: runningFollowers)
+            if(SessionContext *f= app.findClient(id)) forward(f);
+        if(term)
+            replyFinished();
+        return len;
+    }
+
+    char *nl= (char*)memchr(data, '\n', size);
+    if(!nl)
+    {
+        linebuf.append(data, size);
+        return size;
+    }
+    size_t len= nl+1-data;
+    linebuf.append(data, len);
+
+    // check state and forward status line to client.
     if(expectingReply)
     {
         expectingReply= false;
-        if(lineIndicatesDataset(line))
-            expectingDataset= true;         // save flag to determine when a command is finished.
+        CommandTokens reply;
+        reply.parse(linebuf);
+        if(reply.dataset)
+            expectingDataset= true,         // save flag to determine when a command is finished.
+            datasetLineBlank= true;
+        if(capturing)
+        {
+            // only successful replies are cached.
+            CommandStatus status= (reply.nwords? getStatusCode(reply.word(linebuf, 0)): CMD_FAILURE);
+            if(status==CMD_SUCCESS || status==CMD_NONE) captureStatus= linebuf;
+            else capturing= false;
+        }
         if(sc)
         {
             if(logMask&(1<<LOG_INFO))
             {
-                vector<string> words= Cli::splitString(line.c_str());
-                if(words.size() && getStatusCode(words[0])!=CMD_SUCCESS)
-                    flog(LOG_INFO, "core '%s', pid %d: status: %s", name.c_str(), pid, line.c_str());
+                if(reply.nwords && getStatusCode(reply.word(linebuf, 0))!=CMD_SUCCESS)
+                    flog(LOG_INFO, "core '%s', pid %d: status: %s", name.c_str(), pid, linebuf.c_str());
             }
-            sc->forwardStatusline(line);    // virtual fn does http-specific stuff
+            if(expectingDataset) sc->setCorked(true);
+            sc->forwardStatusline(linebuf);    // virtual fn does http-specific stuff
         }
-    }
-    else if(expectingDataset)
-    {
-        if(Cli::splitString(line.c_str()).size()==0)
-            expectingDataset= false;        // save flag to determine when a command is finished.
-        if(sc)
-            sc->forwardDataset(line);       // virtual function does http-specific stuff, if any
+        for(uint32_t id: runningFollowers)
+            if(SessionContext *f= app.findClient(id))
+            {
+                if(expectingDataset) f->setCorked(true);
+                f->forwardStatusline(linebuf);
+            }
+        if(!reply.dataset)
+            replyFinished();
     }
     else
     {
         // a core sent data we didn't ask for. this shouldn't happen.
-        if(app.findClient(lastClientID))
-            flog(LOG_ERROR, _("CoreInstance '%s', ID %u: lineFromCore(): not expecting anything from this core\n"), getName().c_str(), getID());
+        if(sc)
+            flog(LOG_ERROR, _("CoreInstance '%s', ID %u: dataFromCore(): not expecting anything from this core\n"), getName().c_str(), getID());
     }
+    linebuf.clear();
+    return len;
+}
+
+#ifdef USE_SPLICE
+// true if the data set currently expected from the core can be moved straight to the client socket.
+// this is the case for plain TCP sessions with nothing else buffered, unless the reply goes into the result cache
+// or to other clients too. cores which send CRs are not relayed: the line path strips them.
+bool CoreInstance::canRelayTo(SessionContext *sc)
+{
+    return expectingDataset && bareNewlines && sc && sc->connectionType==CONN_TCP && !sc->shard && sc->writeBufferEmpty() &&
+           !capturing && runningFollowers.empty();
 }
 
-// write out as many commands from queue to core process as possible.
-void CoreInstance::flushCommandQ(class Graphserv &app)
+// move data set bytes waiting in the core's stdout pipe to the client socket, without copying them through
+// user space. everything in the pipe belongs to the current data set: the next command is only sent to the
+// core once the data set is finished. so the only thing to look for is the terminating blank line, which is
+// always at the very end of the data. the data is tee()d to a second pipe from which only the last bytes
+// relayed are read, the rest is discarded.
+// returns the result of tee(): 0 if the core has exited, <0 on error.
+ssize_t CoreInstance::relayDataset(SessionContext *sc)
 {
-    while( commandQ.size() && (!expectingReply) && (!expectingDataset) && commandQ.front().flushable() )
+    static int devnull= open("/dev/null", O_WRONLY|O_CLOEXEC);
+    if(relayPipe[0]<0 && pipe2(relayPipe, O_CLOEXEC|O_NONBLOCK)<0)
+    {
+        logerror("pipe2");
+        return -1;
+    }
+    auto discard= [this] (size_t n)
+    {
+        while(n)
+        {
+            ssize_t sz= splice(relayPipe[0], NULL, devnull, NULL, n, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if(sz<=0) { logerror("splice"); break; }
+            n-= sz;
+        }
+    };
+
+    ssize_t avail= tee(pipeFromCore[0], relayPipe[1], RELAY_CHUNKSIZE, SPLICE_F_NONBLOCK);
+    if(avail<=0)
+        return avail;
+
+    ssize_t moved= splice(pipeFromCore[0], NULL, sc->sockfd, NULL, avail, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if(moved<0)
     {
-        CommandQEntry &c= commandQ.front();
-        write(c.command);
-        for(deque<string>::iterator it= c.dataset.begin(); it!=c.dataset.end(); ++it)
-            write(*it);
-        lastClientID= c.clientID;
-        expectingReply= true;
-        expectingDataset= false;
-        commandQ.pop_front();
+        if(errno==EAGAIN)
+            outputWaiting= true;    // client socket is full.
+        else
+            sc->writeFailed(errno);
+        moved= 0;
     }
+    else if(moved<avail)
+        outputWaiting= true;
+    NonblockWriter::stats().relayed+= moved;
+
+    if(moved)
+    {
+        // the end of the data set is looked for in the last bytes relayed, by the same rule as in dataFromCore().
+        // if more was relayed, the scan starts at the first line beginning in them, so a terminating line of more
+        // than RELAY_TAILSIZE blanks would be missed.
+        char tail[RELAY_TAILSIZE];
+        ssize_t ntail= min(moved, (ssize_t)sizeof(tail));
+        discard(moved-ntail);
+        if(read(relayPipe[0], tail, ntail)!=ntail)
+            logerror("read");
+        const char *p= tail;
+        if(ntail<moved)
+        {
+            const char *nl= (const char*)memchr(tail, '\n', ntail);
+            p= (nl? nl+1: tail+ntail);
+            datasetLineBlank= (nl!=NULL);
+        }
+        if(datasetEnd(p, tail+ntail-p))
+            expectingDataset= false,
+            sc->setCorked(false),
+            replyFinished();
+    }
+    discard(avail-moved);
+
+    return avail;
 }
+#endif
 
 
 
@@ -135,7 +259,15 @@ bool SessionContext::isWaitingForCoreReply()
     if(curCommand) return true;
     CoreInstance *instance= app.findInstance(coreID);
     if(!instance) return false;
-    return instance->hasDataForClient(clientID);
+    return app.coreHasDataForClient(instance, clientID);
+}
+
+// mark the client to be disconnected once its output is sent.
+void HTTPSessionContext::finishConversation()
+{
+    if(conversationFinished) return;
+    conversationFinished= true;
+    app.conversationFinished(clientID);
 }
 
 // forward statusline to http client, possibly mark client to be disconnected
@@ -147,8 +279,9 @@ void HTTPSessionContext::forwardStatusline(const string& line)
         SessionContext::forwardStatusline(line);
         return;
     }
-    vector<string> replyWords= Cli::splitString(line.c_str());
-    if(replyWords.empty())
+    CommandTokens reply;
+    reply.parse(line);
+    if(!reply.nwords)
     {
         // this shouldn't happen.
         httpWriteErrorResponse(500, "Internal Server Error", _("Received empty status line from core. Please report."));
@@ -156,10 +289,10 @@ void HTTPSessionContext::forwardStatusline(const string& line)
     }
     else
     {
-        bool hasDataset= lineIndicatesDataset(line);
+        bool hasDataset= reply.dataset;
         string headerStatusLine= "X-GraphProcessor: " + line;
 
-        switch(getStatusCode(replyWords[0]))
+        switch(getStatusCode(reply.word(line, 0)))
         {
             case CMD_SUCCESS:
                 httpWriteResponseHeader(200, "OK", "text/plain", headerStatusLine);
@@ -189,7 +322,7 @@ void HTTPSessionContext::forwardStatusline(const string& line)
         // if there's nothing left to forward, mark client to be disconnected.
         if(!hasDataset)
             flog(LOG_INFO, _("client %d: conversation finished.\n"), clientID),
-            conversationFinished= true;
+            finishConversation();
     }
 }
 
@@ -271,15 +404,16 @@ class ccCreateGraph: public ServCmd_RTVoid
 {
     public:
         string getName() { return "create-graph"; }
-        string getSynopsis() { return getName() + " GRAPHNAME"; }
+        string getSynopsis() { return getName() + " GRAPHNAME [REPLICAS]"; }
         string getHelpText() { return _("create a named graphcore instance.\n"
                                         "# graph names may contain only alphabetic characters (a-z A-Z), digits (0-9), hyphens (-) and underscores (_).\n"
-                                        "# graph names must start with an alphabetic character, a hyphen or an underscore."); }
+                                        "# graph names must start with an alphabetic character, a hyphen or an underscore.\n"
+                                        "# REPLICAS additional instances serve read commands. all instances run every other command."); }
         AccessLevel getAccessLevel() { return ACCESS_ADMIN; }
 
         CommandStatus execute(vector<string> words, class Graphserv &app, class SessionContext &sc)
         {
-            if(words.size()!=2)
+            if(words.size()!=2 && words.size()!=3)
             {
                 syntaxError();
                 return CMD_FAILURE;
@@ -289,13 +423,47 @@ class ccCreateGraph: public ServCmd_RTVoid
                 cliFailure("invalid graph name.\n");
                 return CMD_FAILURE;
             }
-            // check whether named instance already exists, try spawning core instance, return.
+            unsigned nreplicas= 0;
+            if(words.size()==3)
+            {
+                if(!Cli::isValidUint(words[2]) || (nreplicas= atoi(words[2].c_str()))>MAX_GRAPH_REPLICAS)
+                {
+                    cliFailure(_("number of replicas must be between 0 and %d.\n"), MAX_GRAPH_REPLICAS);
+                    return CMD_FAILURE;
+                }
+            }
+            // check whether named instance already exists, try spawning core instances, return.
             if(app.findNamedInstance(words[1])) { cliFailure(_("an instance with this name already exists.\n")); return CMD_FAILURE; }
-            CoreInstance *core= app.createCoreInstance(words[1]);
-            if(!core) { cliFailure(_("Graphserv::createCoreInstance() failed.\n")); return CMD_FAILURE; }
-            if(!core->startCore()) { cliFailure("startCore(): %s\n", core->getLastError().c_str()); return CMD_FAILURE; }
-            app.addCoreInstance(core);
-            cliSuccess(_("spawned pid %d.\n"), (int)core->getPid());
+            vector<CoreInstance*> cores;
+            // if any instance can't be created or started, the ones already started are terminated
+            // and removed by the main loop, the others are removed right away.
+            auto fail= [&] (size_t nstarted)
+            {
+                for(size_t i= cores.size(); i-->0; )
+                    if(i<nstarted) cores[i]->terminate();
+                    else app.removeCoreInstance(cores[i]);
+                return CMD_FAILURE;
+            };
+            for(unsigned i= 0; i<=nreplicas; i++)
+            {
+                CoreInstance *ci= app.createCoreInstance(words[1], i? cores[0]: NULL);
+                if(!ci) { cliFailure(_("Graphserv::createCoreInstance() failed.\n")); return fail(0); }
+                cores.push_back(ci);
+            }
+            for(size_t i= 0; i<cores.size(); i++)
+            {
+                if(!cores[i]->startCore())
+                {
+                    cliFailure("startCore(): %s\n", cores[i]->getLastError().c_str());
+                    return fail(i);
+                }
+                app.addCoreInstance(cores[i]);
+            }
+            CoreInstance *core= cores[0];
+            if(nreplicas)
+                cliSuccess(_("spawned pid %d and %u replicas.\n"), (int)core->getPid(), nreplicas);
+            else
+                cliSuccess(_("spawned pid %d.\n"), (int)core->getPid());
             return CMD_SUCCESS;
         }
 
@@ -352,6 +520,11 @@ class ccDropGraph: public ServCmd_RTVoid
                 cliFailure(_("couldn't kill the process. %s\n"), strerror(errno));
                 return CMD_FAILURE;
             }
+            for(uint32_t id: core->replicaIDs)
+            {
+                CoreInstance *r= app.findInstance(id);
+                if(r) r->terminate();
+            }
             flog(LOG_INFO, _("client %u killed core with ID %u, pid %d.\n"), sc.clientID, core->getID(), (int)core->getPid());
             cliSuccess(_("killed core with ID %u, pid %d.\n"), core->getID(), (int)core->getPid());
 //  we shouldn't block here, waiting for the child is done in the select loop.
@@ -381,10 +554,9 @@ class ccListGraphs: public ServCmd_RTOther
             }
             cliSuccess(_("running graphs:\n"));
             sc.forwardStatusline(lastStatusMessage);
-            map<uint32_t,CoreInstance*>& cores= app.getCoreInstances();
-            for(map<uint32_t,CoreInstance*>::iterator it= cores.begin(); it!=cores.end(); ++it)
-                if(it->second->isRunning())
-                    sc.forwardDataset(it->second->getName() + "\n");
+            for(CoreInstance *ci: app.getCoreInstances())
+                if(ci->isRunning() && !ci->primaryID)
+                    sc.forwardDataset(ci->getName() + "\n");
             sc.forwardDataset("\n");
             return CMD_SUCCESS;
         }
@@ -413,6 +585,16 @@ class ccSessionInfo: public ServCmd_RTOther
             // prints minimal info. might print some session statistics (avg lines queued, etc).
             sc.forwardDataset(format("ConnectedGraph,%s\n", ci? ci->getName().c_str(): "None").c_str());
             sc.forwardDataset(format("AccessLevel,%s\n", gAccessLevelNames[sc.accessLevel]).c_str());
+            sc.forwardDataset(format("OutputPending,%zu\n", sc.pendingOutput()).c_str());
+            sc.forwardDataset(format("OutputPendingPeak,%zu\n", sc.outputPeak).c_str());
+            sc.forwardDataset(format("OutputThrottled,%u\n", sc.outputThrottled).c_str());
+            sc.forwardDataset(format("OutputSpilled,%zu\n", sc.getSpillSize()).c_str());
+            sc.forwardDataset(format("QueuedLines,%zu\n", sc.lineQueue.size()).c_str());
+            sc.forwardDataset(format("QueuedBytes,%zu\n", sc.lineQueueBytes).c_str());
+            sc.forwardDataset(format("QueuedLinesPeak,%zu\n", sc.lineQueuePeak).c_str());
+            sc.forwardDataset(format("InputPaused,%u\n", sc.inputPauses).c_str());
+            sc.forwardDataset(format("FloodWaits,%u\n", sc.floodWaits).c_str());
+            sc.forwardDataset(format("FloodWaitTime,%.3f\n", sc.floodWaitTime).c_str());
             sc.forwardDataset("\n");
             return CMD_SUCCESS;
         }
@@ -438,13 +620,26 @@ class ccServerStats: public ServCmd_RTOther
             cliSuccess(_("server info:\n"));
             sc.forwardStatusline(lastStatusMessage);
             // this currently just outputs the minimal info: number of cores. should return more useful info.
-            map<uint32_t,CoreInstance*>& cores= app.getCoreInstances();
             size_t runningCores= 0;
-            for(map<uint32_t,CoreInstance*>::iterator it= cores.begin(); it!=cores.end(); ++it)
-                if(it->second->isRunning())
+            for(CoreInstance *ci: app.getCoreInstances())
+                if(ci->isRunning())
                     runningCores++;
             sc.forwardDataset(format("NCores,%zu\n", runningCores));
             sc.forwardDataset(format("TotalLinesFromClients,%u\n", app.linesFromClients));
+            NonblockWriter::Stats &ws= NonblockWriter::stats();
+            sc.forwardDataset(format("WriteCalls,%llu\n", (unsigned long long)ws.writes));
+            sc.forwardDataset(format("WriteSyscalls,%llu\n", (unsigned long long)ws.syscalls));
+            sc.forwardDataset(format("SpilledBytes,%llu\n", (unsigned long long)ws.spilled));
+            sc.forwardDataset(format("RelayedBytes,%llu\n", (unsigned long long)ws.relayed));
+            ResultCache &rc= app.getResultCache();
+            uint64_t lookups= rc.stats.hits + rc.stats.misses;
+            sc.forwardDataset(format("ResultCacheHits,%llu\n", (unsigned long long)rc.stats.hits));
+            sc.forwardDataset(format("ResultCacheMisses,%llu\n", (unsigned long long)rc.stats.misses));
+            sc.forwardDataset(format("ResultCacheHitRatio,%.3f\n", lookups? double(rc.stats.hits)/lookups: 0.0));
+            sc.forwardDataset(format("ResultCacheBytesSaved,%llu\n", (unsigned long long)rc.stats.bytesSaved));
+            sc.forwardDataset(format("ResultCacheEntries,%zu\n", rc.size()));
+            sc.forwardDataset(format("ResultCacheBytes,%zu\n", rc.bytes()));
+            sc.forwardDataset(format("CoalescedCommands,%llu\n", (unsigned long long)app.coalescedCommands));
             sc.forwardDataset("\n");
             return CMD_SUCCESS;
         }
@@ -475,12 +670,13 @@ class ccAuthorize: public ServCmd_RTVoid
                 return CMD_FAILURE;
             }
             AccessLevel newAccessLevel;
-            if(!auth->authorize(words[2], newAccessLevel))
+            string user;
+            if(!auth->authorize(words[2], newAccessLevel, user))
             {
                 cliFailure(_("authorization failure.\n"));
                 return CMD_FAILURE;
             }
-            sc.accessLevel= newAccessLevel;
+            app.setAccessLevel(sc, newAccessLevel, user);
             cliSuccess(_("access level: %s\n"), gAccessLevelNames[sc.accessLevel]);
             return CMD_SUCCESS;
         }
@@ -532,11 +728,12 @@ class ccInfo: public ServCmd_RTOther
 
             sc.writef("Cores: %d\n", app.coreInstances.size());
 
-            for(map<uint32_t,CoreInstance*>::iterator it= app.coreInstances.begin(); it!=app.coreInstances.end(); ++it)
+            for(CoreInstance *ci: app.coreInstances)
             {
-                CoreInstance *ci= it->second;
                 sc.writef("Core %d:\n", ci->getID());
                 sc.writef("  running: %s\n", ci->isRunning()? "true": "false");
+                if(ci->primaryID) sc.writef("  replica of: %u\n", ci->primaryID);
+                if(ci->replicaIDs.size()) sc.writef("  replicas: %zu\n", ci->replicaIDs.size());
                 sc.writef("  queue size: %u\n", ci->commandQ.size());
                 sc.writef("  bytes in write buffer: %u\n", ci->getWritebufferSize());
                 sc.writef("  expectingReply: %s\n", ci->expectingReply? "true": "false");
@@ -544,9 +741,8 @@ class ccInfo: public ServCmd_RTOther
                 sc.writef("\n");
             }
 
-            for(map<uint32_t,SessionContext*>::iterator it= app.sessionContexts.begin(); it!=app.sessionContexts.end(); ++it)
+            for(SessionContext *ci: app.sessionContexts)
             {
-                SessionContext *ci= it->second;
                 sc.writef("Session ID %d:\n", ci->clientID);
                 sc.writef("  accessLevel: %s\n", gAccessLevelNames[ci->accessLevel]);
                 sc.writef("  connectionType: %s\n", ci->connectionType==CONN_TCP? "TCP": "HTTP");
@@ -632,7 +828,7 @@ class ccHelp: public ServCmd_RTOther
                         line+= " ";
                     line+= "\n";
 #ifndef NOSESSIONCONTEXTBUFFER
-                    app.forwardToCore(new CommandQEntry(sc.clientID, line), sc);
+                    app.forwardToCore(CommandQEntry::create(sc.clientID, line), sc);
 #else
                     app.sendCoreCommand(sc, line, false, &words);
 #endif
@@ -659,7 +855,7 @@ class ccHelp: public ServCmd_RTOther
                         line+= " ";
                     line+= "\n";
 #ifndef NOSESSIONCONTEXTBUFFER
-                    app.forwardToCore(new CommandQEntry(sc.clientID, line), sc);
+                    app.forwardToCore(CommandQEntry::create(sc.clientID, line), sc);
 #else
                     app.sendCoreCommand(sc, line, false, &words);
 #endif
@@ -744,10 +940,16 @@ class ccShutdown: public ServCmd_RTVoid
             // send the command to the core, mark the core as no longer running.
             // the client will still receive the reply from the core.
 #ifndef NOSESSIONCONTEXTBUFFER
-            app.forwardToCore(new CommandQEntry(sc.clientID, "shutdown\n"), sc);
+            app.forwardToCore(CommandQEntry::create(sc.clientID, "shutdown\n", 9), sc);
 #else
             app.sendCoreCommand(sc, "shutdown\n", false);
 #endif
+            // replicas were sent the command too.
+            for(uint32_t id: ci->replicaIDs)
+            {
+                CoreInstance *r= app.findInstance(id);
+                if(r) r->processRunning= false;
+            }
             ci->processRunning= false;
 
             return CMD_SUCCESS;
@@ -795,6 +997,25 @@ static void printHelp(const char *comm= "graphserv")
            "    -p FILENAME     set htpassword file name [" DEFAULT_HTPASSWD_FILENAME "]\n"
            "    -g FILENAME     set group file name [" DEFAULT_GROUP_FILENAME "]\n"
            "    -c FILENAME     set path of GraphCore binary [" DEFAULT_CORE_PATH "]\n"
+           "    -e              use the libevent main loop (default).\n"
+           "    -S              use the select() main loop. limited to FD_SETSIZE (" stringify(FD_SETSIZE) ") descriptors.\n"
+#ifdef USE_IO_URING
+           "    -u              use the io_uring main loop (linux 6.0 or later).\n"
+#endif
+           "    -w COUNT        do client socket i/o in COUNT worker threads (libevent main loop only) [0]\n"
+           "    -C              cork client sockets while data sets are sent, set TCP_NODELAY otherwise.\n"
+           "    -b HIGH[,LOW]   stop reading core output for a client with HIGH KiB of output pending, until it is below LOW KiB\n"
+           "                    [" stringify(DEFAULT_WRITEBUFFER_HIGH_KB) "," stringify(DEFAULT_WRITEBUFFER_LOW_KB) "]. LOW defaults to HIGH/4.\n"
+           "    -r LEVEL:LINES,BYTES,COMMANDS\n"
+           "                    flood control: lines, bytes and core commands per second a session with access level LEVEL\n"
+           "                    may send. a user's sessions together may send " stringify(FLOOD_USER_FACTOR) " times as much. zero for unlimited,\n"
+           "                    which is the default.\n"
+           "    -q MODE         how each core picks the next command from those its clients have queued:\n"
+           "                        fair: clients take turns, weighted by access level and connection type (default)\n"
+           "                        sjf: shortest expected command first, from the times of earlier commands of the\n"
+           "                             same kind. commands get more urgent as they wait.\n"
+           "    -R KB           cache replies to read commands in up to KB KiB [" stringify(DEFAULT_RESULT_CACHE_KB) "]. zero to disable.\n"
+           "    -s KB           spill client output beyond KB KiB to a temporary file instead of pausing the core [" stringify(DEFAULT_SPILL_THRESHOLD_KB) "]. zero to disable.\n"
            "    -l FLAGS        set logging flags.\n"
            "                        e: log error messages (default)\n"
            "                        i: log error and informational messages\n"
@@ -842,11 +1063,19 @@ int main(int argc, char *argv[])
     string htpwFilename= DEFAULT_HTPASSWD_FILENAME;
     string groupFilename= DEFAULT_GROUP_FILENAME;
     string corePath= DEFAULT_CORE_PATH;
-    bool useLibevent= false;
+    MainLoop mainLoop= MAINLOOP_LIBEVENT;
+    bool corkResponses= false;
+    int workerThreads= 0;
+    size_t writeHighWatermark= DEFAULT_WRITEBUFFER_HIGH_KB*1024;
+    size_t writeLowWatermark= DEFAULT_WRITEBUFFER_LOW_KB*1024;
+    size_t spillThreshold= DEFAULT_SPILL_THRESHOLD_KB*1024;
+    SchedulingMode scheduling= SCHED_FAIR;
+    size_t resultCacheBudget= DEFAULT_RESULT_CACHE_KB*1024;
+    FloodLimits floodLimits[]= { FLOOD_LIMITS_READ, FLOOD_LIMITS_WRITE, FLOOD_LIMITS_ADMIN };
 
     // parse the command line.
     char opt;
-    while( (opt= getopt(argc, argv, "ht:H:p:g:c:l:e"))!=-1 )
+    while( (opt= getopt(argc, argv, "ht:H:p:g:c:l:eSuw:Cb:s:r:q:R:"))!=-1 )
         switch(opt)
         {
             case '?':
@@ -892,8 +1121,69 @@ int main(int argc, char *argv[])
                 }
                 break;
             case 'e':
-                useLibevent= true;
+                mainLoop= MAINLOOP_LIBEVENT;
                 break;
+            case 'S':
+                mainLoop= MAINLOOP_SELECT;
+                break;
+#ifdef USE_IO_URING
+            case 'u':
+                mainLoop= MAINLOOP_URING;
+                break;
+#endif
+            case 'w':
+                workerThreads= cmdlnParseUint(optarg);
+                break;
+            case 'C':
+                corkResponses= true;
+                break;
+            case 'b':
+            {
+                char *comma= strchr(optarg, ',');
+                if(comma) *comma++= 0;
+                writeHighWatermark= size_t(cmdlnParseUint(optarg))*1024;
+                writeLowWatermark= (comma? size_t(cmdlnParseUint(comma))*1024: writeHighWatermark/4);
+                break;
+            }
+            case 's':
+                spillThreshold= size_t(cmdlnParseUint(optarg))*1024;
+                break;
+            case 'R':
+                resultCacheBudget= size_t(cmdlnParseUint(optarg))*1024;
+                break;
+            case 'q':
+                if(strcmp(optarg, "fair")==0)
+                    scheduling= SCHED_FAIR;
+                else if(strcmp(optarg, "sjf")==0)
+                    scheduling= SCHED_SHORTEST;
+                else
+                {
+                    printf(_("invalid argument -- '%s'\n"), optarg);
+                    printHelp(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'r':
+            {
+                char level[16];
+                FloodLimits l;
+                int i= ACCESS_ADMIN+1;
+                if(sscanf(optarg, "%15[a-z]:%lf,%lf,%lf", level, &l.lines, &l.bytes, &l.coreCommands)==4 &&
+                   l.lines>=0 && l.bytes>=0 && l.coreCommands>=0)
+                    for(i= ACCESS_READ; i<=ACCESS_ADMIN; i++)
+                        if(strcmp(level, gAccessLevelNames[i])==0)
+                        {
+                            floodLimits[i]= l;
+                            break;
+                        }
+                if(i>ACCESS_ADMIN)
+                {
+                    printf(_("invalid argument -- '%s'\n"), optarg);
+                    printHelp(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
         }
 
     if( !(tcpPort || httpPort) )
@@ -911,7 +1201,13 @@ int main(int argc, char *argv[])
 //    handleSigchld();
 
     // instantiate app and kick off main loop.
-    Graphserv s(tcpPort, httpPort, htpwFilename, groupFilename, corePath, useLibevent);
+    Graphserv s(tcpPort, httpPort, htpwFilename, groupFilename, corePath, mainLoop, corkResponses, workerThreads);
+    s.setWriteWatermarks(writeHighWatermark, writeLowWatermark);
+    s.setSpillThreshold(spillThreshold);
+    s.setScheduling(scheduling);
+    s.setResultCacheBudget(resultCacheBudget);
+    for(int i= ACCESS_READ; i<=ACCESS_ADMIN; i++)
+        s.setFloodLimits(AccessLevel(i), floodLimits[i]);
     if(!s.run()) return 1;  // exit with error.
 
     return 0;
@@ -22,12 +22,18 @@
 class Graphserv
 {
     public:
-        Graphserv(int tcpPort_, int httpPort_, const string& htpwFilename, const string& groupFilename, const string& corePath_, bool useLibevent_):
-            tcpPort(tcpPort_), httpPort(httpPort_), corePath(corePath_), useLibevent(useLibevent_),
-            coreIDCounter(0), sessionIDCounter(0),
-            cli(*this), linesFromClients(0), quit(false)
+        Graphserv(int tcpPort_, int httpPort_, const string& htpwFilename, const string& groupFilename, const string& corePath_, MainLoop mainLoop_,
+                  bool corkResponses_, int workerThreads_):
+            tcpPort(tcpPort_), httpPort(httpPort_), corePath(corePath_), mainLoop(mainLoop_), corkResponses(corkResponses_), workerThreads(workerThreads_), nextShard(0),
+            writeHighWatermark(DEFAULT_WRITEBUFFER_HIGH_KB*1024), writeLowWatermark(DEFAULT_WRITEBUFFER_LOW_KB*1024),
+            spillThreshold(DEFAULT_SPILL_THRESHOLD_KB*1024), scheduling(SCHED_FAIR), resultCache(DEFAULT_RESULT_CACHE_KB*1024), chokeTimerAt(0), statsRolloverTime(0),
+            tcpSessionPool(SESSION_POOL_SIZE), httpSessionPool(SESSION_POOL_SIZE),
+            cli(*this), linesFromClients(0), coalescedCommands(0), quit(false)
         {
             initCoreCommandTable();
+            FloodLimits defaultLimits[]= { FLOOD_LIMITS_READ, FLOOD_LIMITS_WRITE, FLOOD_LIMITS_ADMIN };
+            for(int i= ACCESS_READ; i<=ACCESS_ADMIN; i++)
+                floodLimits[i]= defaultLimits[i];
 
             Authority *auth= new PasswordAuth(htpwFilename, groupFilename);
             authorities.insert(pair<string,Authority*> (auth->getName(), auth));
@@ -39,13 +45,41 @@ class Graphserv
                 delete it->second;
             authorities.clear();
             
-            for(auto it= coreInstances.begin(); it!=coreInstances.end(); ++it)
-                delete it->second;
-            coreInstances.clear();
+            for(CoreInstance *ci: coreInstances)
+                delete ci;
             
-            for(auto it= sessionContexts.begin(); it!=sessionContexts.end(); ++it)
-                delete it->second;
-            sessionContexts.clear();
+            for(SessionContext *sc: sessionContexts)
+                delete sc;
+        }
+
+        // set the amount of pending client output at which reading from a core is paused, and where it is resumed.
+        void setWriteWatermarks(size_t high, size_t low)
+        {
+            writeHighWatermark= max(high, (size_t)1);
+            writeLowWatermark= min(low, writeHighWatermark);
+        }
+
+        // spill client output to a temporary file when more than this is waiting for the socket. 0 disables spilling.
+        void setSpillThreshold(size_t threshold)
+        {
+            spillThreshold= threshold;
+        }
+
+        // how cores created from now on pick the next command to run.
+        void setScheduling(SchedulingMode mode)
+        {
+            scheduling= mode;
+        }
+
+        // memory for cached replies to read commands. 0 disables the cache.
+        void setResultCacheBudget(size_t bytes)
+        {
+            resultCache.setBudget(bytes);
+        }
+
+        ResultCache& getResultCache()
+        {
+            return resultCache;
         }
 
         Authority *findAuthority(const string& name)
@@ -70,174 +104,187 @@ class Graphserv
                 return false;
             }
             
+            // lots of connections need lots of fds.
             struct rlimit rlim= { 0 };
             getrlimit(RLIMIT_NOFILE, &rlim);
+            if(rlim.rlim_cur<rlim.rlim_max)
+            {
+                rlim.rlim_cur= rlim.rlim_max;
+                if(setrlimit(RLIMIT_NOFILE, &rlim)<0) logerror("setrlimit");
+                getrlimit(RLIMIT_NOFILE, &rlim);
+            }
             flog(LOG_INFO, "RLIMIT_NOFILE: cur %ld, max %ld\n", long(rlim.rlim_cur), long(rlim.rlim_max));
             
             handleSigint();
+
+            if(workerThreads && mainLoop!=MAINLOOP_LIBEVENT)
+            {
+                flog(LOG_ERROR, _("worker threads need the libevent main loop. not starting any.\n"));
+                workerThreads= 0;
+            }
          
-            if(useLibevent)
-                return mainloop_libevent();
-            else
-                return mainloop_select();
+            switch(mainLoop)
+            {
+                case MAINLOOP_LIBEVENT: return mainloop_libevent();
+#ifdef USE_IO_URING
+                case MAINLOOP_URING:    return mainloop_uring();
+#endif
+                default:                return mainloop_select();
+            }
         }
         
         // called when a session socket is readable (level triggered)
-        template<ConnectionType CONNTYPE>
         void cb_sessionReadable(evutil_socket_t fd, short what)
         {
-            const size_t BUFSIZE= 128;
-            char buf[BUFSIZE];
-            SessionContext &sc= *libeventData.sessions[fd];
+            SessionContext &sc= *libeventData.sessions.find(fd);
             double time= getTime();
-            ssize_t sz= recv(fd, buf, sizeof(buf), 0);
-            auto closeSession= [this] (SessionContext& sc)
-            {
-                removeSession(sc.clientID);
-            };
+            ssize_t sz= readFromClient(sc, fd, time);
             if(sz==0)
             {
                 flog(LOG_INFO, _("client %d: connection closed%s.\n"), sc.clientID, sc.shutdownTime? "": _(" by peer"));
-                closeSession(sc);
+                removeSession(sc.clientID);
             }
             else if(sz<0)
             {
                 flog(LOG_ERROR, _("recv() error, client %d, %d bytes in write buffer, %s\n"), sc.clientID, sc.getWritebufferSize(), strerror(errno));
-                closeSession(sc);
-            }
-            else
-            {
-                for(ssize_t i= 0; i<sz; i++)
-                {
-                    char c= buf[i];
-                    if(c=='\r') continue;   // someone is feeding us DOS newlines?
-                    sc.linebuf+= c;
-                    if(c=='\n')
-                    {
-                        //~ flog(LOG_INFO, "line from client: %s", sc.linebuf.c_str());
-
-                        linesFromClients++;
-
-                        if(CONNTYPE==CONN_HTTP)
-                            lineFromHTTPClient(sc.linebuf, *(HTTPSessionContext*)&sc, time);
-                        else
-                            lineFromClient(string(sc.linebuf), sc, time);
-                        sc.linebuf.clear();
-                    }
-                }
+                removeSession(sc.clientID);
             }
         }
 
-        // called when a session socket is writable (edge triggered)
-        template<ConnectionType CONNTYPE>
+        // called when a session socket is writable (level triggered, only enabled while output is pending)
         void cb_sessionWritable(evutil_socket_t fd, short what)
         {
-            flog(LOG_INFO, "session context writable event\n");
-            libeventData.sessions[fd]->flush();
+            SessionContext *sc= libeventData.sessions.find(fd);
+            // the write event is also used to wait for a client which held up its core's output.
+            if(sc->flush())
+                event_del(sc->writeEvent);
+            if(sc->pendingOutput()<writeLowWatermark)
+                resumeCoreOutput(sc->clientID);
         }
         
-        // called when a core pipe is readable (level triggered)
-        
-        // XXXXXXXXXX todo: handle different CB types (all callbacks)
+        // called when a core's stdout or stderr pipe is readable (level triggered)
         void cb_coreReadable(evutil_socket_t fd, short what)
         {
-            CoreInstance *ci= libeventData.cores[fd];
+            CoreInstance *ci= libeventData.cores.find(fd);
             if(fd==ci->getReadFd())
             {
-                const size_t BUFSIZE= 128;
-                char buf[BUFSIZE];
-                ssize_t sz= read(ci->getReadFd(), buf, sizeof(buf));
-                double time= getTime();
-                if(sz==0)
-                {
-                    flog(LOG_INFO, "core %s (ID %u, pid %d) has exited\n", ci->getName().c_str(), ci->getID(), (int)ci->getPid());
-                    int status;
-                    waitpid(ci->getPid(), &status, 0);  // un-zombify
-                    //~ coresToRemove.push_back(ci);
-                    removeCoreInstance(ci);
-                }
-                else if(sz<0)
-                {
-                    flog(LOG_ERROR, "i/o error, core %s: %s\n", ci->getName().c_str(), strerror(errno));
-                    //~ coresToRemove.push_back(ci);
-                    removeCoreInstance(ci);
-                }
-                else
+                if(!coreReadable(ci))
+                    return;
+                if(ci->outputWaiting)
                 {
-                    for(ssize_t i= 0; i<sz; i++)
-                    {
-                        char c= buf[i];
-                        if(c=='\r') continue;
-                        ci->linebuf+= c;
-                        if(c=='\n')
-                        {
-                            SessionContext *sc= findClient(ci->getLastClientID());
-                            bool clientWasWaiting= (sc && sc->isWaitingForCoreReply());
-                            ci->lineFromCore(ci->linebuf, *this);
-                            ci->linebuf.clear();
-                            // if this was the last line the client was waiting for, 
-                            // execute its queued commands now.
-                            if( clientWasWaiting )
-                                while(!sc->lineQueue.empty() && (!sc->isWaitingForCoreReply()))
-                                {
-                                    string& line= sc->lineQueue.front();
-                                    flog(LOG_INFO, "execing queued line from client: '%s", line.c_str());
-                                    lineFromClient(line, *sc, time, true);
-                                    sc->lineQueue.pop();
-                                }
-                        }
-                    }
+                    // resumed when the client has drained its output. shards report that with a message.
+                    event_del(ci->readEvent);
+                    SessionContext *sc= findClient(ci->getLastClientID());
+                    if(sc && sc->writeEvent) event_add(sc->writeEvent, nullptr);
                 }
             }
             else if(fd==ci->getStderrReadFd())
-            {
-                deque<string> lines= ci->stderrQ.nextLines(ci->getStderrReadFd());
-                for(deque<string>::const_iterator it= lines.begin(); it!=lines.end(); ++it)
-                    flog(LOG_INFO, "[%s] %s", ci->getName().c_str(), it->c_str());
-            }
+                coreStderrReadable(ci);
         }
 
-        // called when a core pipe is writable (edge triggered)
+        // called when a core's stdin pipe is writable (level triggered, only enabled while output is pending)
         void cb_coreWritable(evutil_socket_t fd, short what)
         {
-            flog(LOG_INFO, "core writable event\n");
-            libeventData.cores[fd]->flush();
+            libeventData.cores.find(fd)->flush();
         }
 
         // called when something connects to either of the listen sockets
         template<ConnectionType CONNTYPE>
         void cb_connect(evutil_socket_t fd, short what)
         {
-            flog(LOG_INFO, "cb_connect(): fd=%d, what=%d\n", fd, what);
             SessionContext *sc= acceptConnection(fd, CONNTYPE);
-            if(sc)
+            if(sc && !shards.empty())
+            {
+                // socket i/o for this session is done by a worker thread.
+                sc->shard= shards[nextShard++ % shards.size()];
+                sc->corkEnabled= false;
+                sc->shardCounters= make_shared<ShardCounters>();
+                ShardMessage m;
+                m.type= ShardMessage::ADD;
+                m.clientID= sc->clientID;
+                m.fd= sc->sockfd;
+                m.counters= sc->shardCounters;
+                sc->shard->post(std::move(m));
+            }
+            else if(sc)
             {
-                sc->sockfdRead= dup(sc->sockfd);
-                libeventData.sessions[sc->sockfd]= sc;
-                libeventData.sessions[sc->sockfdRead]= sc;
-                sc->readEvent= event_new(libeventData.base, sc->sockfdRead, EV_READ|EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
+                libeventData.sessions.set(sc->sockfd, sc);
+                sc->readEvent= event_new(libeventData.base, sc->sockfd, EV_READ|EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
                     {
-                        ((Graphserv*)arg)->cb_sessionReadable<CONNTYPE>(fd, what);
+                        ((Graphserv*)arg)->cb_sessionReadable(fd, what);
                     }, this);
-                sc->writeEvent= event_new(libeventData.base, sc->sockfd, EV_WRITE|EV_PERSIST|EV_ET, [](evutil_socket_t fd, short what, void *arg)
+                sc->writeEvent= event_new(libeventData.base, sc->sockfd, EV_WRITE|EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
                     {
-                        ((Graphserv*)arg)->cb_sessionWritable<CONNTYPE>(fd, what);
+                        ((Graphserv*)arg)->cb_sessionWritable(fd, what);
                     }, this);
+                sc->waitWritable= eventToggle(sc->writeEvent);
                 event_add(sc->readEvent, nullptr);
-                event_add(sc->writeEvent, nullptr);
             }
             else
             {
                 flog(LOG_ERROR, _("couldn't create connection.\n"));
-                //~ if(errno==EMFILE)
-                //~ {
-                    //~ double defer= 3.0;
-                    //~ flog(LOG_ERROR, _("too many open files. deferring new connections for %.0f seconds.\n"), defer);
-                    //~ deferNewConnectionsUntil= time + defer;
-                //~ }
+                if(errno==EMFILE || errno==ENFILE)
+                {
+                    // stop listening for a while. accept() would fail again immediately.
+                    timeval defer= { 3, 0 };
+                    flog(LOG_ERROR, _("too many open files. deferring new connections for %.0f seconds.\n"), (double)defer.tv_sec);
+                    for(int i= 0; i<2; i++)
+                        if(libeventData.listenEvents[i]) event_del(libeventData.listenEvents[i]);
+                    event_base_once(libeventData.base, -1, EV_TIMEOUT, [](evutil_socket_t fd, short what, void *arg)
+                        {
+                            Graphserv *self= (Graphserv*)arg;
+                            for(int i= 0; i<2; i++)
+                                if(self->libeventData.listenEvents[i]) event_add(self->libeventData.listenEvents[i], nullptr);
+                        }, this, &defer);
+                }
             }
         }
         
+        // called when a shard has posted messages.
+        void cb_shardNotify(SessionShard *shard)
+        {
+            shard->clearNotification();
+            double time= getTime();
+            ShardMessage m;
+            while(shard->receive(m))
+            {
+                SessionContext *sc= findClient(m.clientID);
+                if(!sc) continue;
+                if(m.type==ShardMessage::INPUT)
+                {
+                    size_t size= m.data[0].size();
+                    dataFromClient(*sc, &m.data[0][0], size, time);
+                    // the shard stops reading while too much input is in transit.
+                    size_t old= sc->shardCounters->input.fetch_sub(size);
+                    if(old>=SHARD_INPUT_LIMIT && old-size<SHARD_INPUT_LIMIT)
+                    {
+                        ShardMessage c;
+                        c.type= ShardMessage::CONSUMED;
+                        c.clientID= sc->clientID;
+                        c.fd= 0;
+                        sc->shard->post(std::move(c));
+                    }
+                }
+                else if(m.type==ShardMessage::CLOSED)
+                {
+                    if(m.fd)
+                        flog(LOG_ERROR, _("i/o error, client %d: %s\n"), sc->clientID, strerror(m.fd));
+                    else
+                        flog(LOG_INFO, _("client %d: connection closed%s.\n"), sc->clientID, sc->shutdownTime? "": _(" by peer"));
+                    removeSession(sc->clientID);
+                }
+                else if(m.type==ShardMessage::DRAINED)
+                    resumeCoreOutput(sc->clientID);
+            }
+        }
+
+        // wake up shards which have messages waiting.
+        void wakeShards()
+        {
+            for(size_t i= 0; i<shards.size(); i++)
+                shards[i]->wake();
+        }
+
         bool mainloop_libevent()
         {
 #ifdef DEBUG_EVENTS
@@ -247,13 +294,8 @@ class Graphserv
             flog(LOG_INFO, "compiled libevent version: %s\n", LIBEVENT_VERSION);
             flog(LOG_INFO, "runtime libevent version: %s\n", event_get_version());
             
-            event_config *cfg= event_config_new();
-            if(!cfg)
-                throw std::runtime_error("event_config_new() failed");
-            event_config_require_features(cfg, EV_FEATURE_ET); //|EV_FEATURE_FDS); // 
-            if(!(libeventData.base= event_base_new_with_config(cfg)))
-                throw std::runtime_error("event_base_new_with_config() failed");
-            event_config_free(cfg);
+            if(!(libeventData.base= event_base_new()))
+                throw std::runtime_error("event_base_new() failed");
             
             int i;
             const char **methods = event_get_supported_methods();
@@ -279,18 +321,358 @@ class Graphserv
                 Graphserv *self= (Graphserv*)arg;
                 self->cb_connect<CONN_HTTP>(fd, what);
             };
-            event *ev= event_new(libeventData.base, listenSocket, EV_READ|EV_PERSIST, listen_cb, this);
-            event_add(ev, nullptr);
-            ev= event_new(libeventData.base, httpSocket, EV_READ|EV_PERSIST, http_cb, this);
-            event_add(ev, nullptr);
-            
-            while(true)
+            libeventData.listenEvents[0]= (listenSocket? event_new(libeventData.base, listenSocket, EV_READ|EV_PERSIST, listen_cb, this): NULL);
+            libeventData.listenEvents[1]= (httpSocket? event_new(libeventData.base, httpSocket, EV_READ|EV_PERSIST, http_cb, this): NULL);
+            for(i= 0; i<2; i++)
+                if(libeventData.listenEvents[i]) event_add(libeventData.listenEvents[i], nullptr);
+
+            // the timer wakes up the loop regularly, so that statistics are updated and quit is noticed.
+            event *timer= event_new(libeventData.base, -1, EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
+                {
+                    ((Graphserv*)arg)->rolloverSessionStats(getTime());
+                }, this);
+            timeval timerInterval= { 1, 0 };
+            event_add(timer, &timerInterval);
+            libeventData.chokeTimer= evtimer_new(libeventData.base, [](evutil_socket_t fd, short what, void *arg)
+                {
+                    ((Graphserv*)arg)->unchokeClients(getTime());
+                }, this);
+
+            // start the worker threads.
+            vector<event*> shardEvents;
+            for(i= 0; i<workerThreads; i++)
             {
-                event_base_loop(libeventData.base, EVLOOP_ONCE);
+                SessionShard *shard= new SessionShard(i, writeLowWatermark, spillThreshold);
+                if(!shard->start())
+                {
+                    flog(LOG_CRIT, "couldn't start worker thread %d: %s\n", i, strerror(errno));
+                    delete shard;
+                    return false;
+                }
+                shards.push_back(shard);
+                shardEvents.push_back(event_new(libeventData.base, shard->getNotifyFd(), EV_READ|EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
+                    {
+                        Graphserv *self= (Graphserv*)arg;
+                        for(size_t i= 0; i<self->shards.size(); i++)
+                            if(self->shards[i]->getNotifyFd()==fd) self->cb_shardNotify(self->shards[i]);
+                    }, this));
+                event_add(shardEvents.back(), nullptr);
             }
-            
-            throw std::runtime_error("mainloop_libevent: not implemented");
+            if(workerThreads) flog(LOG_INFO, "started %d worker threads.\n", workerThreads);
+
+            flog(LOG_INFO, "entering main loop. TCP port: %d, HTTP port: %d\n", tcpPort, httpPort);
+            while(!quit)
+            {
+                removeDeferredClients();
+
+                // send queued commands to cores, then write out everything that was buffered.
+                flushCommandQueues();
+                NonblockWriter::flushDirty();
+                resumeDatasetClients();
+                wakeShards();
+
+                if(event_base_loop(libeventData.base, EVLOOP_ONCE)<0)
+                {
+                    flog(LOG_CRIT, "event_base_loop() failed\n");
+                    break;
+                }
+
+                NonblockWriter::flushDirty();
+                shutdownFinishedConversations();
+                wakeShards();
+            }
+
+            // the worker threads close their sockets when they stop.
+            for(size_t k= 0; k<shards.size(); k++)
+            {
+                shards[k]->stop();
+                event_free(shardEvents[k]);
+                delete shards[k];
+            }
+            shards.clear();
+
+            // free events before the event base. sessions and cores are deleted by the destructor.
+            for(SessionContext *sc: sessionContexts)
+                freeEvents(sc);
+            for(CoreInstance *ci: coreInstances)
+                freeEvents(ci);
+            for(i= 0; i<2; i++)
+                if(libeventData.listenEvents[i]) event_free(libeventData.listenEvents[i]);
+            event_free(timer);
+            event_free(libeventData.chokeTimer);
+            event_base_free(libeventData.base);
+            libeventData.base= NULL;
+
+            return quit;    // false if the loop failed
+        }
+
+#ifdef USE_IO_URING
+        // io_uring requests are tagged with the operation and a client or core ID.
+        enum UringOp
+        {
+            URING_ACCEPT= 1,            // ID is the ConnectionType
+            URING_RECV,
+            URING_SESSION_WRITABLE,
+            URING_CORE_READABLE,
+            URING_CORE_STDERR,
+            URING_CORE_WRITABLE,
+            URING_TIMER,
+            URING_CHOKE_TIMER
+        };
+        static uint64_t uringTag(UringOp op, uint32_t id) { return (uint64_t(op)<<32) | id; }
+
+        // multishot accept on a listen socket.
+        void uringAccept(ConnectionType type)
+        {
+            io_uring_sqe *sqe= uringData.ring.getSqe();
+            sqe->opcode= IORING_OP_ACCEPT;
+            sqe->fd= (type==CONN_TCP? listenSocket: httpSocket);
+            sqe->ioprio= IORING_ACCEPT_MULTISHOT;
+            sqe->user_data= uringTag(URING_ACCEPT, type);
+            uringData.acceptStopped[type]= false;
+        }
+
+        // multishot receive from a client socket into the shared buffer ring.
+        void uringRecv(SessionContext *sc)
+        {
+            if(!uringData.recvArmed.insert(sc->clientID).second) return;
+            io_uring_sqe *sqe= uringData.ring.getSqe();
+            sqe->opcode= IORING_OP_RECV;
+            sqe->fd= sc->sockfd;
+            sqe->flags= IOSQE_BUFFER_SELECT;
+            sqe->buf_group= 0;
+            sqe->ioprio= IORING_RECV_MULTISHOT;
+            sqe->user_data= uringTag(URING_RECV, sc->clientID);
+        }
+
+        // oneshot poll. does nothing if a poll with this tag is already pending.
+        void uringArmPoll(int fd, unsigned events, uint64_t tag)
+        {
+            if(!uringData.polls.insert(tag).second) return;
+            io_uring_sqe *sqe= uringData.ring.getSqe();
+            sqe->opcode= IORING_OP_POLL_ADD;
+            sqe->fd= fd;
+            sqe->poll32_events= events;
+            sqe->user_data= tag;
+        }
+
+        void uringCancel(uint64_t tag)
+        {
+            io_uring_sqe *sqe= uringData.ring.getSqe();
+            sqe->opcode= IORING_OP_ASYNC_CANCEL;
+            sqe->fd= -1;
+            sqe->addr= tag;
+            sqe->user_data= 0;
+        }
+
+        void uringTimer()
+        {
+            io_uring_sqe *sqe= uringData.ring.getSqe();
+            sqe->opcode= IORING_OP_TIMEOUT;
+            sqe->fd= -1;
+            sqe->addr= (uint64_t)(uintptr_t)&uringData.timerInterval;
+            sqe->len= 1;
+            sqe->user_data= uringTag(URING_TIMER, 0);
+        }
+
+        // oneshot timeout for flood control.
+        void uringChokeTimer(double delay)
+        {
+            uringData.chokeDelay.tv_sec= time_t(delay);
+            uringData.chokeDelay.tv_nsec= long((delay-time_t(delay))*1000000000);
+            io_uring_sqe *sqe= uringData.ring.getSqe();
+            sqe->opcode= IORING_OP_TIMEOUT;
+            sqe->fd= -1;
+            sqe->addr= (uint64_t)(uintptr_t)&uringData.chokeDelay;
+            sqe->len= 1;
+            sqe->user_data= uringTag(URING_CHOKE_TIMER, 0);
+        }
+
+        // watch a session socket for writability while its write buffer or a relay is stalled.
+        void uringWaitWritable(SessionContext *sc)
+        {
+            uringArmPoll(sc->sockfd, POLLOUT, uringTag(URING_SESSION_WRITABLE, sc->clientID));
+        }
+
+        // handle one completion.
+        void uringCompletion(const io_uring_cqe &cqe, double time)
+        {
+            uint32_t id= uint32_t(cqe.user_data);
+            bool more= (cqe.flags & IORING_CQE_F_MORE);
+            UringOp op= UringOp(cqe.user_data>>32);
+            if(op!=URING_ACCEPT && op!=URING_RECV)
+                uringData.polls.erase(cqe.user_data);
+            switch(op)
+            {
+                case URING_ACCEPT:
+                {
+                    ConnectionType type= ConnectionType(id);
+                    if(cqe.res>=0)
+                    {
+                        SessionContext *sc= setupConnection(cqe.res, type);
+                        if(sc)
+                        {
+                            sc->waitWritable= [this, sc] (bool on) { if(on) uringWaitWritable(sc); };
+                            uringRecv(sc);
+                        }
+                        else
+                            flog(LOG_ERROR, _("couldn't create connection.\n"));
+                    }
+                    else
+                    {
+                        errno= -cqe.res;
+                        logerror("accept()");
+                        if(errno==EMFILE || errno==ENFILE)
+                        {
+                            double defer= 3.0;
+                            flog(LOG_ERROR, _("too many open files. deferring new connections for %.0f seconds.\n"), defer);
+                            uringData.acceptDeferredUntil= time + defer;
+                        }
+                    }
+                    if(!more)
+                    {
+                        if(time<uringData.acceptDeferredUntil) uringData.acceptStopped[type]= true;
+                        else uringAccept(type);
+                    }
+                    break;
+                }
+
+                case URING_RECV:
+                {
+                    SessionContext *sc= findClient(id);
+                    if(!more) uringData.recvArmed.erase(id);
+                    if(cqe.flags & IORING_CQE_F_BUFFER)
+                    {
+                        uint16_t bid= cqe.flags>>IORING_CQE_BUFFER_SHIFT;
+                        if(sc && cqe.res>0) dataFromClient(*sc, uringData.ring.buffer(bid), cqe.res, time);
+                        uringData.ring.returnBuffer(bid);
+                    }
+                    if(!sc) break;
+                    if(cqe.res==0)
+                    {
+                        flog(LOG_INFO, _("client %d: connection closed%s.\n"), sc->clientID, sc->shutdownTime? "": _(" by peer"));
+                        removeSession(sc->clientID);
+                    }
+                    else if(cqe.res<0 && cqe.res!=-ENOBUFS && cqe.res!=-ECANCELED)
+                    {
+                        flog(LOG_ERROR, _("recv() error, client %d, %d bytes in write buffer, %s\n"), sc->clientID, sc->getWritebufferSize(), strerror(-cqe.res));
+                        removeSession(sc->clientID);
+                    }
+                    else if(!more && !sc->readPaused)
+                        uringRecv(sc);  // ran out of buffers, or input was resumed before the recv was cancelled
+                    break;
+                }
+
+                case URING_SESSION_WRITABLE:
+                {
+                    SessionContext *sc= findClient(id);
+                    if(!sc) break;
+                    if(!sc->flush())
+                        uringWaitWritable(sc);
+                    if(sc->pendingOutput()<writeLowWatermark)
+                        resumeCoreOutput(sc->clientID);
+                    break;
+                }
+
+                case URING_CORE_READABLE:
+                {
+                    CoreInstance *ci= findInstance(id);
+                    if(!ci || !coreReadable(ci)) break;
+                    SessionContext *sc;
+                    if(ci->outputWaiting && (sc= findClient(ci->getLastClientID())))
+                    {
+                        // resumed when the client has drained its output.
+                        uringWaitWritable(sc);
+                        break;
+                    }
+                    ci->outputWaiting= false;
+                    uringArmPoll(ci->getReadFd(), POLLIN, cqe.user_data);
+                    break;
+                }
+
+                case URING_CORE_STDERR:
+                {
+                    CoreInstance *ci= findInstance(id);
+                    if(!ci) break;
+                    coreStderrReadable(ci);
+                    uringArmPoll(ci->getStderrReadFd(), POLLIN, cqe.user_data);
+                    break;
+                }
+
+                case URING_CORE_WRITABLE:
+                {
+                    CoreInstance *ci= findInstance(id);
+                    if(ci && !ci->flush())
+                        uringArmPoll(ci->getWriteFd(), POLLOUT, cqe.user_data);
+                    break;
+                }
+
+                case URING_TIMER:
+                {
+                    rolloverSessionStats(time);
+                    for(int type= CONN_TCP; type<=CONN_HTTP; type++)
+                        if(uringData.acceptStopped[type] && time>=uringData.acceptDeferredUntil)
+                            uringAccept(ConnectionType(type));
+                    uringTimer();
+                    break;
+                }
+
+                case URING_CHOKE_TIMER:
+                    unchokeClients(time);
+                    break;
+
+                default:
+                    break;  // cancel requests
+            }
+        }
+
+        // the io_uring main loop. client input is received into a shared ring of provided buffers with multishot recv,
+        // connections are accepted with multishot accept, and core pipes and stalled writers are watched with polls.
+        // everything queued in one iteration is submitted with a single io_uring_enter() call, which also waits for completions.
+        bool mainloop_uring()
+        {
+            IoUring &ring= uringData.ring;
+            if(!ring.init(URING_ENTRIES, URING_CQ_ENTRIES) || !ring.setupBuffers(0, URING_RECV_BUFFERS, URING_RECV_BUFSIZE))
+            {
+                flog(LOG_ERROR, _("couldn't set up io_uring: %s. falling back to libevent.\n"), strerror(errno));
+                mainLoop= MAINLOOP_LIBEVENT;
+                return mainloop_libevent();
+            }
+
+            uringData.timerInterval.tv_sec= 1;
+            uringData.timerInterval.tv_nsec= 0;
+            uringData.acceptDeferredUntil= 0;
+            uringData.acceptStopped[CONN_TCP]= uringData.acceptStopped[CONN_HTTP]= false;
+            if(listenSocket) uringAccept(CONN_TCP);
+            if(httpSocket) uringAccept(CONN_HTTP);
+            uringTimer();
+
+            flog(LOG_INFO, "entering main loop (io_uring). TCP port: %d, HTTP port: %d\n", tcpPort, httpPort);
+            while(!quit)
+            {
+                removeDeferredClients();
+
+                // send queued commands to cores, then write out everything that was buffered.
+                flushCommandQueues();
+                NonblockWriter::flushDirty();
+                resumeDatasetClients();
+
+                if(ring.submit(1)<0 && errno!=EINTR && errno!=EBUSY)
+                {
+                    flog(LOG_CRIT, "io_uring_enter() failed: %s\n", strerror(errno));
+                    return false;
+                }
+
+                double time= getTime();
+                ring.forEachCqe([&] (const io_uring_cqe &cqe) { uringCompletion(cqe, time); });
+
+                NonblockWriter::flushDirty();
+                shutdownFinishedConversations();
+            }
+
+            return true;
         }
+#endif // USE_IO_URING
 
         bool mainloop_select()
         {
@@ -298,15 +680,29 @@ class Graphserv
             int maxfd;
             double deferNewConnectionsUntil= 0; // defer accept() calls. set if open files limit is hit.
 
+            // client sockets are added to and removed from these sets as their state changes.
+            FD_ZERO(&selectData.readfds);
+            FD_ZERO(&selectData.writefds);
+            selectData.maxfd= 0;
+
             flog(LOG_INFO, "entering main loop. TCP port: %d, HTTP port: %d\n", tcpPort, httpPort);
             while(!quit)
             {
                 double time= getTime();
 
-                FD_ZERO(&readfds);
-                FD_ZERO(&writefds);
+                removeDeferredClients();
+                unchokeClients(time);
+                rolloverSessionStats(time);
+
+                // send queued commands to cores, then write out everything that was buffered.
+                flushCommandQueues();
+                NonblockWriter::flushDirty();
+                resumeDatasetClients();
 
-                maxfd= 0;
+                // init fd sets for select: client sockets which are read from or have output waiting are kept up to date.
+                readfds= selectData.readfds;
+                writefds= selectData.writefds;
+                maxfd= selectData.maxfd;
 
                 // when open files limit is hit, new connections will be deferred for a few seconds
                 if(deferNewConnectionsUntil < time)
@@ -315,50 +711,31 @@ class Graphserv
                     if(httpSocket) fd_add(readfds, httpSocket, maxfd);
                 }
 
-                // deferred removal of clients
-                for(set<uint32_t>::iterator i= clientsToRemove.begin(); i!=clientsToRemove.end(); ++i)
-                    removeSession(*i);
-                clientsToRemove.clear();
-
-                // init fd set for select: add client fds
-                for( map<uint32_t,SessionContext*>::iterator i= sessionContexts.begin(); i!=sessionContexts.end(); ++i )
+                // init fd set for select: add core fds
+                for(CoreInstance *ci: coreInstances)
                 {
-                    SessionContext *sc= i->second;
-                    double d= time-sc->stats.lastTime;
-                    if(d>10.0)
+                    if(ci->outputWaiting)
                     {
-                        sc->stats.normalize(time);
-                        // flog(LOG_INFO, "client %u: bytesSent %.2f, linesQueued %.2f, coreCommandsSent %.2f, servCommandsSent %.2f\n",
-                        //      sc->clientID, sc->stats.bytesSent, sc->stats.linesQueued, sc->stats.coreCommandsSent, sc->stats.servCommandsSent);
-                        // testing this to prevent flooding.
-                        //~ if(sc->stats.linesQueued>5000) { flog(LOG_INFO, "choke\n"); sc->chokeTime= time+10.0; }
-                        sc->stats.reset();
-                        sc->stats.lastTime= time;
+                        // wait for the client to drain its output before reading more.
+                        SessionContext *sc= findClient(ci->getLastClientID());
+                        if(sc) fd_add(writefds, sc->sockfd, maxfd);
+                        else ci->outputWaiting= false;
                     }
-                    if(sc->chokeTime<time)  // chokeTime could be used to slow down a spamming client.
-                        fd_add(readfds, sc->sockfd, maxfd);
-                    else
-                        flog(LOG_INFO, "not reading from client %u (flood).\n", sc->clientID);
-                    // only add write fd if there is something to write
-                    if(!sc->writeBufferEmpty())
-                        fd_add(writefds, sc->sockfd, maxfd);
-                }
-
-                // init fd set for select: add core fds
-                for( map<uint32_t,CoreInstance*>::iterator i= coreInstances.begin(); i!=coreInstances.end(); ++i )
-                {
-                    CoreInstance *ci= i->second;
-                    fd_add(readfds, ci->getReadFd(), maxfd);
+                    if(!ci->outputWaiting)
+                        fd_add(readfds, ci->getReadFd(), maxfd);
                     fd_add(readfds, ci->getStderrReadFd(), maxfd);
-                    ci->flushCommandQ(*this);
                     // only add write fd if there is something to write
                     if(!ci->writeBufferEmpty())
                         fd_add(writefds, ci->getWriteFd(), maxfd);
                 }
 
+                // wake up when the first flood control wait ends.
+                double wait= 2;
+                if(!chokedClients.empty())
+                    wait= max(0.0, min(wait, chokedClients.begin()->first-time));
                 struct timeval timeout;
-                timeout.tv_sec= 2;
-                timeout.tv_usec= 0;
+                timeout.tv_sec= time_t(wait);
+                timeout.tv_usec= suseconds_t((wait-time_t(wait))*1000000);
                 int r= select(maxfd+1, &readfds, &writefds, 0, &timeout);
                 if(r<0)
                 {
@@ -367,15 +744,15 @@ class Graphserv
                         case EBADF:
                             logerror("select()");
                             // a file descriptor is bad, find out which and remove the client or core.
-                            for( map<uint32_t,SessionContext*>::iterator i= sessionContexts.begin(); i!=sessionContexts.end(); ++i )
-                                if( !i->second->writeBufferEmpty() && fcntl(i->second->sockfd, F_GETFL)==-1 )
-                                    flog(LOG_ERROR, _("bad fd, removing client %d.\n"), i->second->clientID),
-                                    forceClientDisconnect(i->second);
-                            for( map<uint32_t,CoreInstance*>::iterator i= coreInstances.begin(); i!=coreInstances.end(); ++i )
-                                if( fcntl(i->second->getReadFd(), F_GETFL)==-1 ||
-                                    (!i->second->writeBufferEmpty() && fcntl(i->second->getWriteFd(), F_GETFL)==-1) )
-                                    flog(LOG_ERROR, _("bad fd, removing core %d.\n"), i->second->getID()),
-                                    removeCoreInstance(i->second);
+                            for(SessionContext *sc: sessionContexts)
+                                if( !sc->writeBufferEmpty() && fcntl(sc->sockfd, F_GETFL)==-1 )
+                                    flog(LOG_ERROR, _("bad fd, removing client %d.\n"), sc->clientID),
+                                    forceClientDisconnect(sc);
+                            for(CoreInstance *ci: coreInstances)
+                                if( fcntl(ci->getReadFd(), F_GETFL)==-1 ||
+                                    (!ci->writeBufferEmpty() && fcntl(ci->getWriteFd(), F_GETFL)==-1) )
+                                    flog(LOG_ERROR, _("bad fd, removing core %d.\n"), ci->getID()),
+                                    removeCoreInstance(ci);
                             continue;
                         
                         case EINTR:
@@ -406,47 +783,26 @@ class Graphserv
                         }
                 }
 
-                // loop through all the session contexts, handle incoming data, flush outgoing data if possible.
-                for( map<uint32_t,SessionContext*>::iterator it= sessionContexts.begin(); it!=sessionContexts.end(); ++it )
+                // loop through the client sockets, handle incoming data, flush outgoing data if possible.
+                // sessions accepted above are not in the sets yet. removed sessions are only deleted at the top of the loop.
+                for(int sockfd= 0; sockfd<=selectData.maxfd; sockfd++)
                 {
-                    SessionContext &sc= *it->second;
-                    int sockfd= sc.sockfd;
+                    if(!FD_ISSET(sockfd, &readfds) && !FD_ISSET(sockfd, &writefds)) continue;
+                    SessionContext *session= selectData.sessions.find(sockfd);
+                    if(!session) continue;
+                    SessionContext &sc= *session;
                     if(FD_ISSET(sockfd, &readfds))
                     {
-                        const size_t BUFSIZE= 128;
-                        char buf[BUFSIZE];
-                        ssize_t sz= recv(sockfd, buf, sizeof(buf), 0);
+                        ssize_t sz= readFromClient(sc, sockfd, time);
                         if(sz==0)
                         {
                             flog(LOG_INFO, _("client %d: connection closed%s.\n"), sc.clientID, sc.shutdownTime? "": _(" by peer"));
-                            clientsToRemove.insert(sc.clientID);
+                            forceClientDisconnect(&sc);
                         }
                         else if(sz<0)
                         {
                             flog(LOG_ERROR, _("recv() error, client %d, %d bytes in write buffer, %s\n"), sc.clientID, sc.getWritebufferSize(), strerror(errno));
-                            clientsToRemove.insert(sc.clientID);
-                        }
-                        else
-                        {
-                            for(ssize_t i= 0; i<sz; i++)
-                            {
-                                char c= buf[i];
-                                if(c=='\r') continue;   // someone is feeding us DOS newlines?
-                                sc.linebuf+= c;
-                                if(c=='\n')
-                                {
-                                    if(clientsToRemove.find(sc.clientID)!=clientsToRemove.end())
-                                        break;
-
-                                    linesFromClients++;
-
-									if(sc.connectionType==CONN_HTTP)
-                                        lineFromHTTPClient(sc.linebuf, *(HTTPSessionContext*)&sc, time);
-                                    else
-                                        lineFromClient(string(sc.linebuf), sc, time);
-                                    sc.linebuf.clear();
-                                }
-                            }
+                            forceClientDisconnect(&sc);
                         }
                     }
                     if(FD_ISSET(sockfd, &writefds))
@@ -456,14 +812,17 @@ class Graphserv
                 vector<CoreInstance*> coresToRemove;
 
                 // loop through all the core instances, handle incoming data, flush outgoing data if possible.
-                for( map<uint32_t,CoreInstance*>::iterator i= coreInstances.begin(); i!=coreInstances.end(); ++i )
+                for(CoreInstance *ci: coreInstances)
                 {
-                    CoreInstance *ci= i->second;
+                    if(ci->outputWaiting)
+                    {
+                        SessionContext *sc= findClient(ci->getLastClientID());
+                        if(!sc || (FD_ISSET(sc->sockfd, &writefds) && sc->pendingOutput()<writeLowWatermark))
+                            ci->outputWaiting= false;
+                    }
                     if(FD_ISSET(ci->getReadFd(), &readfds))
                     {
-                        const size_t BUFSIZE= 1024;
-                        char buf[BUFSIZE];
-                        ssize_t sz= read(ci->getReadFd(), buf, sizeof(buf));
+                        ssize_t sz= readFromCore(ci, time);
                         if(sz==0)
                         {
                             flog(LOG_INFO, "core %s (ID %u, pid %d) has exited\n", ci->getName().c_str(), ci->getID(), (int)ci->getPid());
@@ -476,32 +835,6 @@ class Graphserv
                             flog(LOG_ERROR, "i/o error, core %s: %s\n", ci->getName().c_str(), strerror(errno));
                             coresToRemove.push_back(ci);
                         }
-                        else
-                        {
-                            for(ssize_t i= 0; i<sz; i++)
-                            {
-                                char c= buf[i];
-                                if(c=='\r') continue;
-                                ci->linebuf+= c;
-                                if(c=='\n')
-                                {
-                                    SessionContext *sc= findClient(ci->getLastClientID());
-                                    bool clientWasWaiting= (sc && sc->isWaitingForCoreReply());
-                                    ci->lineFromCore(ci->linebuf, *this);
-                                    ci->linebuf.clear();
-                                    // if this was the last line the client was waiting for, 
-                                    // execute its queued commands now.
-                                    if( clientWasWaiting )
-                                        while(!sc->lineQueue.empty() && (!sc->isWaitingForCoreReply()))
-                                        {
-                                            string& line= sc->lineQueue.front();
-                                            flog(LOG_INFO, "execing queued line from client: '%s", line.c_str());
-                                            lineFromClient(line, *sc, time, true);
-                                            sc->lineQueue.pop();
-                                        }
-                                }
-                            }
-                        }
                     }
                     else if(FD_ISSET(ci->getStderrReadFd(), &readfds))
                     {
@@ -517,21 +850,9 @@ class Graphserv
                 for(size_t i= 0; i<coresToRemove.size(); i++)
                     removeCoreInstance(coresToRemove[i]);
 
-                // go through any HTTP session contexts immediately after i/o.
-                for( map<uint32_t,SessionContext*>::iterator i= sessionContexts.begin(); i!=sessionContexts.end(); ++i )
-                {
-                    SessionContext *sc= i->second;
-                    CoreInstance *ci;
-                    // HTTP clients are disconnected once we don't have any more output for them.
-                    if( sc->connectionType==CONN_HTTP &&
-                        ((HTTPSessionContext*)sc)->conversationFinished &&
-                        sc->writeBufferEmpty() &&
-                        ((ci= findInstance(sc->coreID))==NULL || ci->hasDataForClient(sc->clientID)==false) )
-                    {
-                        if(!sc->shutdownTime)
-                            shutdownClient(sc);
-                    }
-                }
+                NonblockWriter::flushDirty();
+
+                shutdownFinishedConversations();
             }
 
             return true;
@@ -555,39 +876,63 @@ class Graphserv
         }
 
         // find a named instance.
-        CoreInstance *findNamedInstance(string name, bool onlyRunning= true)
+        CoreInstance *findNamedInstance(const string& name, bool onlyRunning= true)
         {
-            for(map<uint32_t,CoreInstance*>::iterator it= coreInstances.begin(); it!=coreInstances.end(); ++it)
-                if( it->second->getName()==name && (onlyRunning? it->second->isRunning(): true) )
-                    return it->second;
+            unordered_map<string,CoreInstance*>::iterator it= coreNames.find(name);
+            if( it!=coreNames.end() && (onlyRunning? it->second->isRunning(): true) ) return it->second;
             return 0;
         }
 
-        // find an instance by ID (faster).
+        // find an instance by ID.
         CoreInstance *findInstance(uint32_t ID, bool onlyRunning= true)
         {
-            map<uint32_t,CoreInstance*>::iterator it= coreInstances.find(ID);
-            if( it!=coreInstances.end() && (onlyRunning? it->second->isRunning(): true) ) return it->second;
+            CoreInstance *ci= coreInstances.find(ID);
+            if( ci && (onlyRunning? ci->isRunning(): true) ) return ci;
             return 0;
         }
 
         // creates a new instance, without starting it or adding it to the event loop.
-        CoreInstance *createCoreInstance(string name= "")
+        // it is listed right away, and must be removed with removeCoreInstance() if it fails to start.
+        // if primary is given, the instance is a read replica of it, which is not found by name.
+        CoreInstance *createCoreInstance(string name= "", CoreInstance *primary= NULL)
         {
-            CoreInstance *inst= new CoreInstance(++coreIDCounter, corePath);
+            uint32_t id= coreInstances.add();
+            if(!id) return 0;
+            CoreInstance *inst= new CoreInstance(id, corePath);
             inst->setName(name);
+            inst->setScheduling(scheduling);
+            inst->setResultCache(&resultCache, primary? primary->getID(): id);
+            coreInstances.set(id, inst);
+            if(primary)
+            {
+                inst->primaryID= primary->getID();
+                primary->replicaIDs.push_back(id);
+            }
+            else
+                coreNames[inst->getName()]= inst;
             return inst;
         }
+
+        // true if a core or one of its replicas has output or queued commands for a client.
+        bool coreHasDataForClient(CoreInstance *ci, uint32_t clientID)
+        {
+            if(ci->hasDataForClient(clientID)) return true;
+            for(uint32_t id: ci->replicaIDs)
+            {
+                CoreInstance *r= findInstance(id);
+                if(r && r->hasDataForClient(clientID)) return true;
+            }
+            return false;
+        }
         // add a core instance to the event loop.
         void addCoreInstance(CoreInstance *inst)
         {
-            coreInstances.insert( pair<uint32_t,CoreInstance*>(inst->getID(), inst) );
-            if(useLibevent)
+            if(mainLoop==MAINLOOP_LIBEVENT)
             {
                 flog(LOG_INFO, "setting up libevent stuff for core %s\n", inst->getName().c_str());
-                libeventData.cores[inst->getReadFd()]= inst;
-                libeventData.cores[inst->getStderrReadFd()]= inst;
-                libeventData.cores[inst->getWriteFd()]= inst;
+                libeventData.cores.set(inst->getReadFd(), inst);
+                libeventData.cores.set(inst->getStderrReadFd(), inst);
+                libeventData.cores.set(inst->getWriteFd(), inst);
                 // read event forwarder for child's stdout and stderr handles
                 auto read_cb= [] (evutil_socket_t fd, short what, void *arg)
                 {
@@ -595,48 +940,113 @@ class Graphserv
                 };
                 inst->readEvent= event_new(libeventData.base, inst->getReadFd(), EV_READ|EV_PERSIST, read_cb, this);
                 inst->stderrReadEvent= event_new(libeventData.base, inst->getStderrReadFd(), EV_READ|EV_PERSIST, read_cb, this);
-                inst->writeEvent= event_new(libeventData.base, inst->getWriteFd(), EV_WRITE|EV_PERSIST|EV_ET, [](evutil_socket_t fd, short what, void *arg)
+                inst->writeEvent= event_new(libeventData.base, inst->getWriteFd(), EV_WRITE|EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
                     {
                         ((Graphserv*)arg)->cb_coreWritable(fd, what);
                     }, this);
+                inst->waitWritable= eventToggle(inst->writeEvent);
                 event_add(inst->readEvent, nullptr);
                 event_add(inst->stderrReadEvent, nullptr);
-                event_add(inst->writeEvent, nullptr);
+                if(!inst->writeBufferEmpty())
+                    event_add(inst->writeEvent, nullptr);
             }
+#ifdef USE_IO_URING
+            else if(mainLoop==MAINLOOP_URING)
+            {
+                uint32_t id= inst->getID();
+                uringArmPoll(inst->getReadFd(), POLLIN, uringTag(URING_CORE_READABLE, id));
+                uringArmPoll(inst->getStderrReadFd(), POLLIN, uringTag(URING_CORE_STDERR, id));
+                inst->waitWritable= [this, inst, id] (bool on)
+                    {
+                        if(on) uringArmPoll(inst->getWriteFd(), POLLOUT, uringTag(URING_CORE_WRITABLE, id));
+                    };
+                if(!inst->writeBufferEmpty())
+                    inst->waitWritable(true);
+            }
+#endif
         }
 
         // removes a core instance from the list and deletes it
         void removeCoreInstance(CoreInstance *core)
         {
-            map<uint32_t,CoreInstance*>::iterator it= coreInstances.find(core->getID());
-            if(it!=coreInstances.end()) coreInstances.erase(it);
-            if(useLibevent)
+            if(core->primaryID)
+            {
+                // a replica which went away is no longer given commands.
+                CoreInstance *primary= findInstance(core->primaryID, false);
+                if(primary)
+                {
+                    vector<uint32_t>& ids= primary->replicaIDs;
+                    ids.erase(std::remove(ids.begin(), ids.end(), core->getID()), ids.end());
+                }
+            }
+            // replicas don't outlive their primary. they are removed once they have exited.
+            for(uint32_t id: core->replicaIDs)
             {
-                event_free(core->readEvent);
-                event_free(core->stderrReadEvent);
-                event_free(core->writeEvent);
+                CoreInstance *r= findInstance(id, false);
+                if(!r) continue;
+                r->primaryID= 0;
+                if(r->isRunning()) r->terminate();
+            }
+
+            for(SessionContext *sc: sessionContexts)
+                if(sc->streamingDataset && sc->coreID==core->getID())
+                    abandonStreamedDataset(*sc);
+            coreInstances.erase(core->getID());
+            resultCache.forget(core->getID());
+            unordered_map<string,CoreInstance*>::iterator it= coreNames.find(core->getName());
+            if(it!=coreNames.end() && it->second==core) coreNames.erase(it);
+            if(mainLoop==MAINLOOP_LIBEVENT)
+            {
+                freeEvents(core);
                 libeventData.cores.erase(core->getReadFd());
                 libeventData.cores.erase(core->getStderrReadFd());
                 libeventData.cores.erase(core->getWriteFd());
             }
+#ifdef USE_IO_URING
+            else if(mainLoop==MAINLOOP_URING)
+            {
+                // polls on the pipes would keep them open otherwise.
+                uint32_t id= core->getID();
+                uringCancel(uringTag(URING_CORE_READABLE, id));
+                uringCancel(uringTag(URING_CORE_STDERR, id));
+                uringCancel(uringTag(URING_CORE_WRITABLE, id));
+            }
+#endif
             delete core;
         }
 
+        // the core a client is streaming a data set to has exited or is shutting down. the queued entry stays with
+        // the core, the rest of the data set is dropped, and the client gets the error once it has sent all of it.
+        void abandonStreamedDataset(SessionContext &sc)
+        {
+            sc.curCommand= CommandQEntry::create(sc.clientID, sc.curCommand->command);
+            sc.streamingDataset= false;
+            sc.invalidDatasetStatus= CMD_ERROR;
+            sc.invalidDatasetMsg= string(ERROR_STR) + format(_(" core process with ID %d has gone away\n"), sc.coreID);
+        }
+
         // find a session context (client).
         SessionContext *findClient(uint32_t ID)
         {
-            set<uint32_t>::iterator i= clientsToRemove.find(ID);
-            if(i!=clientsToRemove.end()) return 0;
-            map<uint32_t,SessionContext*>::iterator it= sessionContexts.find(ID);
-            if(it!=sessionContexts.end()) return it->second;
-            return 0;
+            SessionContext *sc= sessionContexts.find(ID);
+            return (sc && !sc->removing? sc: 0);
         }
 
         // shut down the client socket. disconnect will happen in select loop when read returns zero.
         void shutdownClient(SessionContext *sc)
         {
             flog(LOG_INFO, "shutting down session %d.\n", sc->clientID);
-            if(shutdown(sc->sockfd, SHUT_RDWR)<0)
+            sc->flush();
+            if(sc->shard)
+            {
+                // the shard shuts the socket down after writing what was queued before.
+                ShardMessage m;
+                m.type= ShardMessage::SHUTDOWN;
+                m.clientID= sc->clientID;
+                m.fd= 0;
+                sc->shard->post(std::move(m));
+            }
+            else if(shutdown(sc->sockfd, SHUT_RDWR)<0)
             {
                 logerror("shutdown");
                 forceClientDisconnect(sc);
@@ -644,17 +1054,24 @@ class Graphserv
             sc->shutdownTime= getTime();
         }
 
+        // an HTTP session has received its complete reply. it is shut down once the reply is sent.
+        void conversationFinished(uint32_t clientID)
+        {
+            finishedConversations.push_back(clientID);
+        }
+
         // mark client connection to be forcefully broken.
         void forceClientDisconnect(SessionContext *sc)
         {
-            if(clientsToRemove.find(sc->clientID)!=clientsToRemove.end())
+            if(sc->removing)
                 return;
-            clientsToRemove.insert(sc->clientID);
+            sc->removing= true;
+            clientsToRemove.push_back(sc->clientID);
         }
 
 
         // get the core instances
-        map<uint32_t,CoreInstance*>& getCoreInstances()
+        SlotTable<CoreInstance>& getCoreInstances()
         {
             return coreInstances;
         }
@@ -665,7 +1082,7 @@ class Graphserv
             if(!sc || !core) return false;
             
             CoreInstance *oldCore= findInstance(sc->coreID);
-            if(oldCore && oldCore->hasDataForClient(sc->clientID))
+            if(oldCore && coreHasDataForClient(oldCore, sc->clientID))
             {
                 // this is not fatal, but commands arriving from a different core could confuse client code.
                 // to avoid this, clients should always wait for cores to reply before switching instances.
@@ -681,38 +1098,78 @@ class Graphserv
     private:
         int tcpPort, httpPort;
         string corePath;
-        bool useLibevent;
+        MainLoop mainLoop;
+        bool corkResponses;     // cork client sockets while a data set is being sent
+        int workerThreads;      // number of shards for client socket i/o (libevent main loop only)
+        vector<SessionShard*> shards;
+        unsigned nextShard;     // new sessions are assigned to shards round-robin
+        size_t writeHighWatermark;  // pause reading from a core when its client has this many bytes of output pending
+        size_t writeLowWatermark;   // resume when the client is below this
+        size_t spillThreshold;      // buffered client output beyond this goes to a temporary file, if nonzero
+        SchedulingMode scheduling;  // of core commands
+        ResultCache resultCache;    // replies to read commands, by graph
+        FloodLimits floodLimits[ACCESS_ADMIN+1];    // flood control limits per access level
+        map<string, FloodBuckets> userFlood;        // flood control per user
+        set< pair<double,uint32_t> > chokedClients; // clients over their flood control limits, by the time their wait ends
+        double chokeTimerAt;        // time for which the main loop's flood control timer is armed, or 0
+        set<uint32_t> datasetPausedClients;         // clients not read from until the core their data set goes to has caught up
+        double statsRolloverTime;   // next time the per-session statistics are rolled over
         int listenSocket;
         int httpSocket;
         struct 
         {
             struct event_base *base;
-            // sockfd => SessionContext
-            std::map<evutil_socket_t, SessionContext*> sessions;
-            // pipe fd => CoreInstance
-            std::map<evutil_socket_t, CoreInstance*> cores;
+            event *listenEvents[2];     // TCP and HTTP listen sockets
+            event *chokeTimer;          // fires when the first flood control wait ends
+            FdTable<SessionContext> sessions;   // sockfd => SessionContext
+            FdTable<CoreInstance> cores;        // pipe fd => CoreInstance
         } libeventData;
-
+        struct
+        {
+            fd_set readfds, writefds;       // client sockets which are read from, and which have output waiting
+            int maxfd;                      // highest client socket
+            FdTable<SessionContext> sessions;   // sockfd => SessionContext
+        } selectData;
+#ifdef USE_IO_URING
+        struct
+        {
+            IoUring ring;
+            set<uint64_t> polls;            // tags of armed oneshot polls
+            set<uint32_t> recvArmed;        // clients with an active multishot recv
+            __kernel_timespec timerInterval;
+            __kernel_timespec chokeDelay;   // read by the kernel when the timeout is submitted
+            double acceptDeferredUntil;     // new connections are deferred after running out of fds
+            bool acceptStopped[2];          // multishot accept has ended and must be re-armed, per ConnectionType
+        } uringData;
+#endif
+
         struct CoreCommandInfo
         {
             AccessLevel accessLevel;
             string coreImpDetail;
         };
-        map<string,CoreCommandInfo> coreCommandInfos;
-
-        uint32_t coreIDCounter;
-        uint32_t sessionIDCounter;
-
-        map<uint32_t,CoreInstance*> coreInstances;
-        map<uint32_t,SessionContext*> sessionContexts;
-
-        set<uint32_t> clientsToRemove;
+        NameTable<CoreCommandInfo> coreCommandInfos;
+
+        SlotTable<CoreInstance> coreInstances;
+        SlotTable<SessionContext> sessionContexts;
+        unordered_map<string,CoreInstance*> coreNames; // core instances by name
+        string httpCoreName;    // scratch buffer for looking up the core named in an HTTP request
+        // released sessions, kept for reuse by createSession().
+        ObjectPool<SessionContext> tcpSessionPool;
+        ObjectPool<HTTPSessionContext> httpSessionPool;
+        // the lists below are emptied every main loop iteration, so they keep their memory.
+        vector<uint32_t> finishedConversations;     // HTTP sessions which are shut down as soon as their output is sent
+        vector<uint32_t> readyCores;    // cores which finished a reply and may have more commands queued. may contain duplicates.
+        vector<uint32_t> followersDone; // clients whose coalesced command has just finished, see readFromCore()
+
+        vector<uint32_t> clientsToRemove;
 
         ServCli cli;
 
         map<string,Authority*> authorities;
 
         uint32_t linesFromClients;
+        uint64_t coalescedCommands;     // read commands which got the reply of an identical one, see joinFlight()
         
         bool quit;
         
@@ -786,11 +1243,9 @@ class Graphserv
         }
 
         // find information about a core command
-        CoreCommandInfo *findCoreCommand(const string &name)
+        CoreCommandInfo *findCoreCommand(StrRef name)
         {
-            map<string,CoreCommandInfo>::iterator it= coreCommandInfos.find(name);
-            if(it!=coreCommandInfos.end()) return &it->second;
-            return 0;
+            return coreCommandInfos.find(name);
         }
 
         // initialize the core command info table.
@@ -800,7 +1255,7 @@ class Graphserv
 #define CORECOMMANDS_END
 #define CORECOMMAND(name, level, imp...) ({ \
     CoreCommandInfo cci= { level, #imp };         \
-    coreCommandInfos.insert( pair<string,CoreCommandInfo> (name, cci) ); })
+    coreCommandInfos.insert(name, cci); })
 #include "corecommands.h"
 #undef CORECOMMANDS_BEGIN
 #undef CORECOMMANDS_END
@@ -818,6 +1273,19 @@ class Graphserv
                 logerror("accept()");
                 return 0;
             }
+            return setupConnection(newConnection, type);
+        }
+
+        // create session context for an accepted connection.
+        SessionContext *setupConnection(int newConnection, ConnectionType type)
+        {
+            if(mainLoop==MAINLOOP_SELECT && newConnection>=FD_SETSIZE)
+            {
+                flog(LOG_ERROR, _("socket %d is out of range for select(). use the libevent main loop for more connections.\n"), newConnection);
+                close(newConnection);
+                errno= EMFILE;
+                return 0;
+            }
             else
             {
                 // add new connection
@@ -831,86 +1299,135 @@ class Graphserv
         // create a SessionContext or HTTPSessionContext, depending on connection type
         SessionContext *createSession(int sock, ConnectionType connType= CONN_TCP)
         {
-            uint32_t newID= ++sessionIDCounter;
             if(!closeOnExec(sock)) return 0;
+            uint32_t newID= sessionContexts.add();
+            if(!newID)
+            {
+                flog(LOG_ERROR, "createSession: too many sessions\n");
+                errno= EMFILE;
+                return 0;
+            }
+            if(corkResponses)
+            {
+                // corked sockets send complete frames only, uncorked data should go out immediately.
+                int on= 1;
+                if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))<0)
+                    logerror("setsockopt(TCP_NODELAY)");
+            }
             SessionContext *newSession;
             switch(connType)
             {
-                case CONN_TCP:  newSession= new SessionContext(*this, newID, sock, connType); break;
-                case CONN_HTTP: newSession= new HTTPSessionContext(*this, newID, sock); break;
-                default:        flog(LOG_ERROR, "createSession: unknown connection type %d!\n", connType); return 0;
+                case CONN_TCP:
+                    if( (newSession= tcpSessionPool.get()) ) newSession->reset(newID, sock);
+                    else newSession= new SessionContext(*this, newID, sock, connType);
+                    break;
+                case CONN_HTTP:
+                    HTTPSessionContext *hsc;
+                    if( (hsc= httpSessionPool.get()) ) hsc->reset(newID, sock);
+                    else hsc= new HTTPSessionContext(*this, newID, sock);
+                    newSession= hsc;
+                    break;
+                default:        flog(LOG_ERROR, "createSession: unknown connection type %d!\n", connType); sessionContexts.erase(newID); return 0;
+            }
+            newSession->corkEnabled= corkResponses;
+            newSession->setSpill(spillThreshold, SPILL_FILE_LIMIT);
+            setAccessLevel(*newSession, ACCESS_READ, "");
+            sessionContexts.set(newID, newSession);
+            if(mainLoop==MAINLOOP_SELECT)
+            {
+                // the select loop keeps fd sets up to date, instead of rebuilding them for every call.
+                selectData.sessions.set(sock, newSession);
+                selectData.maxfd= max(selectData.maxfd, sock);
+                FD_SET(sock, &selectData.readfds);
+                newSession->waitWritable= [this, sock] (bool on)
+                    {
+                        if(on) FD_SET(sock, &selectData.writefds);
+                        else FD_CLR(sock, &selectData.writefds);
+                    };
             }
-            sessionContexts.insert( pair<uint32_t,SessionContext*>(newID, newSession) );
             return newSession;
         }
 
         // immediately remove a session.
         bool removeSession(uint32_t sessionID)
         {
-            map<uint32_t,SessionContext*>::iterator it= sessionContexts.find(sessionID);
-            if(it!=sessionContexts.end())
+            SessionContext *sc= sessionContexts.find(sessionID);
+            if(sc)
             {
-                flog(LOG_INFO, "removing client %d, %d sessions active\n", it->second->clientID, sessionContexts.size()-1);
+                flog(LOG_INFO, "removing client %d, %d sessions active\n", sc->clientID, sessionContexts.size()-1);
                 
-                shutdown(it->second->sockfd, SHUT_RDWR);
+                shutdown(sc->sockfd, SHUT_RDWR);
 
-                if(useLibevent)
+                if(sc->shard)
                 {
-                    event_free(it->second->readEvent);
-                    event_free(it->second->writeEvent);
-                    shutdown(it->second->sockfdRead, SHUT_RDWR);
-                    setNonblocking(it->second->sockfdRead, false);
-                    close(it->second->sockfdRead);
-                    libeventData.sessions.erase(it->second->sockfd);
-                    libeventData.sessions.erase(it->second->sockfdRead);
+                    ShardMessage m;
+                    m.type= ShardMessage::REMOVE;
+                    m.clientID= sc->clientID;
+                    m.fd= 0;
+                    sc->shard->post(std::move(m));
+                }
+                else if(mainLoop==MAINLOOP_LIBEVENT)
+                {
+                    freeEvents(sc);
+                    libeventData.sessions.erase(sc->sockfd);
+                }
+                else if(mainLoop==MAINLOOP_SELECT)
+                {
+                    int fd= sc->sockfd;
+                    FD_CLR(fd, &selectData.readfds);
+                    FD_CLR(fd, &selectData.writefds);
+                    selectData.sessions.erase(fd);
+                    while(selectData.maxfd>0 && !selectData.sessions.find(selectData.maxfd))
+                        selectData.maxfd--;
                 }
 
                 CoreInstance *ci;
-                if( it->second->coreID && 
-                    (ci= findInstance(it->second->coreID)) )
+                if( sc->coreID && 
+                    (ci= findInstance(sc->coreID)) )
                 {
-                    CommandQEntry *cqe= ci->findLastClientCommand(it->second->clientID);
+                    CommandQEntry *cqe= ci->findLastClientCommand(sc->clientID);
                     if(cqe && cqe->acceptsData && (!cqe->dataFinished))
                     {
                         flog(LOG_ERROR, _("terminating open data set of connected core '%s' (ID %u)\n"), ci->getName().c_str(), ci->getID());
-                        cqe->appendToDataset("\n\n");
+                        ci->appendToDataset(cqe, "\n", 1);
                     }
                 }
-                delete(it->second);
-                sessionContexts.erase(it);
+                resumeCoreOutput(sc->clientID);
+                sessionContexts.erase(sessionID);
+                // close the connection and keep the session for reuse.
+                sc->release();
+                if(!(sc->connectionType==CONN_HTTP? httpSessionPool.put((HTTPSessionContext*)sc): tcpSessionPool.put(sc)))
+                    delete(sc);
                 return true;
             }
             return false;
         }
 
         public:
+        // the core's command queue takes ce over, it is recycled if it can't be queued.
         void forwardToCore(CommandQEntry *ce, SessionContext &sc)
         {
-            vector<string> words= Cli::splitString(ce->command.c_str(), " \t\n:<>");
-            
             CoreInstance *ci= findInstance(sc.coreID);
             if(ci)
             {
-                CoreCommandInfo *cci= findCoreCommand(words[0]);
-                if(cci)
+                if(mayRunCoreCommand(ce, sc, true))
                 {
-                    AccessLevel al= cci->accessLevel;
-                    if( ce->command.find(">")!=string::npos || ce->command.find("<")!=string::npos )
-                        al= ACCESS_ADMIN;   // i/o redirection requires admin level.
-                    if(sc.accessLevel>=al)
+                    sc.stats.coreCommandsSent++;
+                    chargeClient(sc, 0, 0, 1, getTime());
+                    markCacheInvalidation(ce);
+                    if(joinFlight(ci, ce))
                     {
-                        ci->queueCommand(ce);
-                        ci->flushCommandQ(*this);
+                        CommandQEntry::recycle(ce);
+                        return;
                     }
+                    if(ci->replicaIDs.size())
+                        queueReplicated(ci, ce, queueWeight(sc));
                     else
                     {
-                        sc.forwardStatusline(string(DENIED_STR) + format(_(" insufficient access level (command needs %s, you have %s)\n"),
-                                                                     gAccessLevelNames[al], gAccessLevelNames[sc.accessLevel]));
+                        ci->queueCommand(ce, queueWeight(sc));
+                        ci->flushCommandQ();
                     }
-                }
-                else
-                {
-                    sc.commandNotFound(format(_("no such core command '%s'."), words[0].c_str()));
+                    return;
                 }
             }
             else
@@ -920,200 +1437,733 @@ class Graphserv
                 sc.coreID= 0;
             }
             
-            delete ce;
+            CommandQEntry::recycle(ce);
+        }
+
+        // queue a command for a graph which has read replicas.
+        // read commands go to the instance with the fewest outstanding commands. everything else is run by all
+        // instances; the copies are queued at the same time, so every instance runs writes in the same order.
+        // the client gets the primary's reply, and waits for the replicas too, so that it reads its own writes.
+        void queueReplicated(CoreInstance *primary, CommandQEntry *ce, unsigned weight)
+        {
+            CoreCommandInfo *cci= findCoreCommand(ce->tokens.name(ce->command));
+            if(cci && cci->accessLevel==ACCESS_READ && !ce->tokens.redirected)
+            {
+                CoreInstance *target= primary;
+                for(uint32_t id: primary->replicaIDs)
+                {
+                    CoreInstance *r= findInstance(id);
+                    if(r && r->outstandingCommands()<target->outstandingCommands()) target= r;
+                }
+                target->queueCommand(ce, weight);
+                target->flushCommandQ();
+                return;
+            }
+            ce->ordered= true;
+            for(uint32_t id: primary->replicaIDs)
+            {
+                CoreInstance *r= findInstance(id);
+                if(!r) continue;
+                r->queueCommand(ce->replicaCopy(), weight);
+                r->flushCommandQ();
+            }
+            primary->queueCommand(ce, weight);
+            primary->flushCommandQ();
+        }
+
+        // single flight: a read command identical to one which is queued or waiting for its reply on the graph's
+        // primary instance or a replica is not run again. the client gets the other command's reply.
+        // commands which don't join get the key under which later ones can join them.
+        bool joinFlight(CoreInstance *primary, CommandQEntry *ce)
+        {
+            CoreCommandInfo *cci= findCoreCommand(ce->tokens.name(ce->command));
+            if(!cci || cci->accessLevel>ACCESS_READ || ce->acceptsData) return false;
+            if(ce->cacheKey.size()) ce->flightKey= ce->cacheKey;
+            else if(!resultCache.makeKey(primary->getID(), ce->command, ce->tokens, ce->flightKey)) return false;
+            bool joined= primary->joinFlight(ce);
+            for(size_t i= 0; i<primary->replicaIDs.size() && !joined; i++)
+            {
+                CoreInstance *r= findInstance(primary->replicaIDs[i]);
+                joined= (r && r->joinFlight(ce));
+            }
+            if(joined) coalescedCommands++;
+            return joined;
+        }
+
+        // commands above read level may change the graph. its cached replies are dropped once they have run.
+        void markCacheInvalidation(CommandQEntry *ce)
+        {
+            CoreCommandInfo *cci= findCoreCommand(ce->tokens.name(ce->command));
+            ce->invalidatesCache= (!cci || cci->accessLevel>ACCESS_READ);
+        }
+
+        // answer a read command from the result cache, without going to the core. on a miss, the command gets
+        // the key under which its reply is to be cached. takes ce over if it returns true.
+        bool answerFromCache(CommandQEntry *ce, SessionContext &sc)
+        {
+            if(!resultCache.getBudget() || !findInstance(sc.coreID)) return false;
+            CoreCommandInfo *cci= findCoreCommand(ce->tokens.name(ce->command));
+            if(!cci || cci->accessLevel>ACCESS_READ || ce->acceptsData ||
+               !resultCache.makeKey(sc.coreID, ce->command, ce->tokens, ce->cacheKey))
+                return false;
+            if(sc.accessLevel<cci->accessLevel) return false;   // forwardToCore() reports that.
+            const ResultCache::Entry *e= resultCache.find(ce->cacheKey);
+            if(!e) return false;
+            sc.stats.coreCommandsSent++;
+            chargeClient(sc, 0, 0, 1, getTime());
+            if(e->data.size()) sc.setCorked(true);
+            sc.forwardStatusline(e->status);
+            if(e->data.size())
+            {
+                sc.forwardDatasetChunk(e->data.data(), e->data.size(), true);
+                sc.setCorked(false);
+            }
+            CommandQEntry::recycle(ce);
+            return true;
+        }
+
+        // a session's share of the time of a core which other clients are waiting for.
+        unsigned queueWeight(SessionContext &sc)
+        {
+            static const unsigned weights[]= FAIRQ_WEIGHTS;
+            return weights[sc.accessLevel] * (sc.connectionType==CONN_HTTP? FAIRQ_HTTP_FACTOR: 1);
+        }
+
+        // check whether a client may run a core command. if not, the reason is sent to the client if 'report' is set.
+        bool mayRunCoreCommand(CommandQEntry *ce, SessionContext &sc, bool report)
+        {
+            StrRef name= ce->tokens.name(ce->command);
+            CoreCommandInfo *cci= findCoreCommand(name);
+            if(!cci)
+            {
+                if(report) sc.commandNotFound(format(_("no such core command '%s'."), name.str().c_str()));
+                return false;
+            }
+            AccessLevel al= cci->accessLevel;
+            if(ce->tokens.redirected)
+                al= ACCESS_ADMIN;   // i/o redirection requires admin level.
+            if(sc.accessLevel<al)
+            {
+                if(report) sc.forwardStatusline(string(DENIED_STR) + format(_(" insufficient access level (command needs %s, you have %s)\n"),
+                                                                            gAccessLevelNames[al], gAccessLevelNames[sc.accessLevel]));
+                return false;
+            }
+            return true;
+        }
+
+        // queue a core command whose data set has not arrived yet, so that the data set can be passed on to the core
+        // as it arrives. returns false if the command can't be run. the data set is then buffered, and the error is
+        // reported by processCommand() once it is complete. the core takes ce over if successful.
+        // data sets for graphs with replicas are buffered, to be copied to each instance.
+        bool streamDataset(CommandQEntry *ce, SessionContext &sc)
+        {
+            CoreInstance *ci= findInstance(sc.coreID);
+            if(!ci || ci->replicaIDs.size() || cli.findCommand(ce->tokens.word(ce->command, 0)) || !mayRunCoreCommand(ce, sc, false))
+                return false;
+            sc.stats.coreCommandsSent++;
+            chargeClient(sc, 0, 0, 1, getTime());
+            markCacheInvalidation(ce);
+            sc.curCommand= ci->queueCommand(ce, queueWeight(sc));
+            sc.streamingDataset= true;
+            ci->flushCommandQ();
+            return true;
+        }
+
+        // resume reading from clients whose data set is streamed to a core, once the core has caught up.
+        void resumeDatasetClients()
+        {
+            for(set<uint32_t>::iterator it= datasetPausedClients.begin(); it!=datasetPausedClients.end(); )
+            {
+                SessionContext *sc= findClient(*it);
+                CoreInstance *ci= (sc? findInstance(sc->coreID): NULL);
+                if(ci && sc->streamingDataset && ci->getWritebufferSize()>CORE_WRITEBUFFER_LOW)
+                {
+                    ++it;
+                    continue;
+                }
+                if(sc)
+                {
+                    sc->datasetPaused= false;
+                    updateClientReading(sc);
+                }
+                datasetPausedClients.erase(it++);
+            }
         }
 
         // process a fully transferred command
-        // deletes ce
+        // takes ce over
         void processCommand(CommandQEntry *ce, SessionContext &sc)
         {
-            vector<string> words= Cli::splitString(ce->command.c_str(), " \t\n");
-            if(words.empty()) { delete(ce); return; }
-            ServCmd *cmd= (ServCmd*)cli.findCommand(words[0]);
+            // only server commands need copies of the words. core commands are passed on as they are.
+            if(!ce->tokens.nwords) { CommandQEntry::recycle(ce); return; }
+            StrRef name= ce->tokens.word(ce->command, 0);
+            ServCmd *cmd= cli.findCommand(name);
             if(cmd)
             {
                 // execute server command
                 sc.stats.servCommandsSent++;
                 if(!ce->dataset.empty())  // currently, no server command takes a data set.
-                    sc.forwardStatusline(string(FAIL_STR) + " " + words[0] + _(" accepts no data set.\n"));
-                else if( ce->command.find(">")!=string::npos || ce->command.find("<")!=string::npos )
+                    sc.forwardStatusline(string(FAIL_STR) + " " + name.str() + _(" accepts no data set.\n"));
+                else if(ce->tokens.redirected)
                     sc.forwardStatusline(string(FAIL_STR) + _(" input/output of server commands can't be redirected.\n"));
-                else cli.execute(cmd, words, sc);
-                delete ce;
+                else
+                {
+                    vector<string> words= ce->tokens.strings(ce->command);
+                    cli.execute(cmd, words, sc);
+                }
+                CommandQEntry::recycle(ce);
             }
             else if(sc.coreID)
             {
-                forwardToCore(ce, sc);
+                if(!answerFromCache(ce, sc))
+                    forwardToCore(ce, sc);
             }
             else
             {
                 // no server command and not connected to core
-                sc.commandNotFound(format(_("no such server command '%s'."), words[0].c_str()));
-                delete ce;
+                sc.commandNotFound(format(_("no such server command '%s'."), name.str().c_str()));
+                CommandQEntry::recycle(ce);
+            }
+        }
+        private:
+
+        // deferred removal of clients
+        void removeDeferredClients()
+        {
+            for(size_t i= 0; i<clientsToRemove.size(); i++)
+                removeSession(clientsToRemove[i]);
+            clientsToRemove.clear();
+        }
+
+        // send the next queued commands to the cores which have finished a reply.
+        // commands queued for an idle core are sent right away by forwardToCore(), so no other core needs a look.
+        void flushCommandQueues()
+        {
+            for(size_t i= 0; i<readyCores.size(); i++)
+            {
+                CoreInstance *ci= findInstance(readyCores[i]);
+                if(ci) ci->flushCommandQ();
+            }
+            readyCores.clear();
+        }
+
+        // HTTP clients are disconnected once we don't have any more output for them.
+        // only sessions whose conversation has finished are checked, they stay on the list until their output is drained.
+        void shutdownFinishedConversations()
+        {
+            size_t n= 0;
+            for(size_t i= 0; i<finishedConversations.size(); i++)
+            {
+                SessionContext *sc= findClient(finishedConversations[i]);
+                CoreInstance *ci;
+                if(sc && !sc->shutdownTime &&
+                   !(sc->writeBufferEmpty() && ((ci= findInstance(sc->coreID))==NULL || coreHasDataForClient(ci, sc->clientID)==false)) )
+                {
+                    finishedConversations[n++]= finishedConversations[i];
+                    continue;
+                }
+                if(sc && !sc->shutdownTime)
+                    shutdownClient(sc);
+            }
+            finishedConversations.resize(n);
+        }
+
+        // per-session statistics are collected over periods of SESSION_STATS_PERIOD seconds.
+        // called from the main loop timers, the statistics of all sessions are rolled over together once a period has passed.
+        void rolloverSessionStats(double time)
+        {
+            if(time<statsRolloverTime) return;
+            for(SessionContext *sc: sessionContexts)
+            {
+                sc->stats.normalize(time);
+                // flog(LOG_INFO, "client %u: bytesSent %.2f, linesQueued %.2f, coreCommandsSent %.2f, servCommandsSent %.2f\n",
+                //      sc->clientID, sc->stats.bytesSent, sc->stats.linesQueued, sc->stats.coreCommandsSent, sc->stats.servCommandsSent);
+                sc->stats.reset(time);
+            }
+            statsRolloverTime= time+SESSION_STATS_PERIOD;
+        }
+
+        // read output from a core. returns false if the core has exited and was removed.
+        bool coreReadable(CoreInstance *ci)
+        {
+            ssize_t sz= readFromCore(ci, getTime());
+            if(sz==0)
+            {
+                flog(LOG_INFO, "core %s (ID %u, pid %d) has exited\n", ci->getName().c_str(), ci->getID(), (int)ci->getPid());
+                int status;
+                waitpid(ci->getPid(), &status, 0);  // un-zombify
+                removeCoreInstance(ci);
+                return false;
+            }
+            else if(sz<0)
+            {
+                flog(LOG_ERROR, "i/o error, core %s: %s\n", ci->getName().c_str(), strerror(errno));
+                removeCoreInstance(ci);
+                return false;
+            }
+            return true;
+        }
+
+        // log what a core writes to stderr.
+        void coreStderrReadable(CoreInstance *ci)
+        {
+            deque<string> lines= ci->stderrQ.nextLines(ci->getStderrReadFd());
+            for(deque<string>::const_iterator it= lines.begin(); it!=lines.end(); ++it)
+                flog(LOG_INFO, "[%s] %s", ci->getName().c_str(), it->c_str());
+        }
+
+        // NonblockWriter::waitWritable handler which adds or removes a libevent write event.
+        static function<void(bool)> eventToggle(event *ev)
+        {
+            return [ev] (bool on)
+                {
+                    if(on) event_add(ev, nullptr);
+                    else event_del(ev);
+                };
+        }
+
+        // free the libevent events of a session or core.
+        void freeEvents(SessionContext *sc)
+        {
+            if(sc->readEvent) event_free(sc->readEvent);
+            if(sc->writeEvent) event_free(sc->writeEvent);
+            sc->readEvent= sc->writeEvent= NULL;
+        }
+        void freeEvents(CoreInstance *ci)
+        {
+            if(ci->readEvent) event_free(ci->readEvent);
+            if(ci->stderrReadEvent) event_free(ci->stderrReadEvent);
+            if(ci->writeEvent) event_free(ci->writeEvent);
+            ci->readEvent= ci->stderrReadEvent= ci->writeEvent= NULL;
+        }
+
+        // read data from a core's stdout and forward it to the client which is waiting for it.
+        // returns the result of read(): 0 if the core has exited, <0 on error.
+        ssize_t readFromCore(CoreInstance *ci, double time)
+        {
+            // outbound backpressure: leave the data in the pipe while the client is not keeping up.
+            // this eventually blocks the core, until resumeCoreOutput() is called.
+            SessionContext *client= findClient(ci->getLastClientID());
+            if(client)
+            {
+                size_t pending= client->pendingOutput();
+                if(pending>client->outputPeak) client->outputPeak= pending;
+                if(pending>=writeHighWatermark)
+                {
+                    flog(LOG_INFO, "client %u has %zu bytes of output pending, pausing core %u.\n", client->clientID, pending, ci->getID());
+                    client->outputThrottled++;
+                    ci->outputWaiting= true;
+                    return 1;
+                }
+            }
+#ifdef USE_SPLICE
+            if(ci->canRelayTo(client))
+            {
+                bool clientWasWaiting= (client && client->isWaitingForCoreReply());
+                ssize_t sz= ci->relayDataset(client);
+                if(sz<0 && errno==EAGAIN)
+                    return 1;   // nothing to read after all.
+                if(ci->commandsReady()) readyCores.push_back(ci->getID());
+                if(clientWasWaiting)
+                    execQueuedLines(client, time);
+                return sz;
             }
+#endif
+            static char buf[LineBuffer::READSIZE];
+            ssize_t sz= read(ci->getReadFd(), buf, sizeof(buf));
+            if(sz<=0) return sz;
+            size_t size= LineBuffer::stripCR(buf, sz);
+            for(char *p= buf; size; )
+            {
+                // replicas' copies of a command also hold back the client, so that it reads its own writes.
+                SessionContext *sc= findClient(ci->getCommandClientID());
+                bool clientWasWaiting= (sc && sc->isWaitingForCoreReply());
+                size_t n= ci->dataFromCore(p, size, *this);
+                p+= n, size-= n;
+                if(ci->commandsReady()) readyCores.push_back(ci->getID());
+                // if this was the end of the reply the client was waiting for,
+                // execute its queued commands now.
+                if(clientWasWaiting)
+                    execQueuedLines(sc, time);
+                // the clients which got the reply of an identical command are done waiting as well.
+                ci->takeFinishedFollowers(followersDone);
+                for(uint32_t id: followersDone)
+                    if( (sc= findClient(id)) )
+                        execQueuedLines(sc, time);
+            }
+            return sz;
+        }
+
+        // if a client is no longer waiting for its core, execute the lines it sent in the meantime.
+        void execQueuedLines(SessionContext *sc, double time)
+        {
+            while(!sc->lineQueue.empty() && (sc->isReceivingDataset() || !sc->isWaitingForCoreReply()) && !sc->chokeTime)
+            {
+                string line= sc->popLine();
+                flog(LOG_INFO, "execing queued line from client: '%s", line.c_str());
+                lineFromClient(line.data(), line.size(), *sc, time, true);
+            }
+            checkInputQueue(sc);
+        }
+
+        // inbound backpressure: stop reading from a client whose line queue is full, resume when it has drained.
+        // input which was already received when reading is paused is still queued, so the limits are soft.
+        void checkInputQueue(SessionContext *sc)
+        {
+            if(!sc->inputPaused && sc->inputQueueFull())
+            {
+                flog(LOG_INFO, "client %u has %zu lines queued, pausing input.\n", sc->clientID, sc->lineQueue.size());
+                sc->inputPauses++;
+                sc->inputPaused= true;
+            }
+            else if(sc->inputPaused && sc->inputQueueDrained())
+                sc->inputPaused= false;
+            else
+                return;
+            updateClientReading(sc);
+        }
+
+        // start or stop reading from a client, depending on its line queue and flood control.
+        void updateClientReading(SessionContext *sc)
+        {
+            bool pause= (sc->inputPaused || sc->chokeTime || sc->datasetPaused);
+            if(pause==sc->readPaused) return;
+            sc->readPaused= pause;
+            if(sc->shard)
+            {
+                ShardMessage m;
+                m.type= (pause? ShardMessage::PAUSE: ShardMessage::RESUME);
+                m.clientID= sc->clientID;
+                m.fd= 0;
+                sc->shard->post(std::move(m));
+            }
+            else if(mainLoop==MAINLOOP_LIBEVENT)
+            {
+                if(pause) event_del(sc->readEvent);
+                else event_add(sc->readEvent, nullptr);
+            }
+#ifdef USE_IO_URING
+            else if(mainLoop==MAINLOOP_URING)
+            {
+                // the recv is re-armed when its last completion arrives, if it is still active.
+                if(pause) uringCancel(uringTag(URING_RECV, sc->clientID));
+                else uringRecv(sc);
+            }
+#endif
+            else if(mainLoop==MAINLOOP_SELECT)
+            {
+                if(pause) FD_CLR(sc->sockfd, &selectData.readfds);
+                else FD_SET(sc->sockfd, &selectData.readfds);
+            }
+        }
+
+        // set the access level of a client and apply the flood control limits for it.
+        public:
+        void setAccessLevel(SessionContext &sc, AccessLevel level, const string& user)
+        {
+            double time= getTime();
+            sc.accessLevel= level;
+            sc.userName= user;
+            sc.flood.setLimits(floodLimits[level], 1, time);
+            sc.userFlood= NULL;
+            if(!user.empty())
+            {
+                sc.userFlood= &userFlood[user];
+                sc.userFlood->setLimits(floodLimits[level], FLOOD_USER_FACTOR, time);
+            }
+        }
+
+        void setFloodLimits(AccessLevel level, const FloodLimits &limits)
+        {
+            floodLimits[level]= limits;
         }
         private:
 
-        // handle a line of text arriving from a client.
-        void lineFromClient(string line, SessionContext &sc, double timestamp, bool fromServerQueue= false)
+        // flood control: take tokens from a client's buckets. a client which is over its limits
+        // is not read from until it is back in budget. commands it has sent in the meantime are queued.
+        void chargeClient(SessionContext &sc, double lines, double bytes, double coreCommands, double time)
         {
-            if(line.rfind('\n')!=line.size()-1) line.append("\n");
+            double wait= sc.flood.charge(lines, bytes, coreCommands, time);
+            if(sc.userFlood) wait= max(wait, sc.userFlood->charge(lines, bytes, coreCommands, time));
+            if(wait<=0) return;
+            double until= time+wait;
+            if(until<=sc.chokeTime) return;
+            if(!sc.chokeTime)
+            {
+                flog(LOG_INFO, "client %u is over its flood control limits, not reading for %.3f seconds.\n", sc.clientID, wait);
+                sc.floodWaits++;
+                sc.floodWaitTime+= wait;
+            }
+            else
+                sc.floodWaitTime+= until-sc.chokeTime;
+            sc.chokeTime= until;
+            chokedClients.insert(make_pair(until, sc.clientID));
+            updateClientReading(&sc);
+            armChokeTimer(time);
+        }
+
+        // resume reading from clients whose flood control wait has ended.
+        void unchokeClients(double time)
+        {
+            chokeTimerAt= 0;
+            while(!chokedClients.empty() && chokedClients.begin()->first<=time)
+            {
+                SessionContext *sc= findClient(chokedClients.begin()->second);
+                double until= chokedClients.begin()->first;
+                chokedClients.erase(chokedClients.begin());
+                if(sc && sc->chokeTime==until)
+                {
+                    sc->chokeTime= 0;
+                    updateClientReading(sc);
+                    execQueuedLines(sc, time);
+                }
+            }
+            armChokeTimer(time);
+        }
+
+        // make sure that the main loop calls unchokeClients() when the first flood control wait ends.
+        void armChokeTimer(double time)
+        {
+            if(chokedClients.empty()) return;
+            double when= chokedClients.begin()->first;
+            if(chokeTimerAt && chokeTimerAt<=when) return;
+            chokeTimerAt= when;
+            double delay= max(0.0, when-time);
+            if(mainLoop==MAINLOOP_LIBEVENT)
+            {
+                timeval tv= { time_t(delay), suseconds_t((delay-time_t(delay))*1000000) };
+                evtimer_add(libeventData.chokeTimer, &tv);
+            }
+#ifdef USE_IO_URING
+            else if(mainLoop==MAINLOOP_URING)
+                uringChokeTimer(delay);
+#endif
+            // the select loop adjusts its timeout.
+        }
+
+        // continue reading from cores which were waiting for this client to drain its output.
+        void resumeCoreOutput(uint32_t clientID)
+        {
+            for(CoreInstance *ci: coreInstances)
+            {
+                if(ci->outputWaiting && ci->getLastClientID()==clientID)
+                {
+                    ci->outputWaiting= false;
+                    if(mainLoop==MAINLOOP_LIBEVENT) event_add(ci->readEvent, nullptr);
+#ifdef USE_IO_URING
+                    else if(mainLoop==MAINLOOP_URING) uringArmPoll(ci->getReadFd(), POLLIN, uringTag(URING_CORE_READABLE, ci->getID()));
+#endif
+                }
+            }
+        }
+
+        // read a chunk of data from a client socket and handle all complete lines in it.
+        // returns the result of read().
+        ssize_t readFromClient(SessionContext &sc, int fd, double time)
+        {
+            ssize_t sz= sc.linebuf.readLines(fd, [&] (char *line, size_t len) -> bool
+                {
+                    return clientLine(sc, line, len, time);
+                });
+            checkInputQueue(&sc);
+            return sz;
+        }
+
+        // handle a chunk of data which was received from a client.
+        void dataFromClient(SessionContext &sc, char *data, size_t size, double time)
+        {
+            sc.linebuf.splitLines(data, size, [&] (char *line, size_t len) -> bool
+                {
+                    return clientLine(sc, line, len, time);
+                });
+            checkInputQueue(&sc);
+        }
+
+        // dispatch a complete line from a client. returns false if the rest of the input should be dropped.
+        bool clientLine(SessionContext &sc, char *line, size_t len, double time)
+        {
+            if(sc.removing)
+                return false;
+
+            linesFromClients++;
+            chargeClient(sc, 1, len, 0, time);
+
+            if(sc.connectionType==CONN_HTTP)
+                lineFromHTTPClient(line, len, *(HTTPSessionContext*)&sc, time);
+            else if(sc.isReceivingDataset() && sc.lineQueue.empty())
+            {
+                // data set lines go from the input buffer straight into the command's data set.
+                sc.stats.linesSent++;
+                sc.stats.bytesSent+= len;
+                datasetLine(sc, line, len);
+            }
+            else
+                lineFromClient(line, len, sc, time);
+            return true;
+        }
+
+        // append a line to the data set which a client is sending. the command is processed once the data set is complete.
+        void datasetLine(SessionContext &sc, const char *line, size_t len)
+        {
+            if(sc.streamingDataset)
+            {
+                CoreInstance *ci= findInstance(sc.coreID);
+                if(!ci)
+                {
+                    // terminated, but not removed yet.
+                    abandonStreamedDataset(sc);
+                    datasetLine(sc, line, len);
+                }
+                else if(ci->appendToDataset(sc.curCommand, line, len))
+                {
+                    sc.curCommand= NULL;
+                    sc.streamingDataset= false;
+                }
+                else if(!sc.datasetPaused && ci->getWritebufferSize()>=CORE_WRITEBUFFER_HIGH)
+                {
+                    sc.datasetPaused= true;
+                    datasetPausedClients.insert(sc.clientID);
+                    updateClientReading(&sc);
+                }
+                return;
+            }
+            if(sc.invalidDatasetStatus!=CMD_SUCCESS)
+            {
+                // the rest of a data set which can't be run is dropped.
+                if(CommandQEntry::endsDataset(line, len))
+                {
+                    sc.forwardStatusline(sc.invalidDatasetMsg);
+                    sc.invalidDatasetStatus= CMD_SUCCESS;
+                    sc.invalidDatasetMsg.clear();
+                    CommandQEntry::recycle(sc.curCommand);
+                    sc.curCommand= NULL;
+                }
+                return;
+            }
+            sc.curCommand->appendToDataset(line, len);
+            if(sc.curCommand->flushable())
+            {
+                processCommand(sc.curCommand, sc);
+                sc.curCommand= NULL;
+            }
+        }
+
+        // handle a line of text arriving from a client. a newline is added if the line has none.
+        // the line is copied into the line queue or a new command queue entry. data set lines are appended to
+        // the data set of the current command.
+        void lineFromClient(const char *line, size_t len, SessionContext &sc, double timestamp, bool fromServerQueue= false)
+        {
+            bool newline= (len && line[len-1]=='\n');
             
             sc.stats.linesSent++;
-            sc.stats.bytesSent+= line.length();
+            sc.stats.bytesSent+= len + !newline;
             
             if(sc.curCommand)
             {
-                if(sc.curCommand->acceptsData && (!sc.curCommand->dataFinished))
-                {
-                    sc.curCommand->appendToDataset(line);
-                    if(sc.curCommand->flushable())
-                    {
-                        processCommand(sc.curCommand, sc);
-                        sc.curCommand= NULL;
-                    }
-                }
+                if(sc.isReceivingDataset() && (fromServerQueue || sc.lineQueue.empty()))
+                    datasetLine(sc, line, len);
                 else
                 {
-                    flog(LOG_INFO, "queuing: '%s", line.c_str());
-                    sc.lineQueue.push(line);   // must finish pending core commands first, queue this line for later processing
+                    flog(LOG_INFO, "queuing: '%.*s", (int)len, line);
+                    queueLine(sc, line, len, newline);   // must finish pending core commands first, queue this line for later processing
                 }
             }
             else
             {
                 //flog(LOG_INFO, "new command: %s", line.c_str());
 //                CoreInstance *ci= findInstance(sc.coreID);
-                if(!fromServerQueue && (sc.lineQueue.size() || sc.isWaitingForCoreReply()))  //(ci && ci->hasDataForClient(sc.clientID))))
+                if(!fromServerQueue && (sc.lineQueue.size() || sc.isWaitingForCoreReply() || sc.chokeTime))  //(ci && ci->hasDataForClient(sc.clientID))))
                 {
                     //flog(LOG_INFO, "queuing.\n");
-                    sc.lineQueue.push(line);
+                    queueLine(sc, line, len, newline);
                 }
                 else 
                 {
-                    CommandQEntry *ce= new CommandQEntry(sc.clientID, line);
+                    CommandQEntry *ce= CommandQEntry::create(sc.clientID, line, len);
                     if(ce->flushable())
                         //flog(LOG_INFO, "flushable.\n"),
                         processCommand(ce, sc);
-                    else
+                    else if(!streamDataset(ce, sc))
                         //flog(LOG_INFO, "has data set.\n"),
                         sc.curCommand= ce;
                 }
             }
         }
 
+        // queue a line of a client for later execution.
+        void queueLine(SessionContext &sc, const char *line, size_t len, bool newline)
+        {
+            string s;
+            s.reserve(len+1);
+            s.assign(line, len);
+            if(!newline) s+= '\n';
+            sc.queueLine(std::move(s));
+        }
+
         // handle a line of text arriving from a HTTP client
-        void lineFromHTTPClient(string line, HTTPSessionContext &sc, double timestamp)
+        void lineFromHTTPClient(const char *line, size_t len, HTTPSessionContext &sc, double timestamp)
         {
-            sc.http.request.push_back(line);
-            if(line=="\n")  // end of request. CR is removed by buffering code
+            if(!sc.requestLine(line, len))
+                return;
+            if(const char *error= sc.parseRequest())    // this does not look like an HTTP request. disconnect the client.
             {
-                sc.http.requestString= sc.http.request[0];
-                sc.http.request.clear();    // discard the rest of the header, as we don't currently use it.
-                vector<string> words= Cli::splitString(sc.http.requestString.c_str());
-                if(words.size()!=3)     // this does not look like an HTTP request. disconnect the client.
-                {
-                    flog(LOG_ERROR, _("bad HTTP request string, disconnecting.\n"));
-                    sc.forwardStatusline(string(FAIL_STR) + _(" bad HTTP request string.\n"));
-                    return;
-                }
-                transform(words[2].begin(), words[2].end(),words[2].begin(), ::toupper);
-                if( (words[2]!="HTTP/1.0") && (words[2]!="HTTP/1.1") )  // accept HTTP/1.1 too, if only for debugging.
+                sc.forwardStatusline(string(FAIL_STR) + error);
+                return;
+            }
+
+            const string& uri= sc.http.uri;
+            if(sc.http.coreNameSize)
+            {
+                // split the string: corename/command -> corename, command
+                httpCoreName.assign(uri, 0, sc.http.coreNameSize);
+                const char *command= uri.data()+sc.http.coreNameSize+1;
+                size_t commandSize= uri.size()-sc.http.coreNameSize-1;
+
+//                flog(LOG_INFO, "corename: '%s' command: '%.*s'\n", httpCoreName.c_str(), (int)commandSize, command);
+
+                // immediately connect the client to the core named in the request string,
+                // then execute the requested command.
+                CoreInstance *ci= findNamedInstance(httpCoreName);
+                if(!ci)
                 {
-                    flog(LOG_ERROR, _("unknown HTTP version, disconnecting.\n"));
-                    sc.forwardStatusline(string(FAIL_STR) + _(" unknown HTTP version.\n"));
+                    sc.forwardStatusline(string(FAIL_STR) + " " + _("No such instance.\n"));
                     return;
                 }
 
-                const char *uri= words[1].c_str();
-                int urilen= words[1].size();
-                string transformedURI;
-                transformedURI.reserve(urilen);
-                for(int i= 0; i<urilen; i++)
+                CommandTokens tokens;
+                tokens.parse(command, commandSize);
+                if(tokens.dataset)
                 {
-                    switch(uri[i])
-                    {
-                        case '+':
-                            transformedURI+= ' ';
-                            break;
-                        case '%':
-                            // "%%" -> %
-                            if(i<urilen-1 && uri[i+1]=='%')
-                            {
-                                transformedURI+= '%';
-                                i++;
-                                break;
-                            }
-                            // translate hex string
-                            unsigned hexChar;
-                            if( urilen-i<3 || sscanf(uri+i+1, "%02X", &hexChar)!=1 || !isprint(hexChar) )
-                            {
-                                flog(LOG_ERROR, _("i=%d len=%d %s %02X bad hex in request URI, disconnecting\n"), i, urilen, uri+i+1, hexChar);
-                                sc.forwardStatusline(string(FAIL_STR) + _(" bad hex in request URI.\n"));
-                                return;
-                            }
-                            transformedURI+= (char)hexChar;
-                            i+= 2;
-                            break;
-                        case '/':
-                            // remove first forward slash.
-                            if(i==0) break;
-                            // fall through
-                        default:
-                            transformedURI+= uri[i];
-                            break;
-                    }
+                    sc.forwardStatusline(string(FAIL_STR) + _(" data sets not allowed in HTTP GET requests.\n"));
+                    return;
                 }
 
-                // split the string: /corename/command -> corename, command
-                vector<string> uriwords= Cli::splitString(transformedURI.c_str(), "/");
-
-                if(uriwords.size()>=2)
+                sc.coreID= ci->getID();
+                lineFromClient(command, commandSize, sc, timestamp);
+            }
+            else
+            {
+                if(uri.find_first_not_of(" \t\n")!=string::npos)
                 {
-                    string coreName= uriwords[0],
-                           command= transformedURI.substr(coreName.size()+1, transformedURI.size()-coreName.size()-1);
-
-//                    flog(LOG_INFO, "corename: '%s' command: '%s'\n", coreName.c_str(), command.c_str());
-
-                    // immediately connect the client to the core named in the request string,
-                    // then execute the requested command.
-                    CoreInstance *ci= findNamedInstance(coreName);
-                    if(!ci)
-                    {
-                        sc.forwardStatusline(string(FAIL_STR) + " " + _("No such instance.\n"));
-                        return;
-                    }
-
-                    if(lineIndicatesDataset(command))
+                    CommandTokens tokens;
+                    tokens.parse(uri);
+                    if(tokens.dataset)
                     {
                         sc.forwardStatusline(string(FAIL_STR) + _(" data sets not allowed in HTTP GET requests.\n"));
                         return;
                     }
 
-                    sc.coreID= ci->getID();
-                    lineFromClient(command, sc, timestamp);
+                    // try to execute the request as one command.
+                    lineFromClient(uri.data(), uri.size(), sc, timestamp);
                 }
                 else
                 {
-                    if(Cli::splitString(transformedURI.c_str()).size())
-                    {
-                        if(lineIndicatesDataset(transformedURI))
-                        {
-                            sc.forwardStatusline(string(FAIL_STR) + _(" data sets not allowed in HTTP GET requests.\n"));
-                            return;
-                        }
-
-                        // try to execute the request as one command.
-                        lineFromClient(transformedURI, sc, timestamp);
-                    }
-                    else
-                    {
-                        // empty request string received. return information and disconnect.
-                        flog(LOG_ERROR, _("empty HTTP request string, disconnecting.\n"));
-                        sc.forwardStatusline(format(_("%s this is the GraphServ HTTP module listening on port %d. "
-                                                      "protocol-version is %s. %d core instance(s) running, "
-                                                      "%d client connection(s) active including yours.\n"),
-                                                    SUCCESS_STR, httpPort, stringify(PROTOCOL_VERSION), coreInstances.size(), sessionContexts.size()));
-                    }
+                    // empty request string received. return information and disconnect.
+                    flog(LOG_ERROR, _("empty HTTP request string, disconnecting.\n"));
+                    sc.forwardStatusline(format(_("%s this is the GraphServ HTTP module listening on port %d. "
+                                                  "protocol-version is %s. %d core instance(s) running, "
+                                                  "%d client connection(s) active including yours.\n"),
+                                                SUCCESS_STR, httpPort, stringify(PROTOCOL_VERSION), coreInstances.size(), sessionContexts.size()));
                 }
             }
         }
@@ -48,13 +48,25 @@ class ServCli: public Cli
         ServCli(class Graphserv &_app);
 
         void addCommand(ServCmd *cmd)
-        { commands.push_back(cmd); }
+        {
+            commands.push_back(cmd);
+            commandIndex.insert(cmd->getName(), cmd);
+        }
+
+        // look up a server command without creating a string.
+        using Cli::findCommand;
+        ServCmd *findCommand(StrRef name)
+        {
+            ServCmd **cmd= commandIndex.find(name);
+            return (cmd? *cmd: 0);
+        }
 
         CommandStatus execute(string command, class SessionContext &sc);
         CommandStatus execute(class ServCmd *cmd, vector<string> &words, class SessionContext &sc);
 
     private:
         class Graphserv &app;
+        NameTable<ServCmd*> commandIndex;
 };
 
 
@@ -18,6 +18,32 @@
 #ifndef SESSION_H
 #define SESSION_H
 
+// flood control limits per second. 0 means unlimited.
+struct FloodLimits
+{
+    double lines, bytes, coreCommands;
+};
+
+// flood control state of a session or user.
+struct FloodBuckets
+{
+    TokenBucket lines, bytes, coreCommands;
+
+    void setLimits(const FloodLimits &l, double factor, double time)
+    {
+        lines.setRate(l.lines*factor, l.lines*factor*FLOOD_BURST_SECONDS, time);
+        bytes.setRate(l.bytes*factor, l.bytes*factor*FLOOD_BURST_SECONDS, time);
+        coreCommands.setRate(l.coreCommands*factor, l.coreCommands*factor*FLOOD_BURST_SECONDS, time);
+    }
+
+    // take tokens. returns the number of seconds the client has to wait, or 0.
+    double charge(double nlines, double nbytes, double ncommands, double time)
+    {
+        return max(max(lines.take(nlines, time), bytes.take(nbytes, time)), coreCommands.take(ncommands, time));
+    }
+};
+
+
 // session context with information about and methods for handling a client connection.
 // this base class handles TCP connections.
 struct SessionContext: public NonblockWriter
@@ -27,21 +53,38 @@ struct SessionContext: public NonblockWriter
     ConnectionType connectionType;
     uint32_t coreID;    // non-zero if connected to a core instance
     int sockfd;
-    string linebuf;                 // text which is read from this client is buffered here.
+    LineBuffer linebuf;             // text which is read from this client is buffered here.
     std::queue<string> lineQueue;   // lines which arrive from this client while the session is waiting for core reply are buffered here.
+    size_t lineQueueBytes;          // total size of the lines in lineQueue
+    size_t lineQueuePeak;           // largest number of lines queued
+    bool inputPaused;               // socket is not read because lineQueue is full
+    unsigned inputPauses;           // number of times reading was paused
     class Graphserv &app;
-    double chokeTime;
+    double chokeTime;           // if nonzero, the client is over its flood control limits and is not read from until then.
+    FloodBuckets flood;         // per-session flood control
+    FloodBuckets *userFlood;    // flood control shared by all sessions of the authorized user, or NULL
+    string userName;            // authorized user, or empty
+    unsigned floodWaits;        // number of times the client was throttled
+    double floodWaitTime;       // total time the client was throttled
+    bool readPaused;            // socket is not read because of the line queue, flood control or a data set stream
+    bool datasetPaused;         // socket is not read because the core which the data set is streamed to is behind
     // this is set when a client sends an invalid command with a data set.
     // the data set must be read and discarded.
     CommandStatus invalidDatasetStatus;
     string invalidDatasetMsg;   // the status line to send after invalid data set has been read
     double shutdownTime;        // time when shutdown was called on the socket, or 0 if the connection is running.
+    bool removing;              // the session is about to be removed and is not found any more.
+    bool corkEnabled;           // cork the socket while a data set is sent (-C)
+    bool corked;
     
     CommandQEntry *curCommand;  // if non-NULL, command which is currently being transferred to the server but not yet processed
+    bool streamingDataset;      // curCommand is in the command queue of the session's core, its data set is passed on as it arrives
     
-    event *readEvent, *writeEvent;          // libevent read and write events for sockfd
-    int sockfdRead;                         // libevent doesn't support mixing edge- and level triggered events on the same fd, so
-                                            // we need to dup() the socket fd for the read event...
+    event *readEvent, *writeEvent;          // libevent read and write events for sockfd. the write event is only added while output is pending.
+    SessionShard *shard;                    // worker thread which owns the socket, or NULL if the main loop does i/o for this session.
+    shared_ptr<ShardCounters> shardCounters;    // input and output bytes in transit between the main thread and the shard
+    size_t outputPeak;          // largest amount of pending output seen
+    unsigned outputThrottled;   // number of times a core was paused because this client had too much output pending
     
     // some statistics about this connection. currently mostly used for debugging.
     struct Stats
@@ -69,25 +112,124 @@ struct SessionContext: public NonblockWriter
 
 
 	SessionContext(class Graphserv &app_, uint32_t cID, int sock, ConnectionType connType):
-		clientID(cID), accessLevel(ACCESS_READ), connectionType(connType), 
-		coreID(0), sockfd(sock), app(app_),
-		chokeTime(0), invalidDatasetStatus(CMD_SUCCESS), shutdownTime(0), 
-        curCommand(NULL)
+		connectionType(connType), sockfd(-1), app(app_), curCommand(NULL)
 	{
-		setWriteFd(sockfd);
+		reset(cID, sock);
 	}
 
     virtual ~SessionContext()
     {
-        setNonblocking(sockfd, false);  // force output to be drained on close.
-        flog(LOG_INFO, "closing session context socket %d\n", sockfd);
-        close(sockfd);
-        if(curCommand) delete(curCommand);
+        release();
+    }
+
+    // set up a new connection. sessions are recycled: this is called on a released session instead of creating a new one.
+    // buffers are emptied, but keep their memory.
+    void reset(uint32_t cID, int sock)
+    {
+        clientID= cID; accessLevel= ACCESS_READ;
+        coreID= 0; sockfd= sock;
+        linebuf.clear();
+        while(!lineQueue.empty()) lineQueue.pop();
+        lineQueueBytes= lineQueuePeak= 0; inputPaused= false; inputPauses= 0;
+        chokeTime= 0; userFlood= NULL; userName.clear(); floodWaits= 0; floodWaitTime= 0; readPaused= datasetPaused= false;
+        invalidDatasetStatus= CMD_SUCCESS; invalidDatasetMsg.clear(); shutdownTime= 0; removing= false;
+        corkEnabled= corked= false;
+        curCommand= NULL; streamingDataset= false;
+        readEvent= writeEvent= NULL; shard= NULL; shardCounters.reset();
+        outputPeak= 0; outputThrottled= 0;
+        stats.reset();
+        setWriteFd(sockfd);
+    }
+
+    // close the connection and drop the current command and any pending output.
+    void release()
+    {
+        if(sockfd>=0 && !shard)  // otherwise, the shard closes the socket.
+        {
+            setNonblocking(sockfd, false);  // force output to be drained on close.
+            flog(LOG_INFO, "closing session context socket %d\n", sockfd);
+            close(sockfd);
+        }
+        sockfd= -1;
+        if(curCommand && !streamingDataset) CommandQEntry::recycle(curCommand);
+        curCommand= NULL;
+        NonblockWriter::reset();
+    }
+
+    // sessions owned by a shard hand their buffered output to the shard's thread instead of writing it.
+    bool flush()
+    {
+        if(!shard) return NonblockWriter::flush();
+        ShardMessage m;
+        shardCounters->output+= getWritebufferSize();
+        takeBuffer(m.data);
+        if(!m.data.empty())
+        {
+            m.type= ShardMessage::DATA;
+            m.clientID= clientID;
+            m.fd= 0;
+            shard->post(std::move(m));
+        }
+        return true;
     }
     
+    // queue a line for later execution.
+    void queueLine(string&& line)
+    {
+        lineQueueBytes+= line.size();
+        lineQueue.push(std::move(line));
+        lineQueuePeak= max(lineQueuePeak, lineQueue.size());
+        stats.linesQueued++;
+    }
+
+    // remove the first line from the queue and return it.
+    string popLine()
+    {
+        string line= std::move(lineQueue.front());
+        lineQueueBytes-= line.size();
+        lineQueue.pop();
+        return line;
+    }
+
+    // true if the line queue has reached its limit.
+    bool inputQueueFull()
+    {
+        return lineQueue.size()>=INPUT_QUEUE_MAX_LINES || lineQueueBytes>=INPUT_QUEUE_MAX_BYTES;
+    }
+
+    // true if the line queue has drained far enough to resume reading.
+    bool inputQueueDrained()
+    {
+        return lineQueue.size()<=INPUT_QUEUE_MAX_LINES/2 && lineQueueBytes<=INPUT_QUEUE_MAX_BYTES/2;
+    }
+
+    // number of bytes written to this session which have not reached the socket yet.
+    size_t pendingOutput()
+    {
+        return getWritebufferSize() + (shardCounters? shardCounters->output.load(std::memory_order_relaxed): 0);
+    }
+
     // true if this session is waiting for a reply from its connected core instance.
     bool isWaitingForCoreReply();
 
+    // true if the lines from this client are data set lines for curCommand.
+    bool isReceivingDataset()
+    {
+        return curCommand && curCommand->acceptsData && !curCommand->dataFinished;
+    }
+
+    // hold back partial TCP frames while a data set is being sent.
+    void setCorked(bool on)
+    {
+#ifdef TCP_CORK
+        if(!corkEnabled || on==corked) return;
+        int v= on;
+        if(setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &v, sizeof(v))<0)
+            logerror("setsockopt(TCP_CORK)");
+        corked= on;
+#endif
+    }
+
     // write-error callback
     void writeFailed(int _errno);
 
@@ -104,6 +246,14 @@ struct SessionContext: public NonblockWriter
         write(line);
     }
 
+    // forward a part of a data set from a core to the client. 'finished' is true if the chunk ends with the
+    // empty line which terminates the data set.
+    virtual void forwardDatasetChunk(const char *data, size_t size, bool finished)
+    {
+        // default for tcp: just write out the data to the client.
+        write(data, size);
+    }
+
     // send string to client indicating that a command was not found.
     // there has to be a special case for this in the http handling code
     // to change the http status-code, therefore this is virtual.
@@ -121,12 +271,16 @@ struct HTTPSessionContext: SessionContext
 {
     bool conversationFinished;  // client will be disconnected when this is false and there's no buffered data left.
 
+    // the request line is kept, the rest of the header is not used. the request URI is decoded into 'uri'.
+    // the buffers are kept when the session is recycled.
     struct HttpClientState
     {
-        vector<string> request;
         string requestString;
+        unsigned headerLines;
+        string uri;
+        size_t coreNameSize;    // the URI starts with "corename/" if this is nonzero
         unsigned commandsExecuted;
-        HttpClientState(): commandsExecuted(0) { }
+        HttpClientState(): headerLines(0), coreNameSize(0), commandsExecuted(0) { }
     } http;
 
     HTTPSessionContext(class Graphserv &app_, uint32_t cID, int sock):
@@ -135,6 +289,91 @@ struct HTTPSessionContext: SessionContext
     {
     }
 
+    void reset(uint32_t cID, int sock)
+    {
+        SessionContext::reset(cID, sock);
+        conversationFinished= false;
+        http.requestString.clear();
+        http.headerLines= 0;
+        http.uri.clear();
+        http.coreNameSize= 0;
+        http.commandsExecuted= 0;
+    }
+
+    // add a line of the request header. returns true once the header is complete.
+    bool requestLine(const char *line, size_t len)
+    {
+        if(!http.headerLines++) http.requestString.assign(line, len);
+        if(len!=1 || line[0]!='\n') return false;  // end of request. CR is removed by buffering code
+        http.headerLines= 0;
+        return true;
+    }
+
+    // parse the request line and decode the URI. returns NULL on success, or a message for the client.
+    const char *parseRequest()
+    {
+        CommandTokens words;
+        words.parse(http.requestString);
+        if(words.nwords!=3)     // this does not look like an HTTP request.
+        {
+            flog(LOG_ERROR, _("bad HTTP request string, disconnecting.\n"));
+            return _(" bad HTTP request string.\n");
+        }
+        StrRef version= words.word(http.requestString, 2);
+        if( version.size!=8 || (strncasecmp(version.data, "HTTP/1.0", 8) && strncasecmp(version.data, "HTTP/1.1", 8)) )  // accept HTTP/1.1 too, if only for debugging.
+        {
+            flog(LOG_ERROR, _("unknown HTTP version, disconnecting.\n"));
+            return _(" unknown HTTP version.\n");
+        }
+
+        StrRef requestURI= words.word(http.requestString, 1);
+        const char *uri= requestURI.data;
+        size_t urilen= requestURI.size;
+        http.uri.clear();
+        for(size_t i= 0; i<urilen; i++)
+        {
+            switch(uri[i])
+            {
+                case '+':
+                    http.uri+= ' ';
+                    break;
+                case '%':
+                    // "%%" -> %
+                    if(i+1<urilen && uri[i+1]=='%')
+                    {
+                        http.uri+= '%';
+                        i++;
+                        break;
+                    }
+                    // translate hex string
+                    unsigned hexChar;
+                    if( i+2>=urilen || sscanf(uri+i+1, "%02X", &hexChar)!=1 || !isprint(hexChar) )
+                    {
+                        flog(LOG_ERROR, _("i=%zu len=%zu %.*s %02X bad hex in request URI, disconnecting\n"), i, urilen, int(urilen-i-1), uri+i+1, hexChar);
+                        return _(" bad hex in request URI.\n");
+                    }
+                    http.uri+= (char)hexChar;
+                    i+= 2;
+                    break;
+                case '/':
+                    // remove first forward slash.
+                    if(i==0) break;
+                    // fall through
+                default:
+                    http.uri+= uri[i];
+                    break;
+            }
+        }
+
+        // /corename/command -> corename, command
+        size_t slash= http.uri.find('/');
+        if(slash!=string::npos && slash>0 && http.uri.find_first_not_of('/', slash)!=string::npos)
+            http.coreNameSize= slash;
+        else
+            http.coreNameSize= 0;
+        return NULL;
+    }
+
     void httpWriteResponseHeader(int code, const string &title, const string &contentType, const string &optionalField= "")
     {
         writef("HTTP/1.0 %d %s\r\n", code, title.c_str());
@@ -164,6 +403,9 @@ struct HTTPSessionContext: SessionContext
         httpWriteErrorBody(title, description);
     }
 
+    // mark the client to be disconnected once its output is sent.
+    void finishConversation();
+
     // forward statusline to http client, possibly mark client to be disconnected
     void forwardStatusline(const string& line);
 
@@ -171,15 +413,22 @@ struct HTTPSessionContext: SessionContext
     void forwardDataset(const string& line)
     {
         write(line);
-        if(Cli::splitString(line.c_str()).empty())
-            conversationFinished= true; // empty line marks end of data set, we're ready to disconnect.
+        if(line.find_first_not_of(" \t\n")==string::npos)
+            finishConversation();   // empty line marks end of data set, we're ready to disconnect.
+    }
+
+    void forwardDatasetChunk(const char *data, size_t size, bool finished)
+    {
+        write(data, size);
+        if(finished)
+            finishConversation();
     }
 
     virtual void commandNotFound(const string& text)
     {
         // special case: send http status code 501 instead of 400.
         httpWriteErrorResponse(501, "Not Implemented", string(FAIL_STR) + " " + text);
-        conversationFinished= true;
+        finishConversation();
     }
 };
 
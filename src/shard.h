@@ -0,0 +1,426 @@
+// Graph Processor server component.
+// (c) Wikimedia Deutschland, written by Johannes Kroll in 2011, 2012
+// worker threads for client socket i/o.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SHARD_H
+#define SHARD_H
+
+// lock-free queue for exactly one producer thread and one consumer thread.
+// the consumer always keeps the last node it has read, so the two threads never touch the same node's link.
+template<typename T> class SPSCQueue
+{
+    public:
+        SPSCQueue()
+        {
+            head= tail= new Node();
+        }
+
+        ~SPSCQueue()
+        {
+            while(head)
+            {
+                Node *next= head->next.load(std::memory_order_relaxed);
+                delete head;
+                head= next;
+            }
+        }
+
+        // producer side.
+        void push(T&& value)
+        {
+            Node *n= new Node();
+            n->value= std::move(value);
+            tail->next.store(n, std::memory_order_release);
+            tail= n;
+        }
+
+        // consumer side. returns false if the queue is empty.
+        bool pop(T& value)
+        {
+            Node *next= head->next.load(std::memory_order_acquire);
+            if(!next) return false;
+            value= std::move(next->value);
+            delete head;
+            head= next;
+            return true;
+        }
+
+    private:
+        struct Node
+        {
+            T value;
+            std::atomic<Node*> next;
+            Node(): next(NULL) {}
+        };
+        Node *head;     // consumer
+        Node *tail;     // producer
+};
+
+
+// byte counts shared by a session in the main thread and its connection in a shard.
+struct ShardCounters
+{
+    std::atomic<size_t> output;     // bytes posted to the shard which were not written to the socket yet
+    std::atomic<size_t> input;      // bytes posted to the main thread which it has not handled yet
+    ShardCounters(): output(0), input(0) {}
+};
+
+// messages between the main thread and a shard.
+struct ShardMessage
+{
+    enum Type
+    {
+        // main thread -> shard
+        ADD,        // take over socket 'fd' for client 'clientID'
+        DATA,       // write 'data' to the client
+        SHUTDOWN,   // shut the socket down once everything is written
+        REMOVE,     // forget the client and close its socket
+        PAUSE,      // stop reading from the client
+        RESUME,     // continue reading from the client
+        CONSUMED,   // the main thread has caught up with the client's input
+        // shard -> main thread
+        INPUT,      // complete lines received from the client, in data[0]
+        CLOSED,     // connection was closed. 'fd' holds errno, or 0 on EOF.
+        DRAINED     // the client's pending output dropped below the low watermark.
+    };
+    Type type;
+    uint32_t clientID;
+    int fd;
+    deque<string> data;
+    shared_ptr<ShardCounters> counters;     // ADD: counters shared with the session
+};
+
+
+// a worker thread with its own event loop which owns the sockets of a subset of all sessions.
+// the shard does socket reads and writes and splits the input at line boundaries.
+// everything else, including all session and core state, stays in the main thread.
+// the two sides talk through a pair of SPSC queues and wake each other up with eventfds.
+// since each client is handled by exactly one shard and the queues are FIFO, commands and replies keep their order.
+class SessionShard
+{
+    public:
+        SessionShard(int _index, size_t _lowWatermark, size_t _spillThreshold):
+            index(_index), lowWatermark(_lowWatermark), spillThreshold(_spillThreshold), base(NULL), wakeEvent(NULL), quit(false), wakePending(false), mainWakePending(false)
+        {
+            toShardFd= eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+            toMainFd= eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        }
+
+        ~SessionShard()
+        {
+            stop();
+            close(toShardFd);
+            close(toMainFd);
+        }
+
+        bool start()
+        {
+            if(toShardFd<0 || toMainFd<0 || !(base= event_base_new()))
+                return false;
+            wakeEvent= event_new(base, toShardFd, EV_READ|EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
+                {
+                    ((SessionShard*)arg)->handleMessages();
+                }, this);
+            event_add(wakeEvent, nullptr);
+            thread= std::thread(&SessionShard::run, this);
+            return true;
+        }
+
+        // stop the thread. sockets which are still open are closed.
+        void stop()
+        {
+            if(!thread.joinable()) return;
+            quit= true;
+            notify(toShardFd);
+            thread.join();
+        }
+
+        // main thread side: queue a message. the shard is woken up by wake().
+        void post(ShardMessage &&m)
+        {
+            toShard.push(std::move(m));
+            wakePending= true;
+        }
+
+        // main thread side: wake the shard if something was posted since the last call.
+        void wake()
+        {
+            if(wakePending) notify(toShardFd), wakePending= false;
+        }
+
+        // main thread side: fetch a message from the shard.
+        bool receive(ShardMessage &m)
+        {
+            return fromShard.pop(m);
+        }
+
+        // main thread side: readable when the shard has posted messages. read it with clearNotification().
+        int getNotifyFd() { return toMainFd; }
+
+        void clearNotification()
+        {
+            uint64_t v;
+            while(::read(toMainFd, &v, sizeof(v))>0);
+        }
+
+        int getIndex() { return index; }
+
+    private:
+        // a client connection, as seen from the shard.
+        struct Connection: public NonblockWriter
+        {
+            SessionShard &shard;
+            uint32_t clientID;
+            int fd;
+            event *readEvent, *writeEvent;
+            string partial;         // incomplete line
+            shared_ptr<ShardCounters> counters;     // shared with the main thread's session
+            bool inputPaused;       // reading was paused by the main thread
+            bool reading;           // read event is active
+            bool shutdownPending;   // shut down the socket after the write buffer is drained
+            bool closed;            // CLOSED was reported to the main thread
+
+            Connection(SessionShard &_shard, uint32_t _clientID, int _fd):
+                shard(_shard), clientID(_clientID), fd(_fd), readEvent(NULL), writeEvent(NULL),
+                inputPaused(false), reading(false), shutdownPending(false), closed(false)
+            {
+                setWriteFd(fd);
+            }
+
+            ~Connection()
+            {
+                if(readEvent) event_free(readEvent);
+                if(writeEvent) event_free(writeEvent);
+                // output still buffered here is dropped. the main thread removes a session once its output was
+                // flushed and the socket shut down, or when the client is gone.
+                close(fd);
+            }
+
+            void writeFailed(int _errno)
+            {
+                shard.connectionClosed(this, _errno);
+            }
+
+            // keep the pending byte count up to date and tell the main thread when it drops below the low watermark.
+            // data moved to the spill file counts as written.
+            bool flush()
+            {
+                size_t before= getWritebufferSize();
+                bool ret= NonblockWriter::flush();
+                size_t written= before-getWritebufferSize();
+                if(written)
+                {
+                    size_t old= counters->output.fetch_sub(written);
+                    if(old>=shard.lowWatermark && old-written<shard.lowWatermark)
+                    {
+                        ShardMessage m;
+                        m.type= ShardMessage::DRAINED;
+                        m.clientID= clientID;
+                        m.fd= 0;
+                        shard.postToMain(std::move(m));
+                    }
+                }
+                return ret;
+            }
+        };
+
+        int index;
+        size_t lowWatermark;
+        size_t spillThreshold;
+        std::thread thread;
+        event_base *base;
+        event *wakeEvent;
+        int toShardFd, toMainFd;
+        SPSCQueue<ShardMessage> toShard, fromShard;
+        std::atomic<bool> quit;
+        bool wakePending;           // written only by the main thread
+        bool mainWakePending;       // written only by the shard thread
+        map<uint32_t, Connection*> connections;
+
+        static void notify(int fd)
+        {
+            uint64_t one= 1;
+            if(::write(fd, &one, sizeof(one))<0 && errno!=EAGAIN)
+                logerror("eventfd write");
+        }
+
+        void run()
+        {
+            mainWakePending= false;
+            while(!quit)
+            {
+                if(event_base_loop(base, EVLOOP_ONCE)<0)
+                {
+                    flog(LOG_CRIT, "shard %d: event_base_loop() failed\n", index);
+                    break;
+                }
+                NonblockWriter::flushDirty();
+                if(mainWakePending) notify(toMainFd), mainWakePending= false;
+            }
+            for(map<uint32_t, Connection*>::iterator it= connections.begin(); it!=connections.end(); ++it)
+                delete it->second;
+            connections.clear();
+            event_free(wakeEvent);
+            event_base_free(base);
+            wakeEvent= NULL;
+            base= NULL;
+        }
+
+        void postToMain(ShardMessage &&m)
+        {
+            fromShard.push(std::move(m));
+            mainWakePending= true;
+        }
+
+        Connection *findConnection(uint32_t clientID)
+        {
+            map<uint32_t, Connection*>::iterator it= connections.find(clientID);
+            return (it==connections.end()? NULL: it->second);
+        }
+
+        void handleMessages()
+        {
+            uint64_t v;
+            while(::read(toShardFd, &v, sizeof(v))>0);
+            ShardMessage m;
+            while(toShard.pop(m))
+            {
+                Connection *c= findConnection(m.clientID);
+                switch(m.type)
+                {
+                    case ShardMessage::ADD:
+                        addConnection(m.clientID, m.fd, m.counters);
+                        break;
+                    case ShardMessage::DATA:
+                        if(!c || c->closed) break;
+                        for(deque<string>::iterator it= m.data.begin(); it!=m.data.end(); ++it)
+                            c->write(std::move(*it));
+                        break;
+                    case ShardMessage::SHUTDOWN:
+                        if(!c) break;
+                        c->shutdownPending= true;
+                        if(c->flush()) shutdownConnection(c);
+                        break;
+                    case ShardMessage::PAUSE:
+                    case ShardMessage::RESUME:
+                        if(!c) break;
+                        c->inputPaused= (m.type==ShardMessage::PAUSE);
+                        updateReading(c);
+                        break;
+                    case ShardMessage::CONSUMED:
+                        if(c) updateReading(c);
+                        break;
+                    case ShardMessage::REMOVE:
+                        if(!c) break;
+                        connections.erase(m.clientID);
+                        delete c;
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        void addConnection(uint32_t clientID, int fd, const shared_ptr<ShardCounters> &counters)
+        {
+            Connection *c= new Connection(*this, clientID, fd);
+            c->counters= counters;
+            c->setSpill(spillThreshold, SPILL_FILE_LIMIT);
+            connections[clientID]= c;
+            c->readEvent= event_new(base, fd, EV_READ|EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
+                {
+                    Connection *c= (Connection*)arg;
+                    c->shard.readable(c);
+                }, c);
+            c->writeEvent= event_new(base, fd, EV_WRITE|EV_PERSIST, [](evutil_socket_t fd, short what, void *arg)
+                {
+                    Connection *c= (Connection*)arg;
+                    if(c->flush() && c->shutdownPending)
+                        c->shard.shutdownConnection(c);
+                }, c);
+            event *writeEvent= c->writeEvent;
+            c->waitWritable= [writeEvent] (bool on)
+                {
+                    if(on) event_add(writeEvent, nullptr);
+                    else event_del(writeEvent);
+                };
+            updateReading(c);
+        }
+
+        // read from a connection unless the main thread paused it, or has not caught up with its input yet.
+        void updateReading(Connection *c)
+        {
+            bool on= !c->closed && !c->inputPaused && c->counters->input<SHARD_INPUT_LIMIT;
+            if(on==c->reading) return;
+            c->reading= on;
+            if(on) event_add(c->readEvent, nullptr);
+            else event_del(c->readEvent);
+        }
+
+        void shutdownConnection(Connection *c)
+        {
+            c->shutdownPending= false;
+            if(shutdown(c->fd, SHUT_RDWR)<0)
+                connectionClosed(c, errno);
+            // otherwise, the main thread is notified once read() returns 0.
+        }
+
+        // read from a client and pass complete lines on to the main thread.
+        void readable(Connection *c)
+        {
+            static thread_local char buf[LineBuffer::READSIZE];
+            ssize_t sz= ::read(c->fd, buf, sizeof(buf));
+            if(sz>0)
+            {
+                char *nl= (char*)memrchr(buf, '\n', sz);
+                if(!nl)
+                {
+                    c->partial.append(buf, sz);
+                    return;
+                }
+                ShardMessage m;
+                m.type= ShardMessage::INPUT;
+                m.clientID= c->clientID;
+                m.fd= 0;
+                m.data.push_back(std::move(c->partial));
+                m.data.back().append(buf, nl+1-buf);
+                c->partial.assign(nl+1, buf+sz-(nl+1));
+                c->counters->input+= m.data.back().size();
+                postToMain(std::move(m));
+                updateReading(c);
+            }
+            else if(sz==0 || (errno!=EAGAIN && errno!=EINTR))
+                connectionClosed(c, sz==0? 0: errno);
+        }
+
+        // report a closed connection. the socket stays open until the main thread sends REMOVE.
+        void connectionClosed(Connection *c, int _errno)
+        {
+            if(c->closed) return;
+            c->closed= true;
+            c->waitWritable= nullptr;
+            c->reading= false;
+            event_del(c->readEvent);
+            event_del(c->writeEvent);
+            ShardMessage m;
+            m.type= ShardMessage::CLOSED;
+            m.clientID= c->clientID;
+            m.fd= _errno;
+            postToMain(std::move(m));
+        }
+};
+
+#endif // SHARD_H
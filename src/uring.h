@@ -0,0 +1,170 @@
+// Graph Processor server component.
+// (c) Wikimedia Deutschland, written by Johannes Kroll in 2011, 2012
+// minimal io_uring wrapper.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef URING_H
+#define URING_H
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// a submission/completion ring pair with one group of provided receive buffers.
+// talks to the kernel directly, so there is no dependency on liburing.
+// SQEs are collected with getSqe() and handed to the kernel in one go by submit().
+class IoUring
+{
+    public:
+        IoUring(): ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes((io_uring_sqe*)MAP_FAILED),
+            sqeTail(0), sqeSubmitted(0), bufMem(0), bufSize(0), bufGroup(0)
+        { }
+
+        ~IoUring()
+        {
+            free(bufMem);
+            if(sqes!=MAP_FAILED) munmap(sqes, params.sq_entries*sizeof(io_uring_sqe));
+            if(cqRing!=MAP_FAILED && cqRing!=sqRing) munmap(cqRing, cqRingSize);
+            if(sqRing!=MAP_FAILED) munmap(sqRing, sqRingSize);
+            if(ringFd>=0) close(ringFd);
+        }
+
+        // set up the rings. returns false and sets errno on failure.
+        bool init(unsigned entries, unsigned cqEntries)
+        {
+            memset(&params, 0, sizeof(params));
+            params.flags= IORING_SETUP_CQSIZE;
+            params.cq_entries= cqEntries;
+            if((ringFd= syscall(__NR_io_uring_setup, entries, &params))<0)
+                return false;
+
+            sqRingSize= params.sq_off.array + params.sq_entries*sizeof(unsigned);
+            cqRingSize= params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+            if(params.features & IORING_FEAT_SINGLE_MMAP)
+                sqRingSize= cqRingSize= max(sqRingSize, cqRingSize);
+            sqRing= mmap(0, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            if(sqRing==MAP_FAILED) return false;
+            if(params.features & IORING_FEAT_SINGLE_MMAP)
+                cqRing= sqRing;
+            else if((cqRing= mmap(0, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_CQ_RING))==MAP_FAILED)
+                return false;
+            sqes= (io_uring_sqe*)mmap(0, params.sq_entries*sizeof(io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, IORING_OFF_SQES);
+            if(sqes==MAP_FAILED) return false;
+
+            sqHead= (unsigned*)((char*)sqRing + params.sq_off.head);
+            sqTail= (unsigned*)((char*)sqRing + params.sq_off.tail);
+            sqMask= *(unsigned*)((char*)sqRing + params.sq_off.ring_mask);
+            sqArray= (unsigned*)((char*)sqRing + params.sq_off.array);
+            cqHead= (unsigned*)((char*)cqRing + params.cq_off.head);
+            cqTail= (unsigned*)((char*)cqRing + params.cq_off.tail);
+            cqMask= *(unsigned*)((char*)cqRing + params.cq_off.ring_mask);
+            cqes= (io_uring_cqe*)((char*)cqRing + params.cq_off.cqes);
+            sqeTail= sqeSubmitted= *sqTail;
+            return true;
+        }
+
+        // provide 'count' receive buffers of 'size' bytes each as buffer group 'group'.
+        // the buffers are handed to the kernel with the next submit().
+        bool setupBuffers(uint16_t group, unsigned count, unsigned size)
+        {
+            bufGroup= group;
+            bufSize= size;
+            if(!(bufMem= (char*)malloc(size_t(count)*size))) return false;
+            io_uring_sqe *sqe= getSqe();
+            sqe->opcode= IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd= count;
+            sqe->addr= (uint64_t)(uintptr_t)bufMem;
+            sqe->len= size;
+            sqe->off= 0;
+            sqe->buf_group= group;
+            return true;
+        }
+
+        char *buffer(uint16_t bid) { return bufMem + size_t(bid)*bufSize; }
+
+        // give a receive buffer back to the kernel. this is queued like any other request.
+        void returnBuffer(uint16_t bid)
+        {
+            io_uring_sqe *sqe= getSqe();
+            sqe->opcode= IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd= 1;
+            sqe->addr= (uint64_t)(uintptr_t)buffer(bid);
+            sqe->len= bufSize;
+            sqe->off= bid;
+            sqe->buf_group= bufGroup;
+            sqe->flags= IOSQE_CQE_SKIP_SUCCESS;
+        }
+
+        // get a cleared SQE. submits pending SQEs if the submission ring is full.
+        io_uring_sqe *getSqe()
+        {
+            if(sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= params.sq_entries)
+                submit(0);
+            unsigned idx= sqeTail & sqMask;
+            io_uring_sqe *sqe= &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqArray[idx]= idx;
+            sqeTail++;
+            return sqe;
+        }
+
+        // hand all new SQEs to the kernel, optionally waiting for at least waitNr completions.
+        // returns the result of io_uring_enter().
+        int submit(unsigned waitNr)
+        {
+            __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+            unsigned toSubmit= sqeTail - sqeSubmitted;
+            int ret= syscall(__NR_io_uring_enter, ringFd, toSubmit, waitNr, (waitNr? IORING_ENTER_GETEVENTS: 0), NULL, 0);
+            if(ret>0) sqeSubmitted+= ret;
+            return ret;
+        }
+
+        // call fn(const io_uring_cqe&) for each available completion. returns the number of completions.
+        template<typename Fn> unsigned forEachCqe(Fn fn)
+        {
+            unsigned n= 0;
+            unsigned head= *cqHead;
+            while(head!=__atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            {
+                io_uring_cqe cqe= cqes[head & cqMask];
+                // release the slot before handling, the handler might submit more work.
+                __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+                fn(cqe);
+                n++;
+            }
+            return n;
+        }
+
+    private:
+        int ringFd;
+        io_uring_params params;
+        void *sqRing, *cqRing;
+        size_t sqRingSize, cqRingSize;
+        io_uring_sqe *sqes;
+        unsigned *sqHead, *sqTail, *sqArray, sqMask;
+        unsigned *cqHead, *cqTail, cqMask;
+        io_uring_cqe *cqes;
+        unsigned sqeTail;           // local tail, published on submit()
+        unsigned sqeSubmitted;      // SQEs consumed by the kernel so far
+        char *bufMem;           // receive buffers
+        unsigned bufSize;
+        uint16_t bufGroup;
+};
+
+#endif // USE_IO_URING
+
+#endif // URING_H
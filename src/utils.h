@@ -18,6 +18,8 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <unordered_map>
+
 extern uint32_t logMask;
 
 void flog(Loglevel level, const char *fmt, ...)
@@ -90,53 +92,825 @@ inline bool closeOnExec(int fd)
     return true;
 }
 
+// token bucket rate limiter. tokens are refilled at 'rate' per second, up to 'burst'.
+// taking tokens always succeeds, but can leave a debt which has to be paid off by waiting.
+struct TokenBucket
+{
+    double rate, burst, tokens, lastTime;
+
+    TokenBucket(): rate(0), burst(0), tokens(0), lastTime(0) {}
+
+    // set the rate. a rate of 0 means unlimited. the bucket is refilled if the rate changes.
+    void setRate(double _rate, double _burst, double time)
+    {
+        if(_rate==rate) return;
+        rate= _rate;
+        burst= tokens= _burst;
+        lastTime= time;
+    }
+
+    // take n tokens. returns the number of seconds until the bucket is out of debt, or 0.
+    double take(double n, double time)
+    {
+        if(rate<=0) return 0;
+        tokens= min(burst, tokens + (time-lastTime)*rate);
+        lastTime= time;
+        tokens-= n;
+        return (tokens<0? -tokens/rate: 0);
+    }
+};
+
+// create an unlinked temporary file in $TMPDIR or /tmp. returns the fd, or -1 on error.
+inline int openTempFile()
+{
+    const char *dir= getenv("TMPDIR");
+    if(!dir || !*dir) dir= "/tmp";
+#ifdef O_TMPFILE
+    int fd= open(dir, O_TMPFILE|O_RDWR|O_CLOEXEC, 0600);
+    if(fd>=0) return fd;
+#endif
+    string name= string(dir) + "/graphserv-XXXXXX";
+    int fd2= mkostemp(&name[0], O_CLOEXEC);
+    if(fd2>=0) unlink(name.c_str());
+    return fd2;
+}
+
+
+// a part of a string, referenced without copying.
+struct StrRef
+{
+    const char *data;
+    size_t size;
+
+    StrRef(): data(""), size(0) {}
+    StrRef(const char *_data, size_t _size): data(_data), size(_size) {}
+    StrRef(const string& s): data(s.data()), size(s.size()) {}
+
+    string str() const { return string(data, size); }
+
+    int compare(const string& s) const
+    {
+        int r= memcmp(data, s.data(), min(size, s.size()));
+        if(r) return r;
+        return (size<s.size()? -1: size>s.size()? 1: 0);
+    }
+};
+
+// a command line split into words at spaces, tabs and newlines. nothing is copied or allocated: the words
+// are kept as offsets into the line, so they stay valid when the line string is moved.
+struct CommandTokens
+{
+    enum { MAXWORDS= 16 };      // only this many words are stored, further words are only counted
+    struct Word { uint32_t begin, size; };
+    Word words[MAXWORDS];
+    unsigned nwords;            // number of words in the line
+    uint32_t nameSize;          // size of the command name: the first word, up to a ':', '<' or '>'
+    bool redirected;            // the line contains '<' or '>'
+    bool dataset;               // the line ends with ':', a data set follows
+
+    CommandTokens(): nwords(0), nameSize(0), redirected(false), dataset(false) {}
+
+    void parse(const string& line)
+    {
+        parse(line.data(), line.size());
+    }
+
+    void parse(const char *p, size_t len)
+    {
+        size_t i= 0;
+        nwords= 0;
+        nameSize= 0;
+        redirected= dataset= false;
+        while(true)
+        {
+            while(i<len && isSeparator(p[i])) i++;
+            if(i==len) break;
+            size_t begin= i;
+            for( ; i<len && !isSeparator(p[i]); i++)
+                if(p[i]=='<' || p[i]=='>') redirected= true;
+            if(nwords<MAXWORDS)
+                words[nwords].begin= begin,
+                words[nwords].size= i-begin;
+            nwords++;
+            dataset= (p[i-1]==':');
+        }
+        if(nwords)
+            for(nameSize= 0; nameSize<words[0].size && !strchr(":<>", p[words[0].begin+nameSize]); nameSize++) ;
+    }
+
+    // word i of the line which was parsed.
+    StrRef word(const string& line, unsigned i) const
+    {
+        return StrRef(line.data()+words[i].begin, words[i].size);
+    }
+
+    // the command name, as used to look up core commands.
+    StrRef name(const string& line) const
+    {
+        return StrRef(line.data()+(nwords? words[0].begin: 0), nameSize);
+    }
+
+    // copies of all words, as Cli::splitString returns them.
+    vector<string> strings(const string& line) const
+    {
+        if(nwords>MAXWORDS) return Cli::splitString(line.c_str(), " \t\n");
+        vector<string> ret;
+        ret.reserve(nwords);
+        for(unsigned i= 0; i<nwords; i++)
+            ret.push_back(word(line, i).str());
+        return ret;
+    }
+
+    static bool isSeparator(char c) { return c==' ' || c=='\t' || c=='\n'; }
+};
+
+// a table of named entries. names are looked up without creating a string.
+template<typename T> class NameTable
+{
+    public:
+        void insert(const string& name, const T& value)
+        {
+            typename entries_t::iterator it= lower_bound(entries.begin(), entries.end(), name,
+                [] (const pair<string,T>& e, const string& n) { return e.first<n; });
+            if(it!=entries.end() && it->first==name) it->second= value;
+            else entries.insert(it, make_pair(name, value));
+        }
+
+        T *find(StrRef name)
+        {
+            typename entries_t::iterator it= lower_bound(entries.begin(), entries.end(), name,
+                [] (const pair<string,T>& e, StrRef n) { return n.compare(e.first)>0; });
+            if(it!=entries.end() && name.compare(it->first)==0) return &it->second;
+            return 0;
+        }
+
+    private:
+        typedef vector< pair<string,T> > entries_t;
+        entries_t entries;
+};
+
+// a free list of objects which are created and destroyed all the time. recycled objects keep their memory and
+// the capacity of their buffers. the owner resets them before use. at most 'limit' objects are kept.
+template<typename T> class ObjectPool
+{
+    public:
+        ObjectPool(size_t limit_): limit(limit_) { }
+
+        ~ObjectPool()
+        {
+            for(size_t i= 0; i<objects.size(); i++)
+                delete objects[i];
+        }
+
+        // a recycled object, or NULL if there is none.
+        T *get()
+        {
+            if(objects.empty()) return NULL;
+            T *o= objects.back();
+            objects.pop_back();
+            return o;
+        }
+
+        // keep an object for reuse. returns false if the pool is full, the caller deletes the object then.
+        bool put(T *o)
+        {
+            if(objects.size()>=limit) return false;
+            objects.push_back(o);
+            return true;
+        }
+
+        size_t size() { return objects.size(); }
+
+    private:
+        vector<T*> objects;
+        size_t limit;
+};
+
+// a FIFO queue in a ring buffer. unlike a deque, it does not allocate when elements are added and removed in
+// turn, and an empty queue holds no memory until the first element is added. the buffer only grows.
+template<typename T> class RingQueue
+{
+    public:
+        RingQueue(): head(0), count(0) { }
+
+        bool empty() const { return !count; }
+        size_t size() const { return count; }
+
+        T& front() { return ring[head]; }
+        T& back() { return (*this)[count-1]; }
+        T& operator[](size_t i) { return ring[(head+i) & (ring.size()-1)]; }
+
+        void push_back(T&& value)
+        {
+            if(count==ring.size()) grow();
+            (*this)[count++]= std::move(value);
+        }
+
+        void push_back(const T& value)
+        {
+            push_back(T(value));
+        }
+
+        // remove the first element. its memory is freed.
+        void pop_front()
+        {
+            T empty= T();
+            std::swap(ring[head], empty);
+            head= (head+1) & (ring.size()-1);
+            count--;
+        }
+
+        void clear()
+        {
+            while(count) pop_front();
+        }
+
+    private:
+        vector<T> ring;     // the size is 0 or a power of two
+        size_t head, count;
+
+        void grow()
+        {
+            vector<T> r(max((size_t)8, ring.size()*2));
+            for(size_t i= 0; i<count; i++)
+                std::swap(r[i], (*this)[i]);
+            ring.swap(r);
+            head= 0;
+        }
+};
+
+// deficit round robin across clients. each client's items are kept in the order they were added; clients with
+// items take turns. at the start of its turn, a client gets quantum*weight of credit, and its items go first as long
+// as it has credit left. items are paid for with charge(), when their cost is known, which may be after they were
+// handled. a client which used more than its share waits for as many turns as it needs to pay off its debt.
+// the debt of a client which has nothing queued any more is forgotten, and credit is not saved up while idle.
+template<typename T> class FairQueue
+{
+    public:
+        FairQueue(double _quantum): quantum(_quantum), count(0) { }
+
+        bool empty() const { return !count; }
+        size_t size() const { return count; }
+
+        void push(uint32_t client, const T& item, unsigned weight)
+        {
+            Client& c= clients[client];
+            c.items.push_back(item);
+            c.weight= weight;
+            if(!c.active)
+            {
+                c.active= true;
+                round.push_back(client);
+            }
+            count++;
+        }
+
+        // returns the client whose item goes next, or 0 if there is none.
+        // eligible(item) tells whether a client's first item may go now; clients whose item may not are passed over.
+        // the returned client's item must be removed with pop() before next() is called again.
+        template<typename Pred> uint32_t next(Pred eligible)
+        {
+            while(round.size())
+            {
+                size_t n= round.size(), passed= 0;
+                for(size_t i= 0; i<n; i++)
+                {
+                    uint32_t id= round.front();
+                    Client& c= clients.find(id)->second;
+                    if(!eligible(c.items.front()))
+                        passed++;
+                    else
+                    {
+                        if(!c.turn) c.credit+= quantum*c.weight, c.turn= true;
+                        if(c.credit>0) return id;
+                    }
+                    c.turn= false;
+                    round.pop_front();
+                    round.push_back(id);
+                }
+                if(passed==n) return 0;
+                // nobody has credit left. skip ahead the number of rounds it takes for the first client to be back in credit.
+                double rounds= -1;
+                for(size_t i= 0; i<n; i++)
+                {
+                    Client& c= clients.find(round[i])->second;
+                    double r= -c.credit/(quantum*c.weight);
+                    if(eligible(c.items.front()) && (rounds<0 || r<rounds)) rounds= r;
+                }
+                rounds= (double)(uint64_t)rounds;   // whole rounds
+                for(size_t i= 0; i<n; i++)
+                {
+                    Client& c= clients.find(round[i])->second;
+                    c.credit+= rounds*quantum*c.weight;
+                }
+            }
+            return 0;
+        }
+
+        uint32_t next()
+        {
+            return next([] (const T&) { return true; });
+        }
+
+        // returns the client whose first item has the highest score(item) of those which are eligible, or 0 if there
+        // is none. clients with equal scores go in turn. the client's turn begins, its item must be removed with pop().
+        template<typename Score, typename Pred> uint32_t best(Score score, Pred eligible)
+        {
+            size_t n= round.size(), besti= n;
+            double bestScore= 0;
+            for(size_t i= 0; i<n; i++)
+            {
+                T& item= clients.find(round[i])->second.items.front();
+                if(!eligible(item)) continue;
+                double s= score(item);
+                if(besti==n || s>bestScore) besti= i, bestScore= s;
+            }
+            if(besti==n) return 0;
+            for(size_t i= 0; i<besti; i++)
+            {
+                uint32_t id= round.front();
+                clients.find(id)->second.turn= false;
+                round.pop_front();
+                round.push_back(id);
+            }
+            return round.front();
+        }
+
+        T& front(uint32_t client)
+        {
+            return clients.find(client)->second.items.front();
+        }
+
+        // the item which was added last for a client, or T() if the client has nothing queued.
+        T last(uint32_t client)
+        {
+            typename clients_t::iterator it= clients.find(client);
+            return (it==clients.end() || it->second.items.empty()? T(): it->second.items.back());
+        }
+
+        // remove the first item of the client returned by next().
+        void pop(uint32_t client)
+        {
+            Client& c= clients.find(client)->second;
+            c.items.pop_front();
+            count--;
+            if(c.items.empty())
+            {
+                // the client leaves the round. it is forgotten once its last item is paid for.
+                c.active= c.turn= false;
+                if(c.credit>0) c.credit= 0;
+                round.pop_front();
+            }
+        }
+
+        void charge(uint32_t client, double cost)
+        {
+            typename clients_t::iterator it= clients.find(client);
+            if(it==clients.end()) return;
+            it->second.credit-= cost;
+            if(!it->second.active) clients.erase(it);
+        }
+
+        template<typename F> void forEach(F fn)
+        {
+            for(typename clients_t::iterator it= clients.begin(); it!=clients.end(); ++it)
+                for(size_t i= 0; i<it->second.items.size(); i++)
+                    fn(it->second.items[i]);
+        }
+
+    private:
+        struct Client
+        {
+            RingQueue<T> items;
+            unsigned weight;
+            double credit;
+            bool active;    // in the round, has items
+            bool turn;      // it is this client's turn, it got its credit for it
+            Client(): weight(1), credit(0), active(false), turn(false) { }
+        };
+        typedef unordered_map<uint32_t,Client> clients_t;
+        clients_t clients;
+        RingQueue<uint32_t> round;  // active clients, the one whose turn it is first
+        double quantum;
+        size_t count;
+};
+
+// an LRU cache of core replies to read commands, keyed by graph and command line, within a memory budget.
+// a graph's replies are dropped all at once by counting up the graph's generation, which is part of the key:
+// the old entries are not found any more, and are evicted as the least recently used ones.
+class ResultCache
+{
+    public:
+        struct Entry
+        {
+            string status;          // status line
+            string data;            // data set, including the terminating empty line, if any
+            const string *key;
+            Entry *prev, *next;     // in order of use, most recent first
+        };
+
+        struct Stats
+        {
+            uint64_t hits, misses, bytesSaved, evictions;
+            Stats(): hits(0), misses(0), bytesSaved(0), evictions(0) { }
+        };
+
+        ResultCache(size_t _budget): budget(_budget), used(0)
+        {
+            lru.prev= lru.next= &lru;
+        }
+
+        // the budget in bytes. 0 disables the cache.
+        void setBudget(size_t b)
+        {
+            budget= b;
+            evict();
+        }
+        size_t getBudget() { return budget; }
+
+        // make the key for a command line of a graph: the graph's ID and generation, and the words of the command
+        // separated by single spaces. returns false if the command can't be cached.
+        bool makeKey(uint32_t graphID, const string& command, const CommandTokens& tokens, string& key)
+        {
+            if(!tokens.nwords || tokens.nwords>CommandTokens::MAXWORDS || tokens.redirected || tokens.dataset)
+                return false;
+            char buf[48];
+            snprintf(buf, sizeof(buf), "%u.%llu", graphID, (unsigned long long)generations[graphID]);
+            key.assign(buf);
+            for(unsigned i= 0; i<tokens.nwords; i++)
+            {
+                StrRef w= tokens.word(command, i);
+                key+= ' ';
+                key.append(w.data, w.size);
+            }
+            return true;
+        }
+
+        // look up a reply. it becomes the most recently used one.
+        const Entry *find(const string& key)
+        {
+            entries_t::iterator it= entries.find(key);
+            if(it==entries.end())
+            {
+                stats.misses++;
+                return NULL;
+            }
+            Entry *e= &it->second;
+            unlink(e);
+            link(e);
+            stats.hits++;
+            stats.bytesSaved+= e->status.size() + e->data.size();
+            return e;
+        }
+
+        void insert(const string& key, const string& status, const string& data)
+        {
+            size_t size= entrySize(key, status, data);
+            if(size>budget/4) return;   // one reply shouldn't push out everything else
+            pair<entries_t::iterator,bool> r= entries.insert(entries_t::value_type(key, Entry()));
+            Entry *e= &r.first->second;
+            if(r.second)
+                e->key= &r.first->first;
+            else
+            {
+                used-= entrySize(key, e->status, e->data);
+                unlink(e);
+            }
+            e->status= status;
+            e->data= data;
+            link(e);
+            used+= size;
+            evict();
+        }
+
+        // drop the cached replies of a graph.
+        void invalidate(uint32_t graphID)
+        {
+            generations[graphID]++;
+        }
+
+        // the graph has gone away.
+        void forget(uint32_t graphID)
+        {
+            generations.erase(graphID);
+        }
+
+        size_t bytes() { return used; }
+        size_t size() { return entries.size(); }
+
+        Stats stats;
+
+    private:
+        typedef unordered_map<string,Entry> entries_t;
+        entries_t entries;
+        unordered_map<uint32_t,uint64_t> generations;
+        Entry lru;          // list head
+        size_t budget, used;
+
+        static size_t entrySize(const string& key, const string& status, const string& data)
+        {
+            return key.size() + status.size() + data.size() + sizeof(Entry) + 64;  // roughly what the map adds
+        }
+
+        void link(Entry *e)
+        {
+            e->prev= &lru;
+            e->next= lru.next;
+            lru.next->prev= e;
+            lru.next= e;
+        }
+
+        void unlink(Entry *e)
+        {
+            e->prev->next= e->next;
+            e->next->prev= e->prev;
+        }
+
+        void evict()
+        {
+            while(used>budget && lru.prev!=&lru)
+            {
+                Entry *e= lru.prev;
+                unlink(e);
+                used-= entrySize(*e->key, e->status, e->data);
+                entries.erase(entries.find(*e->key));
+                stats.evictions++;
+            }
+        }
+};
+
+// a table of objects indexed by ID. an ID is made of a slot index and the generation of the slot,
+// which is counted up when the slot is freed. so the ID of a removed object is not found any more,
+// even if its slot has been reused. freed slots are reused in order, and only once REUSE_DELAY of
+// them are waiting, so that the same ID comes up again only after millions of others.
+// slot 0 is never used: no ID is 0.
+template<typename T> class SlotTable
+{
+    public:
+        enum { INDEX_BITS= 20, MAX_SLOTS= 1<<INDEX_BITS, REUSE_DELAY= 1024 };
+
+        class iterator
+        {
+            public:
+                iterator(const SlotTable *t, size_t i): table(t), index(i) { skip(); }
+                T *operator*() const { return table->slots[index].value; }
+                iterator& operator++() { index++; skip(); return *this; }
+                bool operator!=(const iterator& o) const { return index!=o.index; }
+            private:
+                const SlotTable *table;
+                size_t index;
+                void skip() { while(index<table->slots.size() && !table->slots[index].value) index++; }
+        };
+
+        SlotTable(): count(0) { slots.resize(1); }
+
+        // allocate a slot for value, which may be NULL until set() is called. returns the new ID, or 0 if the table is full.
+        uint32_t add(T *value= NULL)
+        {
+            uint32_t index;
+            if(freeSlots.size()>REUSE_DELAY || (slots.size()>=MAX_SLOTS && !freeSlots.empty()))
+                index= freeSlots.front(),
+                freeSlots.pop_front();
+            else if(slots.size()<MAX_SLOTS)
+                index= slots.size(),
+                slots.push_back(Slot());
+            else
+                return 0;
+            slots[index].value= value;
+            count++;
+            return (slots[index].generation<<INDEX_BITS) | index;
+        }
+
+        void set(uint32_t id, T *value)
+        {
+            if(Slot *s= slot(id)) s->value= value;
+        }
+
+        T *find(uint32_t id) const
+        {
+            const Slot *s= const_cast<SlotTable*>(this)->slot(id);
+            return (s? s->value: NULL);
+        }
+
+        bool erase(uint32_t id)
+        {
+            Slot *s= slot(id);
+            if(!s) return false;
+            s->value= NULL;
+            s->generation= (s->generation+1) & ((1<<(32-INDEX_BITS))-1);
+            freeSlots.push_back(id & (MAX_SLOTS-1));
+            count--;
+            return true;
+        }
+
+        size_t size() const { return count; }
+        iterator begin() const { return iterator(this, 1); }
+        iterator end() const { return iterator(this, slots.size()); }
+
+    private:
+        struct Slot
+        {
+            T *value;
+            uint32_t generation;
+            Slot(): value(NULL), generation(0) { }
+        };
+        vector<Slot> slots;
+        deque<uint32_t> freeSlots;
+        size_t count;
+
+        Slot *slot(uint32_t id)
+        {
+            uint32_t index= id & (MAX_SLOTS-1);
+            if(!index || index>=slots.size() || slots[index].generation!=(id>>INDEX_BITS)) return NULL;
+            return &slots[index];
+        }
+};
+
+// a table of objects indexed by file descriptor.
+template<typename T> class FdTable
+{
+    public:
+        void set(int fd, T *value)
+        {
+            if(fd<0) return;
+            if((size_t)fd>=slots.size()) slots.resize(fd+1);
+            slots[fd]= value;
+        }
+
+        void erase(int fd)
+        {
+            if(fd>=0 && (size_t)fd<slots.size()) slots[fd]= NULL;
+        }
+
+        T *find(int fd) const
+        {
+            return (fd>=0 && (size_t)fd<slots.size()? slots[fd]: NULL);
+        }
+
+    private:
+        vector<T*> slots;
+};
 
 
 // translate status-string to status-code
-inline CommandStatus getStatusCode(const string& msg)
+inline CommandStatus getStatusCode(StrRef msg)
 {
     for(unsigned i= 0; i<sizeof(statusMsgs)/sizeof(statusMsgs[0]); i++)
-        if(statusMsgs[i]==msg)
+        if(msg.compare(statusMsgs[i])==0)
             return (CommandStatus)i;
-    flog(LOG_ERROR, _("getStatusCode called with bad string %s. Please report this bug.\n"), msg.c_str());
+    flog(LOG_ERROR, _("getStatusCode called with bad string %s. Please report this bug.\n"), msg.str().c_str());
     return CMD_FAILURE;
 }
 
 
 
 // base class for handling buffered writes to a non-blocking fd.
+// buffered data is kept in a chain of chunks. small writes are appended to the last chunk,
+// large strings are moved into the chain as they are. flush() hands as many chunks as possible
+// to the kernel with one writev() call.
+// writes are not flushed immediately. the writer is put on a list instead, and the main loop
+// calls flushDirty() once per iteration, so everything written in one iteration goes out together.
+// optionally, when more than a threshold is buffered for an fd which is not writable, the buffer is
+// spilled to an unlinked temporary file, which is sent with sendfile() before anything written later.
 class NonblockWriter
 {
     public:
-        NonblockWriter(): fd(-1) {}
+        enum { CHUNKSIZE= 16*1024 };    // small writes are collected into chunks of up to this size
+
+        // counters for all writers. writes - syscalls is the number of syscalls saved by buffering.
+        // relayed counts data set bytes spliced from cores to clients past the writers.
+        struct Stats
+        {
+            std::atomic<uint64_t> writes, syscalls, spilled, relayed;
+        };
+
+        NonblockWriter(): fd(-1), frontOffset(0), bufferedBytes(0), dirty(false), blocked(false),
+            spillFd(-1), spillRead(0), spillWrite(0), spillPunched(0), spillThreshold(0), spillLimit(0) {}
+
+        virtual ~NonblockWriter()
+        {
+            reset();
+        }
+
+        // drop buffered output and forget the fd, so that the writer can be used again.
+        void reset()
+        {
+            if(dirty)
+            {
+                vector<NonblockWriter*> &l= dirtyList();
+                l.erase(std::find(l.begin(), l.end(), this));
+                dirty= false;
+            }
+            if(spillFd>=0) close(spillFd);
+            spillFd= -1;
+            spillRead= spillWrite= spillPunched= 0;
+            while(!buffer.empty())
+                releaseChunk(buffer.front()),
+                buffer.pop_front();
+            fd= -1;
+            frontOffset= bufferedBytes= 0;
+            blocked= false;
+            waitWritable= nullptr;
+        }
+
+        // spill the buffer to a file when more than 'threshold' bytes are waiting for the fd, keeping at most
+        // 'limit' bytes in the file. beyond that, data stays in memory again. a threshold of 0 disables spilling.
+        void setSpill(size_t threshold, size_t limit)
+        {
+            spillThreshold= threshold;
+            spillLimit= limit;
+        }
 
         void setWriteFd(int _fd) { fd= _fd; setNonblocking(fd); }
 
+        static Stats &stats()
+        {
+            static Stats s;     // zero-initialized, shared by all threads
+            return s;
+        }
+
+        // flush all writers of the calling thread which were written to since the last call.
+        static void flushDirty()
+        {
+            vector<NonblockWriter*> &l= dirtyList();
+            for(size_t i= 0; i<l.size(); i++)
+                l[i]->dirty= false,
+                l[i]->flush();
+            l.clear();
+        }
+
         // try flushing the write buffer.
-        bool flush()
+        virtual bool flush()
         {
+            if(spillFd>=0)
+            {
+                spill();    // everything in memory was written after what is in the file.
+                if(!flushSpill())
+                {
+                    setBlocked(true);
+                    return false;
+                }
+            }
             while(!buffer.empty())
             {
-                size_t sz= writeString(buffer.front());
-                if(sz==buffer.front().size())
-                    buffer.pop_front();
-                else
+                iovec iov[IOV_MAX];
+                size_t total;
+                int niov= getChunks(iov, total);
+                size_t sz= writeChunks(iov, niov);
+                consume(sz);
+                if(sz<total)
                 {
-                    buffer.front().erase(0, sz);
+                    // fd is not writable at the moment. the main loop flushes once it is.
+                    if(spillThreshold && bufferedBytes>spillThreshold)
+                        spill();
+                    setBlocked(true);
                     return false;
                 }
             }
+            setBlocked(false);
             return true;
         }
 
         bool writeBufferEmpty()
-        { return buffer.empty(); }
+        { return buffer.empty() && spillFd<0; }
 
         // write or buffer a string.
-        void write(const string s)
+        void write(const string& s)
+        {
+            write(s.data(), s.size());
+        }
+
+        // write or buffer a string. large strings are moved into the buffer without copying.
+        void write(string&& s)
+        {
+            if(s.size()<CHUNKSIZE/2)
+                write(s.data(), s.size());
+            else
+            {
+                stats().writes++;
+                bufferedBytes+= s.size();
+                buffer.push_back(std::move(s));
+                markDirty();
+            }
+        }
+
+        // write or buffer a block of data.
+        void write(const char *data, size_t size)
         {
-            buffer.push_back(s);
-            flush();
+            if(!size) return;
+            if(buffer.empty() || buffer.back().size()+size>CHUNKSIZE)
+            {
+                buffer.push_back(string());
+                if(size<=CHUNKSIZE && !spareChunks().empty())
+                    buffer.back().swap(spareChunks().back()),
+                    spareChunks().pop_back();
+                else
+                    buffer.back().reserve(max(size, (size_t)CHUNKSIZE));
+            }
+            buffer.back().append(data, size);
+            bufferedBytes+= size;
+            stats().writes++;
+            markDirty();
         }
 
         // write or buffer a printf-style string.
@@ -145,31 +919,180 @@ class NonblockWriter
             char c[2048];
             va_list ap;
             va_start(ap, fmt);
-            vsnprintf(c, sizeof(c), fmt, ap);
+            int len= vsnprintf(c, sizeof(c), fmt, ap);
             va_end(ap);
-            write(c);
+            if(len>=(int)sizeof(c)) len= sizeof(c)-1;
+            if(len>0) write(c, len);
         }
 
-        // calculate the size of the write buffer in bytes.
+        // the number of bytes buffered in memory.
         size_t getWritebufferSize()
         {
-            size_t ret= 0;
-            for(deque<string>::iterator it= buffer.begin(); it!=buffer.end(); ++it)
-                ret+= it->length();
-            return ret;
+            return bufferedBytes;
+        }
+
+        // the number of bytes waiting in the spill file.
+        size_t getSpillSize()
+        {
+            return spillWrite-spillRead;
         }
 
         // error callback.
         virtual void writeFailed(int _errno)= 0;
 
+        // set by the main loop. called with true when the fd could not take all buffered data, and with false
+        // once the buffer has been drained, so that the fd is only watched for writability while needed.
+        function<void(bool)> waitWritable;
+
+    protected:
+        // move all buffered data to 'out', leaving the write buffer empty.
+        void takeBuffer(deque<string> &out)
+        {
+            if(buffer.empty()) return;
+            if(frontOffset) buffer.front().erase(0, frontOffset);
+            frontOffset= 0;
+            bufferedBytes= 0;
+            for(size_t i= 0; i<buffer.size(); i++)
+                out.push_back(std::move(buffer[i]));
+            buffer.clear();
+        }
+
     private:
         int fd;
-        deque<string> buffer;
+        RingQueue<string> buffer;   // chunks of buffered data
+        size_t frontOffset;     // number of bytes of the first chunk which were already written
+        size_t bufferedBytes;   // total number of bytes buffered
+        bool dirty;             // on the list of writers to flush
+        bool blocked;           // the last flush could not write everything
+        int spillFd;            // unlinked temporary file holding data which comes before the buffer, or -1
+        off_t spillRead, spillWrite;    // read and write positions in the spill file
+        off_t spillPunched;     // the file was deallocated up to here
+        size_t spillThreshold, spillLimit;
+
+        static vector<NonblockWriter*> &dirtyList()
+        {
+            static thread_local vector<NonblockWriter*> l;
+            return l;
+        }
+
+        // empty chunks which were written out, kept for reuse by all writers of the thread.
+        static vector<string> &spareChunks()
+        {
+            static thread_local vector<string> l;
+            return l;
+        }
+
+        // keep a chunk for reuse if it has the usual size.
+        static void releaseChunk(string &chunk)
+        {
+            vector<string> &l= spareChunks();
+            if(chunk.capacity()<CHUNKSIZE || chunk.capacity()>2*CHUNKSIZE || l.size()>=WRITER_SPARE_CHUNKS) return;
+            chunk.clear();
+            l.push_back(string());
+            l.back().swap(chunk);
+        }
+
+        void setBlocked(bool b)
+        {
+            if(b==blocked) return;
+            blocked= b;
+            if(waitWritable) waitWritable(b);
+        }
+
+        // blocked writers are flushed once their fd is writable, unless they spill. those are flushed
+        // every iteration so that new data is moved out of memory.
+        void markDirty()
+        {
+            if(dirty || (blocked && !spillThreshold)) return;
+            dirty= true;
+            dirtyList().push_back(this);
+        }
+
+        // fill iov with the buffered chunks. returns the number of entries used and the number of bytes in 'total'.
+        int getChunks(iovec *iov, size_t &total)
+        {
+            int niov= 0;
+            total= 0;
+            for( ; (size_t)niov<buffer.size() && niov<IOV_MAX; ++niov)
+                iov[niov].iov_base= (void*)buffer[niov].data(),
+                iov[niov].iov_len= buffer[niov].size(),
+                total+= buffer[niov].size();
+            iov[0].iov_base= (char*)iov[0].iov_base + frontOffset;
+            iov[0].iov_len-= frontOffset;
+            total-= frontOffset;
+            return niov;
+        }
+
+        // remove sz bytes from the front of the buffer.
+        void consume(size_t sz)
+        {
+            bufferedBytes-= sz;
+            sz+= frontOffset;
+            while(!buffer.empty() && sz>=buffer.front().size())
+            {
+                sz-= buffer.front().size();
+                releaseChunk(buffer.front());
+                buffer.pop_front();
+            }
+            frontOffset= sz;
+        }
+
+        // append the buffer to the spill file, creating it if necessary.
+        void spill()
+        {
+            while(!buffer.empty() && getSpillSize()<spillLimit)
+            {
+                if(spillFd<0 && (spillFd= openTempFile())<0)
+                {
+                    logerror("can't create spill file");
+                    spillThreshold= 0;
+                    return;
+                }
+                iovec iov[IOV_MAX];
+                size_t total;
+                int niov= getChunks(iov, total);
+                ssize_t sz= pwritev(spillFd, iov, niov, spillWrite);
+                if(sz<=0)
+                {
+                    logerror("write to spill file");
+                    return;     // keep the data in memory.
+                }
+                spillWrite+= sz;
+                stats().spilled+= sz;
+                consume(sz);
+            }
+        }
+
+        // send data from the spill file. returns true when the file is drained, it is closed then.
+        bool flushSpill()
+        {
+            while(spillRead<spillWrite)
+            {
+                stats().syscalls++;
+                ssize_t sz= sendfile(fd, spillFd, &spillRead, spillWrite-spillRead);
+                if(sz<=0)
+                {
+                    if(sz<0 && errno!=EAGAIN && errno!=EWOULDBLOCK)
+                        logerror("sendfile"),
+                        writeFailed(errno);
+                    // give the disk space of data which was already sent back.
+                    if(spillRead-spillPunched>=(off_t)SPILL_PUNCH_SIZE &&
+                       fallocate(spillFd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, spillPunched, spillRead-spillPunched)==0)
+                        spillPunched= spillRead;
+                    return false;
+                }
+            }
+            close(spillFd);
+            spillFd= -1;
+            spillRead= spillWrite= spillPunched= 0;
+            return true;
+        }
 
-        // write a string without buffering. return number of bytes written.
-        size_t writeString(const string& s)
+        // write chunks without buffering. return number of bytes written.
+        size_t writeChunks(const iovec *iov, int niov)
         {
-            ssize_t sz= ::write(fd, s.data(), s.size());
+            stats().syscalls++;
+            ssize_t sz= ::writev(fd, iov, niov);
             if(sz<0)
             {
                 if( (errno!=EAGAIN)&&(errno!=EWOULDBLOCK) )
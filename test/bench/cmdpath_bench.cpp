@@ -0,0 +1,152 @@
+// client-to-core command path allocation benchmark.
+// streams an add-arcs data set through CommandQEntry and CoreInstance, the way the server hands a command
+// from the client's input buffer to the core's write buffer, and counts heap allocations along the way,
+// as well as the heap used by the complete data set while it waits in the command queue.
+// compares against the previous paths:
+//  copying:  appendToDataset() copied every line, queueCommand() copied it again, and each line was split
+//            into words to find the end of the data set.
+//  per-line: each line was moved into the data set as its own string.
+// fails if data set lines are still allocated one by one.
+
+#include <libintl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <new>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <event2/event.h>
+
+using namespace std;
+
+#include "clibase.h"
+#include "const.h"
+#include "utils.h"
+#include "coreinstance.h"
+
+uint32_t logMask= 0;
+
+// every data set line has this length, including the newline. the allocation size of a line's buffer
+// (LINELEN+1) is used to tell per-line strings apart from other allocations.
+#define LINELEN 43
+
+static size_t allocs, lineAllocs;
+
+// neither is inlined, so the compiler doesn't see a malloc() paired with operator delete where a constructor
+// may throw, like in CommandQEntry::create().
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    allocs++;
+    if(size==LINELEN+1) lineAllocs++;
+    void *p= malloc(size);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+static size_t heapInUse()
+{
+    return mallinfo2().uordblks;
+}
+
+struct Result { size_t allocs, lineAllocs, heap, bytes; double seconds; };
+
+// what the server reads from the client.
+static string makeInput(size_t nlines)
+{
+    string s;
+    s.reserve(nlines*LINELEN);
+    char line[64];
+    for(size_t i= 0; i<nlines; i++)
+    {
+        snprintf(line, sizeof(line), "%020zu, %020zu\n", i*7919%1000003, i*104729%1000003);
+        s.append(line, LINELEN);
+    }
+    return s;
+}
+
+// feed the input to a command entry line by line using fn, then queue the command and flush it to the core's write buffer.
+template<typename Fn> static Result run(const string& input, Fn fn)
+{
+    CoreInstance ci(1, "");
+    size_t a= allocs, la= lineAllocs, h= heapInUse();
+    double t= getTime();
+    CommandQEntry *ce= CommandQEntry::create(1, string("add-arcs:\n"));
+    for(size_t i= 0; i<input.size(); i+= LINELEN)
+        fn(ce, input.data()+i, LINELEN);
+    fn(ce, "\n", 1);
+    if(!ce->flushable()) { fprintf(stderr, "data set not terminated\n"); exit(1); }
+    size_t heap= heapInUse()-h;
+    ci.queueCommand(ce);
+    ci.flushCommandQ();
+    Result r= { allocs-a, lineAllocs-la, heap, ci.getWritebufferSize(), getTime()-t };
+    return r;
+}
+
+static void copyingPath(CommandQEntry *ce, const char *line, size_t len)
+{
+    string s(line, len);
+    ce->dataset.push_back(s);
+    if(Cli::splitString(s.c_str()).size()==0)
+        ce->dataFinished= true;
+    string queued(s);   // the copy made by queueCommand()
+}
+
+static void perLinePath(CommandQEntry *ce, const char *line, size_t len)
+{
+    string s(line, len);
+    if(s=="\n") ce->dataFinished= true;
+    ce->dataset.push_back(std::move(s));
+}
+
+static void chunkedPath(CommandQEntry *ce, const char *line, size_t len)
+{
+    ce->appendToDataset(line, len);
+}
+
+static void print(const char *name, const Result& r, size_t nlines)
+{
+    printf("%-9s %8zu allocations (%.3f per line), %8zu line strings, %5.1f heap bytes per buffered line, %zu bytes to core, %.3fs\n",
+           name, r.allocs, double(r.allocs)/nlines, r.lineAllocs, double(r.heap)/nlines, r.bytes, r.seconds);
+}
+
+int main(int argc, char **argv)
+{
+    size_t nlines= (argc>1? atol(argv[1]): 1000000);
+    string input= makeInput(nlines);
+    printf("data set: %zu lines, %.1f MB\n", nlines, input.size()/1048576.0);
+
+    Result c= run(input, copyingPath);
+    Result p= run(input, perLinePath);
+    Result n= run(input, chunkedPath);
+    print("copying:", c, nlines);
+    print("per-line:", p, nlines);
+    print("chunked:", n, nlines);
+
+    if(n.bytes!=c.bytes || n.bytes!=p.bytes) { printf("FAIL: output size differs\n"); return 1; }
+    if(n.lineAllocs>nlines/100) { printf("FAIL: data set lines are allocated one by one\n"); return 1; }
+    return 0;
+}
@@ -0,0 +1,215 @@
+// single flight benchmark.
+// loads a graph on a running graphserv, then has parallel connections send the same deep traversal at the same
+// moment, like clients asking for a category right after it changed, and compares that to each connection
+// asking for a different one. the server has to be started with the example password and group files, the
+// benchmark authorizes as fred (admin). the number of commands the server coalesced is read from server-stats.
+// use: coalesce_bench [host [port [connections [rounds]]]]
+// fails if a client gets a different reply than the others, if identical commands are never coalesced,
+// or if different commands are.
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+static double getTime()
+{
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*0.000001;
+}
+
+static sockaddr_in addr;
+
+// a blocking connection which reads replies line by line.
+struct Conn
+{
+    int fd;
+    string buf;
+
+    bool open()
+    {
+        fd= socket(AF_INET, SOCK_STREAM, 0);
+        if(fd<0 || connect(fd, (sockaddr*)&addr, sizeof(addr))<0) { perror("connect"); return false; }
+        int one= 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return true;
+    }
+
+    bool send(const string& s)
+    {
+        return write(fd, s.data(), s.size())==(ssize_t)s.size();
+    }
+
+    bool readLine(string& line)
+    {
+        size_t nl;
+        while((nl= buf.find('\n'))==string::npos)
+        {
+            char tmp[65536];
+            ssize_t sz= read(fd, tmp, sizeof(tmp));
+            if(sz<=0) return false;
+            buf.append(tmp, sz);
+        }
+        line.assign(buf, 0, nl);
+        buf.erase(0, nl+1);
+        return true;
+    }
+
+    // read a reply. returns the status line, data set lines go to 'data' if given.
+    string reply(vector<string> *data= NULL)
+    {
+        string status, line;
+        if(!readLine(status)) return "";
+        if(status.size() && status[status.size()-1]==':')
+            while(readLine(line) && line.size())
+                if(data) data->push_back(line);
+        return status;
+    }
+
+    bool command(const string& cmd)
+    {
+        if(!send(cmd)) return false;
+        string status= reply();
+        if(status.compare(0, 2, "OK")) { fprintf(stderr, "%s-> %s\n", cmd.c_str(), status.c_str()); return false; }
+        return true;
+    }
+};
+
+// lets the connections send their commands at the same moment.
+struct Barrier
+{
+    mutex m;
+    condition_variable cv;
+    size_t n, waiting, round;
+
+    Barrier(size_t _n): n(_n), waiting(0), round(0) { }
+
+    void wait()
+    {
+        unique_lock<mutex> lock(m);
+        size_t r= round;
+        if(++waiting==n) { waiting= 0; round++; cv.notify_all(); }
+        else cv.wait(lock, [&] { return round!=r; });
+    }
+};
+
+static const char *graphName= "coalescebench";
+static const size_t nnodes= 20000;
+
+// create the graph and load arcs: every node has ten successors.
+static bool setup(Conn& admin)
+{
+    admin.send(string("drop-graph ") + graphName + "\n");
+    admin.reply();
+    usleep(200000);
+    if(!admin.command(string("create-graph ") + graphName + "\n") || !admin.command(string("use-graph ") + graphName + "\n")) return false;
+    string arcs= "add-arcs:\n";
+    for(size_t i= 1; i<=nnodes; i++)
+        for(size_t k= 1; k<=10; k++)
+            arcs+= to_string(i) + "," + to_string((i*k*7919)%nnodes+1) + "\n";
+    arcs+= "\n";
+    return admin.command(arcs);
+}
+
+static unsigned long long coalescedCommands(Conn& admin)
+{
+    vector<string> data;
+    admin.send("server-stats\n");
+    admin.reply(&data);
+    for(const string& line: data)
+        if(!line.compare(0, 18, "CoalescedCommands,")) return strtoull(line.c_str()+18, NULL, 10);
+    return 0;
+}
+
+// every connection sends a traversal per round, all the same one or each a different one.
+// returns commands per second, 0 on failure.
+static double run(size_t nconns, size_t nrounds, bool same, bool& consistent)
+{
+    atomic<size_t> failed(0), differing(0);
+    Barrier barrier(nconns);
+    vector< vector<string> > replies(nconns);
+    vector<thread> threads;
+    double t= getTime();
+    for(size_t c= 0; c<nconns; c++)
+        threads.push_back(thread([&, c] ()
+            {
+                Conn conn;
+                bool ok= conn.open() && conn.command(string("use-graph ") + graphName + "\n");
+                if(!ok) failed++;
+                for(size_t r= 0; r<nrounds; r++)
+                {
+                    barrier.wait();
+                    if(ok)
+                    {
+                        // different nodes in each run, or the result cache would answer.
+                        size_t node= (same? nnodes/2+r: r*nconns+c)%nnodes+1;
+                        replies[c].clear();
+                        conn.send("traverse-successors " + to_string(node) + " 20\n");
+                        if(conn.reply(&replies[c]).compare(0, 2, "OK") || replies[c].empty()) failed++, ok= false;
+                    }
+                    barrier.wait();
+                    if(same && ok && c && replies[c]!=replies[0]) differing++;
+                }
+                close(conn.fd);
+            }));
+    for(thread& th: threads) th.join();
+    t= getTime()-t;
+    consistent= !differing;
+    return (failed? 0: nconns*nrounds/t);
+}
+
+int main(int argc, char **argv)
+{
+    const char *host= (argc>1? argv[1]: "127.0.0.1");
+    int port= (argc>2? atoi(argv[2]): 6666);
+    size_t nconns= (argc>3? atol(argv[3]): 16);
+    size_t nrounds= (argc>4? atol(argv[4]): 200);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family= AF_INET;
+    addr.sin_port= htons(port);
+    hostent *he= gethostbyname(host);
+    if(!he) { fprintf(stderr, "can't resolve %s\n", host); return 1; }
+    memcpy(&addr.sin_addr, he->h_addr, sizeof(addr.sin_addr));
+
+    Conn admin;
+    if(!admin.open() || !admin.command("authorize password fred:test\n")) return 1;
+    if(!setup(admin)) { printf("FAIL: couldn't set up graph\n"); return 1; }
+
+    printf("%zu connections, %zu rounds\n", nconns, nrounds);
+    bool consistent;
+    unsigned long long before= coalescedCommands(admin);
+    double distinct= run(nconns, nrounds, false, consistent);
+    unsigned long long coalescedDistinct= coalescedCommands(admin)-before;
+    if(!distinct) { printf("FAIL: requests failed\n"); return 1; }
+    printf("different commands: %10.0f commands/s, %llu coalesced\n", distinct, coalescedDistinct);
+
+    before= coalescedCommands(admin);
+    double same= run(nconns, nrounds, true, consistent);
+    unsigned long long coalescedSame= coalescedCommands(admin)-before;
+    if(!same) { printf("FAIL: requests failed\n"); return 1; }
+    printf("same command:       %10.0f commands/s, %llu coalesced (%.0f%%), %.2fx\n", same, coalescedSame,
+           100.0*coalescedSame/(nconns*nrounds), same/distinct);
+
+    admin.send(string("drop-graph ") + graphName + "\n");
+    admin.reply();
+
+    if(!consistent) { printf("FAIL: clients got different replies to the same command\n"); return 1; }
+    if(coalescedDistinct) { printf("FAIL: different commands were coalesced\n"); return 1; }
+    if(nconns>1 && !coalescedSame) { printf("FAIL: identical commands were never coalesced\n"); return 1; }
+    return 0;
+}
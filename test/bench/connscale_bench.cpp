@@ -0,0 +1,194 @@
+// connection scaling benchmark.
+// opens lots of idle TCP connections to a running graphserv, then measures how long
+// protocol-version round trips take on all of them while they are connected.
+// use: connscale_bench [host [port [connections [rounds]]]]
+// connections are bound to different 127.0.0.x source addresses when connecting to localhost,
+// so that more than ~28000 connections can be made without running out of ephemeral ports.
+// both sides need a high enough fd limit (ulimit -n).
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+static double getTime()
+{
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*0.000001;
+}
+
+struct Conn
+{
+    int fd;
+    double sendTime;
+    size_t received;    // bytes of the current reply
+    bool waiting;
+};
+
+static const char request[]= "protocol-version\n";
+
+// send a request on every connection and wait until all replies are in.
+// returns per-connection latencies in milliseconds.
+static vector<double> runRound(int epfd, vector<Conn>& conns)
+{
+    vector<double> latencies;
+    latencies.reserve(conns.size());
+    size_t pending= 0;
+    for(size_t i= 0; i<conns.size(); i++)
+    {
+        Conn& c= conns[i];
+        c.sendTime= getTime();
+        c.received= 0;
+        if(write(c.fd, request, sizeof(request)-1)!=sizeof(request)-1)
+        {
+            perror("write");
+            exit(1);
+        }
+        c.waiting= true;
+        pending++;
+    }
+    epoll_event events[1024];
+    char buf[4096];
+    while(pending)
+    {
+        int n= epoll_wait(epfd, events, 1024, 10000);
+        if(n<=0)
+        {
+            fprintf(stderr, "timeout waiting for replies, %zu pending\n", pending);
+            exit(1);
+        }
+        for(int i= 0; i<n; i++)
+        {
+            Conn& c= conns[events[i].data.u32];
+            ssize_t sz;
+            while((sz= read(c.fd, buf, sizeof(buf)))>0)
+            {
+                // the reply is a single status line.
+                if(c.waiting && memchr(buf, '\n', sz))
+                {
+                    latencies.push_back((getTime()-c.sendTime)*1000.0);
+                    c.waiting= false;
+                    pending--;
+                }
+            }
+            if(sz==0)
+            {
+                fprintf(stderr, "connection closed by server\n");
+                exit(1);
+            }
+        }
+    }
+    return latencies;
+}
+
+static double percentile(vector<double>& v, double p)
+{
+    size_t idx= min(v.size()-1, size_t(v.size()*p));
+    nth_element(v.begin(), v.begin()+idx, v.end());
+    return v[idx];
+}
+
+int main(int argc, char **argv)
+{
+    const char *host= (argc>1? argv[1]: "127.0.0.1");
+    int port= (argc>2? atoi(argv[2]): 6666);
+    size_t nconns= (argc>3? atol(argv[3]): 50000);
+    int rounds= (argc>4? atoi(argv[4]): 5);
+
+    struct rlimit rlim;
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    rlim.rlim_cur= rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+    if(rlim.rlim_cur<nconns+16)
+        fprintf(stderr, "warning: fd limit is %ld, connecting %zu sockets will probably fail\n", (long)rlim.rlim_cur, nconns);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family= AF_INET;
+    addr.sin_port= htons(port);
+    hostent *he= gethostbyname(host);
+    if(!he)
+    {
+        fprintf(stderr, "can't resolve %s\n", host);
+        return 1;
+    }
+    memcpy(&addr.sin_addr, he->h_addr, sizeof(addr.sin_addr));
+    bool loopback= ((ntohl(addr.sin_addr.s_addr)>>24)==127);
+
+    int epfd= epoll_create1(0);
+    vector<Conn> conns;
+    conns.reserve(nconns);
+    double t0= getTime();
+    for(size_t i= 0; i<nconns; i++)
+    {
+        int fd= socket(AF_INET, SOCK_STREAM, 0);
+        if(fd<0)
+        {
+            perror("socket");
+            return 1;
+        }
+        if(loopback)
+        {
+            // spread connections over 127.0.0.1 .. 127.0.0.254
+            sockaddr_in src;
+            memset(&src, 0, sizeof(src));
+            src.sin_family= AF_INET;
+            src.sin_addr.s_addr= htonl((127<<24) | (1 + i%254));
+#ifdef IP_BIND_ADDRESS_NO_PORT
+            // pick the port at connect() time, bind() is slow with lots of sockets otherwise.
+            int one= 1;
+            setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+            if(bind(fd, (sockaddr*)&src, sizeof(src))<0)
+            {
+                perror("bind");
+                return 1;
+            }
+        }
+        // connect blocking; the listen backlog is limited, so this is throttled by the server anyway.
+        if(connect(fd, (sockaddr*)&addr, sizeof(addr))<0)
+        {
+            fprintf(stderr, "connect() failed after %zu connections: %s\n", i, strerror(errno));
+            return 1;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+        epoll_event ev;
+        ev.events= EPOLLIN;
+        ev.data.u32= i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        Conn c= { fd, 0, 0, false };
+        conns.push_back(c);
+    }
+    double t1= getTime();
+    printf("%zu connections in %.2f s (%.0f/s)\n", nconns, t1-t0, nconns/(t1-t0));
+
+    // the first round makes sure the server has accepted and registered everything.
+    runRound(epfd, conns);
+
+    for(int r= 0; r<rounds; r++)
+    {
+        double start= getTime();
+        vector<double> lat= runRound(epfd, conns);
+        double secs= getTime()-start;
+        printf("round %d: %.3f s, %.0f requests/s, latency ms: p50 %.2f  p99 %.2f  max %.2f\n", r+1, secs, nconns/secs,
+               percentile(lat, 0.5), percentile(lat, 0.99), percentile(lat, 1.0));
+    }
+
+    for(size_t i= 0; i<conns.size(); i++)
+        close(conns[i].fd);
+    return 0;
+}
@@ -0,0 +1,191 @@
+// command scheduling benchmark.
+// simulates a core shared by a batch client, which pipelines hundreds of expensive commands, and interactive
+// HTTP clients, which send one cheap lookup at a time. the core runs the commands in the order given by a FIFO
+// queue, as before, and by the FairQueue which CoreInstance uses now, with the weights the server gives these
+// sessions. prints the distribution of the interactive clients' latencies, and the batch client's throughput.
+// fails if a client's commands are run out of order, or if lookups wait longer than a few batch commands.
+// use: fairq_bench [batch command ms [lookup ms [interactive clients]]]
+
+#include <libintl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <new>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+using namespace std;
+
+#include "clibase.h"
+#include "const.h"
+#include "utils.h"
+
+uint32_t logMask= 0;
+
+struct Job
+{
+    uint32_t client;
+    uint32_t seq;       // per client, to check the order
+    double queued;      // simulated time
+    double cost;
+};
+
+enum { BATCH_CLIENT= 1 };
+
+struct Result
+{
+    vector<double> latencies;   // of the interactive lookups, in ms
+    size_t batchDone;
+    bool ordered;
+};
+
+static double percentile(vector<double> v, double p)
+{
+    if(v.empty()) return 0;
+    size_t idx= min(v.size()-1, size_t(v.size()*p));
+    nth_element(v.begin(), v.begin()+idx, v.end());
+    return v[idx];
+}
+
+// run the simulation for 'duration' seconds. Queue has push(job, weight), empty(), pop() returning the next job
+// and charge(job, cost).
+template<typename Queue> static Result simulate(Queue& q, double batchCost, double lookupCost, size_t nclients, double duration)
+{
+    // the batch client has write access, the lookups are anonymous.
+    static const unsigned weights[]= FAIRQ_WEIGHTS;
+    unsigned batchWeight= weights[1], lookupWeight= weights[0]*FAIRQ_HTTP_FACTOR;
+    Result res;
+    res.batchDone= 0;
+    res.ordered= true;
+    srand(1);
+    vector<uint32_t> lastSeq(nclients+2, 0), nextSeq(nclients+2, 0);
+    // the batch client keeps 500 commands queued.
+    size_t batchQueued= 0;
+    auto queueBatch= [&] (double t)
+    {
+        while(batchQueued<500)
+        {
+            Job j= { BATCH_CLIENT, ++nextSeq[BATCH_CLIENT], t, batchCost*(0.5+rand()/(double)RAND_MAX) };
+            q.push(j, batchWeight);
+            batchQueued++;
+        }
+    };
+    // interactive clients think for a while between lookups.
+    vector<double> arrival(nclients+2);
+    for(size_t c= 2; c<nclients+2; c++) arrival[c]= -log(1-rand()/(RAND_MAX+1.0))*0.2;
+
+    double t= 0;
+    queueBatch(t);
+    while(t<duration)
+    {
+        for(size_t c= 2; c<nclients+2; c++)
+            if(arrival[c]>=0 && arrival[c]<=t)
+            {
+                Job j= { (uint32_t)c, ++nextSeq[c], arrival[c], lookupCost };
+                q.push(j, lookupWeight);
+                arrival[c]= -1;
+            }
+        if(q.empty())
+        {
+            double next= duration;
+            for(size_t c= 2; c<nclients+2; c++) if(arrival[c]>=0) next= min(next, arrival[c]);
+            t= next;
+            continue;
+        }
+        Job j= q.pop();
+        if(j.seq!=lastSeq[j.client]+1) res.ordered= false;
+        lastSeq[j.client]= j.seq;
+        t+= j.cost;
+        q.charge(j, j.cost);
+        if(j.client==BATCH_CLIENT)
+            res.batchDone++, batchQueued--, queueBatch(t);
+        else
+        {
+            res.latencies.push_back((t-j.queued)*1000);
+            arrival[j.client]= t-log(1-rand()/(RAND_MAX+1.0))*0.2;
+        }
+    }
+    return res;
+}
+
+struct FifoQueue
+{
+    RingQueue<Job> q;
+    void push(const Job& j, unsigned weight) { q.push_back(j); }
+    bool empty() { return q.empty(); }
+    Job pop() { Job j= q.front(); q.pop_front(); return j; }
+    void charge(const Job& j, double cost) { }
+};
+
+struct DrrQueue
+{
+    FairQueue<Job> q;
+    DrrQueue(): q(FAIRQ_QUANTUM) { }
+    void push(const Job& j, unsigned weight) { q.push(j.client, j, weight); }
+    bool empty() { return q.empty(); }
+    Job pop() { uint32_t id= q.next(); Job j= q.front(id); q.pop(id); return j; }
+    void charge(const Job& j, double cost) { q.charge(j.client, cost); }
+};
+
+static void report(const char *name, const Result& r, double duration)
+{
+    printf("%-5s lookups: %6zu, latency ms p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f | batch: %5.1f commands/s\n",
+           name, r.latencies.size(), percentile(r.latencies, 0.5), percentile(r.latencies, 0.9), percentile(r.latencies, 0.99),
+           percentile(r.latencies, 1), r.batchDone/duration);
+}
+
+int main(int argc, char **argv)
+{
+    double batchCost= (argc>1? atof(argv[1]): 50)/1000;
+    double lookupCost= (argc>2? atof(argv[2]): 1)/1000;
+    size_t nclients= (argc>3? atol(argv[3]): 20);
+    double duration= 60;
+    printf("batch commands %.0f ms, lookups %.1f ms, %zu interactive clients, %.0f s simulated\n",
+           batchCost*1000, lookupCost*1000, nclients, duration);
+
+    FifoQueue fifo;
+    Result rf= simulate(fifo, batchCost, lookupCost, nclients, duration);
+    report("fifo", rf, duration);
+    DrrQueue drr;
+    Result rd= simulate(drr, batchCost, lookupCost, nclients, duration);
+    report("fair", rd, duration);
+
+    // scheduling overhead with many clients, which all have a command queued.
+    FairQueue<Job> fq(FAIRQ_QUANTUM);
+    size_t nops= 1000000, nbig= 10000;
+    for(uint32_t c= 1; c<=nbig; c++) { Job j= { c, 0, 0, 0 }; fq.push(c, j, 1+c%4); }
+    double t= getTime();
+    for(size_t i= 0; i<nops; i++)
+    {
+        uint32_t id= fq.next();
+        Job j= fq.front(id);
+        fq.pop(id);
+        fq.charge(id, (id%10? 0.001: 0.05));
+        fq.push(id, j, 1+id%4);
+    }
+    t= getTime()-t;
+    printf("scheduling: %.1f ns per command, %zu clients\n", t*1e9/nops, nbig);
+
+    if(!rf.ordered || !rd.ordered) { printf("FAIL: commands of a client were run out of order\n"); return 1; }
+    // a lookup may have to wait for the batch command which is running, and the rest of the batch client's turn.
+    double bound= 3*1.5*batchCost*1000;
+    if(percentile(rd.latencies, 0.99)>bound) { printf("FAIL: p99 lookup latency above %.0f ms\n", bound); return 1; }
+    if(rd.batchDone<rf.batchDone/2) { printf("FAIL: batch client starved\n"); return 1; }
+    return 0;
+}
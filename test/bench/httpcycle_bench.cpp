@@ -0,0 +1,161 @@
+// HTTP session allocation benchmark.
+// runs the accept -> parse -> forward -> shutdown cycle of an HTTP request through the recycled objects the server
+// uses: a session from the session pool reads the request from a socket, parses it, a command queue entry is made
+// for the core and recycled once it was written, the reply is written to the client, and the session is released.
+// the server's event loop and core process are left out. the core's stdin is /dev/null.
+// counts heap allocations per request, and fails if requests allocate once the pools are warm.
+
+#include <libintl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <memory>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <event2/event.h>
+
+using namespace std;
+
+#include "clibase.h"
+#include "const.h"
+#include "utils.h"
+#include "linebuffer.h"
+#include "auth.h"
+#include "coreinstance.h"
+#include "shard.h"
+
+// stands in for the server, sessions only keep a reference to it.
+class Graphserv { };
+
+#include "session.h"
+
+uint32_t logMask= 0;
+
+static size_t allocs;
+
+void *operator new(size_t size)
+{
+    allocs++;
+    void *p= malloc(size);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+// the parts of the sessions which are defined in main.cpp.
+void SessionContext::writeFailed(int _errno) { }
+bool SessionContext::isWaitingForCoreReply() { return curCommand; }
+void HTTPSessionContext::finishConversation() { conversationFinished= true; }
+void HTTPSessionContext::forwardStatusline(const string& line) { write(line); }
+
+// the core's stdin.
+struct NullCore: public NonblockWriter
+{
+    NullCore() { setWriteFd(open("/dev/null", O_WRONLY)); }
+    void writeFailed(int _errno) { }
+};
+
+static const char request[]= "GET /catgraph/list-successors+1234 HTTP/1.0\r\n"
+                             "Host: localhost:8090\r\n"
+                             "User-Agent: httpcycle_bench\r\n"
+                             "Accept: */*\r\n"
+                             "\r\n";
+
+static const char reply[]= "1235\n1236\n1237\n\n";
+
+// run one request. returns false on failure.
+static bool cycle(Graphserv &app, ObjectPool<HTTPSessionContext> &pool, NullCore &core, uint32_t id)
+{
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)<0) { perror("socketpair"); return false; }
+    if(::write(fds[0], request, sizeof(request)-1)!=sizeof(request)-1) { perror("write"); return false; }
+
+    // accept
+    HTTPSessionContext *sc= pool.get();
+    if(sc) sc->reset(id, fds[1]);
+    else sc= new HTTPSessionContext(app, id, fds[1]);
+
+    // parse and forward
+    bool ok= false;
+    sc->linebuf.readLines(sc->sockfd, [&] (char *line, size_t len) -> bool
+        {
+            if(!sc->requestLine(line, len)) return true;
+            if(sc->parseRequest() || !sc->http.coreNameSize) return false;
+            const string& uri= sc->http.uri;
+            CommandQEntry *ce= CommandQEntry::create(sc->clientID, uri.data()+sc->http.coreNameSize+1, uri.size()-sc->http.coreNameSize-1);
+            core.write(ce->command);
+            CommandQEntry::recycle(ce);
+            ok= true;
+            return false;
+        });
+
+    // reply
+    sc->httpWriteResponseHeader(200, "OK", "text/plain");
+    sc->forwardStatusline(SUCCESS_STR " 3 nodes\n");
+    sc->forwardDatasetChunk(reply, sizeof(reply)-1, true);
+    NonblockWriter::flushDirty();
+
+    char buf[4096];
+    ssize_t sz= ::read(fds[0], buf, sizeof(buf));
+    ok= ok && sz>0 && !memcmp(buf, "HTTP/1.0 200 OK\r\n", 17) && sc->conversationFinished;
+
+    // shutdown
+    sc->release();
+    if(!pool.put(sc)) delete sc;
+    close(fds[0]);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    size_t nrequests= (argc>1? atol(argv[1]): 100000);
+    Graphserv app;
+    ObjectPool<HTTPSessionContext> pool(SESSION_POOL_SIZE);
+    NullCore core;
+
+    size_t a= allocs;
+    if(!cycle(app, pool, core, 1)) { printf("FAIL: request was not handled\n"); return 1; }
+    size_t coldAllocs= allocs-a;
+
+    a= allocs;
+    double t= getTime();
+    for(size_t i= 0; i<nrequests; i++)
+        if(!cycle(app, pool, core, 2+i)) { printf("FAIL: request %zu was not handled\n", i); return 1; }
+    t= getTime()-t;
+    size_t warmAllocs= allocs-a;
+
+    printf("%zu requests\n", nrequests);
+    printf("first request: %6zu allocations\n", coldAllocs);
+    printf("warm pools:    %6.2f allocations per request, %.2f us per request\n", double(warmAllocs)/nrequests, t*1e6/nrequests);
+
+    if(warmAllocs) { printf("FAIL: %zu allocations with warm pools\n", warmAllocs); return 1; }
+    return 0;
+}
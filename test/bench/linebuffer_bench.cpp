@@ -0,0 +1,124 @@
+// client input throughput benchmark.
+// compares LineBuffer against the previous input path (128-byte recv() into a stack buffer,
+// appending to the line buffer one character at a time).
+// a writer thread streams an add-arcs style data set through a socket pair.
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+#include "linebuffer.h"
+
+static double getTime()
+{
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*0.000001;
+}
+
+static string makeInput(size_t nlines)
+{
+    string s;
+    char line[64];
+    for(size_t i= 0; i<nlines; i++)
+    {
+        snprintf(line, sizeof(line), "%zu, %zu\r\n", i*7919%1000003, i*104729%1000003);
+        s+= line;
+    }
+    return s;
+}
+
+struct Result { size_t lines, bytes, reads; double seconds; };
+
+template<typename Reader> static Result run(const string& input, Reader reader)
+{
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)<0) { perror("socketpair"); exit(1); }
+    thread writer([&] ()
+        {
+            const char *p= input.data();
+            size_t left= input.size();
+            while(left)
+            {
+                ssize_t sz= ::write(sv[1], p, left);
+                if(sz<=0) { perror("write"); exit(1); }
+                p+= sz, left-= sz;
+            }
+            close(sv[1]);
+        });
+    Result r= { 0, 0, 0, 0 };
+    double t= getTime();
+    reader(sv[0], r);
+    r.seconds= getTime()-t;
+    writer.join();
+    close(sv[0]);
+    return r;
+}
+
+// the old path, as found in Graphserv::mainloop_select.
+static void oldReader(int fd, Result& r)
+{
+    string linebuf;
+    while(true)
+    {
+        char buf[128];
+        ssize_t sz= recv(fd, buf, sizeof(buf), 0);
+        if(sz<=0) break;
+        r.reads++;
+        for(ssize_t i= 0; i<sz; i++)
+        {
+            char c= buf[i];
+            if(c=='\r') continue;
+            linebuf+= c;
+            if(c=='\n')
+            {
+                r.lines++;
+                r.bytes+= string(linebuf).size();   // lineFromClient took a copy.
+                linebuf.clear();
+            }
+        }
+    }
+}
+
+static void newReader(int fd, Result& r)
+{
+    LineBuffer lb;
+    while(lb.readLines(fd, [&] (char *line, size_t len) -> bool
+        {
+            r.lines++;
+            r.bytes+= string(line, len).size();
+            return true;
+        }) > 0)
+        r.reads++;
+}
+
+int main(int argc, char **argv)
+{
+    size_t nlines= (argc>1? atol(argv[1]): 5000000);
+    string input= makeInput(nlines);
+    printf("input: %zu lines, %.1f MB\n", nlines, input.size()/1048576.0);
+
+    Result o= run(input, oldReader);
+    Result n= run(input, newReader);
+
+    const char *names[]= { "old (128-byte recv, per-byte append)", "LineBuffer" };
+    Result *rs[]= { &o, &n };
+    for(int i= 0; i<2; i++)
+        printf("%-40s %8.3f s  %8.1f MB/s  %9zu reads  %zu lines\n", names[i], rs[i]->seconds,
+               input.size()/1048576.0/rs[i]->seconds, rs[i]->reads, rs[i]->lines);
+    printf("speedup: %.2fx\n", o.seconds/n.seconds);
+
+    if(o.lines!=nlines || n.lines!=nlines || o.bytes!=n.bytes)
+    {
+        printf("MISMATCH: old %zu lines/%zu bytes, new %zu lines/%zu bytes\n", o.lines, o.bytes, n.lines, n.bytes);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+// pending-work lookup benchmark.
+// queues commands from many clients on a core, then asks for each client whether the core has work queued
+// for it, as SessionContext::isWaitingForCoreReply does for every line a client sends.
+// compares the previous reverse scan of the command queue against CoreInstance's per-client index.
+
+#include <libintl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <new>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <event2/event.h>
+
+using namespace std;
+
+#include "clibase.h"
+#include "const.h"
+#include "utils.h"
+#include "coreinstance.h"
+
+uint32_t logMask= 0;
+
+// the previous CoreInstance::findLastClientCommand.
+static CommandQEntry *scanQueue(deque<CommandQEntry> &commandQ, uint32_t clientID)
+{
+    for(deque<CommandQEntry>::reverse_iterator it= commandQ.rbegin(); it!=commandQ.rend(); ++it)
+        if(it->clientID==clientID)
+            return & (*it);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t ncommands= (argc>1? atol(argv[1]): 10000);
+    size_t nclients= ncommands/2;   // two commands per client. as many clients again have nothing queued.
+    printf("%zu queued commands from %zu clients\n", ncommands, nclients);
+
+    CoreInstance ci(1, "");
+    deque<CommandQEntry> commandQ;
+    for(size_t i= 0; i<ncommands; i++)
+    {
+        CommandQEntry *ce= CommandQEntry::create(1+i%nclients, string("list-successors 1\n"));
+        commandQ.push_back(*ce);
+        ci.queueCommand(ce);
+    }
+
+    size_t foundOld= 0, foundNew= 0;
+    double t= getTime();
+    for(uint32_t id= 1; id<=2*nclients; id++)
+        if(scanQueue(commandQ, id)) foundOld++;
+    double tOld= getTime()-t;
+
+    t= getTime();
+    for(uint32_t id= 1; id<=2*nclients; id++)
+        if(ci.hasDataForClient(id)) foundNew++;
+    double tNew= getTime()-t;
+
+    printf("scan:  %10.1f ns per lookup\n", tOld*1e9/(2*nclients));
+    printf("index: %10.1f ns per lookup\n", tNew*1e9/(2*nclients));
+
+    if(foundOld!=nclients || foundNew!=nclients) { printf("FAIL: found %zu, %zu of %zu clients\n", foundOld, foundNew, nclients); return 1; }
+    return 0;
+}
@@ -0,0 +1,280 @@
+// data set relay benchmark.
+// starts graphserv with a stand-in core, a shell script which answers every command with a prepared reply, and
+// fetches each reply over a TCP session, where the data set is spliced from the core to the socket, and over HTTP,
+// where it goes through dataFromCore() like all other output. the data sets end in the different ways a core may
+// end them: an empty line, a line with only blanks, and lines ending in CR LF from a core which sends those.
+// prints the throughput of both paths for a big data set.
+// fails if the two paths don't give the expected output, if a reply never ends, or if the relay is not used for
+// the core with bare newlines, or is used for the one with CRs.
+// use: relay_bench [graphserv binary [port]]
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <stdarg.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+#include "clibase.h"
+
+static double getTime()
+{
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*0.000001;
+}
+
+static string dir;
+
+static bool writeFile(const string& name, const string& content, mode_t mode= 0644)
+{
+    string path= dir + "/" + name;
+    FILE *f= fopen(path.c_str(), "w");
+    if(!f || fwrite(content.data(), 1, content.size(), f)!=content.size()) { perror(path.c_str()); return false; }
+    fclose(f);
+    return chmod(path.c_str(), mode)==0;
+}
+
+// a connection with a receive timeout, so that a reply which never ends is a failure rather than a hang.
+struct Conn
+{
+    int fd;
+    string buf;
+    size_t pos;     // of the next line in buf
+
+    bool open(int port)
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family= AF_INET;
+        addr.sin_port= htons(port);
+        addr.sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+        pos= 0;
+        fd= socket(AF_INET, SOCK_STREAM, 0);
+        if(fd<0 || connect(fd, (sockaddr*)&addr, sizeof(addr))<0) return false;
+        timeval tv= { 10, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        return true;
+    }
+
+    void close() { ::close(fd); }
+
+    bool send(const string& s)
+    {
+        return write(fd, s.data(), s.size())==(ssize_t)s.size();
+    }
+
+    // read more data. false on timeout or EOF.
+    bool fill()
+    {
+        char tmp[65536];
+        ssize_t sz= read(fd, tmp, sizeof(tmp));
+        if(sz<=0) return false;
+        buf.append(tmp, sz);
+        return true;
+    }
+
+    bool readLine(string& line)
+    {
+        size_t nl;
+        while((nl= buf.find('\n', pos))==string::npos)
+        {
+            buf.erase(0, pos);
+            pos= 0;
+            if(!fill()) return false;
+        }
+        line.assign(buf, pos, nl+1-pos);
+        pos= nl+1;
+        return true;
+    }
+
+    // read a reply including the newlines: the status line, and the data set up to its terminating blank line.
+    bool reply(string& out)
+    {
+        string line;
+        out.clear();
+        if(!readLine(line)) return false;
+        out+= line;
+        if(line.size()<2 || line[line.size()-2]!=':') return true;
+        do
+        {
+            if(!readLine(line)) return false;
+            out+= line;
+        } while(line.find_first_not_of(" \t\r\n")!=string::npos);
+        return true;
+    }
+
+    bool command(const string& cmd)
+    {
+        string status;
+        if(!send(cmd) || !reply(status)) return false;
+        if(status.compare(0, strlen(SUCCESS_STR), SUCCESS_STR)) { fprintf(stderr, "%s-> %s", cmd.c_str(), status.c_str()); return false; }
+        return true;
+    }
+};
+
+// a value from the server-stats data set.
+static bool serverStat(Conn& conn, const char *name, unsigned long long& value)
+{
+    string reply;
+    if(!conn.send("server-stats\n") || !conn.reply(reply)) return false;
+    size_t pos= reply.find(string("\n") + name + ",");
+    if(pos==string::npos) return false;
+    value= strtoull(reply.c_str()+pos+strlen(name)+2, NULL, 10);
+    return true;
+}
+
+// fetch a reply with an HTTP request. returns the body, which is the status line and data set.
+static bool httpGet(int port, const string& uri, string& body)
+{
+    Conn conn;
+    if(!conn.open(port) || !conn.send("GET " + uri + " HTTP/1.0\r\n\r\n")) return false;
+    while(conn.fill()) ;
+    conn.close();
+    size_t end= conn.buf.find("\r\n\r\n");
+    if(end==string::npos) return false;
+    body= conn.buf.substr(end+4);
+    return true;
+}
+
+struct Case
+{
+    const char *name;
+    size_t lines;
+    const char *terminator;
+};
+
+static Case cases[]=
+{
+    { "empty data set",             0,      "\n" },
+    { "empty line",                 3,      "\n" },
+    { "blank line",                 3,      " \n" },
+    { "tab and space",              3,      "\t \n" },
+    { "big, empty line",            200000, "\n" },
+    { "big, blank line",            200000, "  \n" },
+};
+enum { NCASES= sizeof(cases)/sizeof(cases[0]) };
+
+// the reply to case i. some lines have blanks at their ends or beginnings, which don't end the data set.
+static string makeReply(int i)
+{
+    string r= format("%s %zu lines:\n", SUCCESS_STR, cases[i].lines);
+    for(size_t k= 0; k<cases[i].lines; k++)
+        r+= (k%7==3? format("%zu,%zu  \n", k, k*31): k%7==5? format("\t%zu,%zu\n", k, k*31): format("%zu,%zu\n", k, k*31));
+    return r + cases[i].terminator;
+}
+
+static string crlf(const string& s)
+{
+    string r;
+    for(char c: s)
+    {
+        if(c=='\n') r+= '\r';
+        r+= c;
+    }
+    return r;
+}
+
+// run graphserv with the stand-in core. the core sends CR LF line endings if 'crlfCore' is set.
+// returns false on failure.
+static bool runServer(const char *graphserv, int port, bool crlfCore)
+{
+    const char *core= (crlfCore? "core-crlf": "core");
+    const char *eol= (crlfCore? "\\r\\n": "\\n");
+    // answer protocol-version, then send the reply file named by the first argument of each command.
+    string script= format("#!/bin/sh\n"
+                          "while read cmd arg rest; do\n"
+                          "  case \"$cmd\" in\n"
+                          "    protocol-version) printf '%s %s%s' ;;\n"
+                          "    *) cat reply%s$arg ;;\n"
+                          "  esac\n"
+                          "done\n", SUCCESS_STR, stringify(PROTOCOL_VERSION), eol, crlfCore? "-crlf": "");
+    if(!writeFile(core, script, 0755)) return false;
+
+    string corePath= dir + "/" + core;
+    string tcpPort= format("%d", port), httpPort= format("%d", port+1);
+    pid_t pid= fork();
+    if(pid==0)
+    {
+        execl(graphserv, graphserv, "-t", tcpPort.c_str(), "-H", httpPort.c_str(), "-p", "../../example-gspasswd.conf",
+              "-g", "../../example-gsgroups.conf", "-c", corePath.c_str(), "-R", "0", (char*)NULL);
+        perror(graphserv);
+        exit(1);
+    }
+    bool ok= false;
+    Conn admin;
+    for(int i= 0; i<50 && !(ok= admin.open(port)); i++) usleep(100000);
+    if(!ok) { printf("FAIL: couldn't connect to %s\n", graphserv); kill(pid, SIGTERM); return false; }
+
+    unsigned long long relayedBefore= 0, relayedAfter= 0;
+    ok= admin.command("authorize password fred:test\n") && admin.command("create-graph relaybench\n") &&
+        admin.command("use-graph relaybench\n") && serverStat(admin, "RelayedBytes", relayedBefore);
+    if(!ok) printf("FAIL: couldn't set up the graph\n");
+
+    printf("%s:\n", crlfCore? "CR LF core, nothing relayed": "newline core, TCP relayed");
+    for(int i= 0; i<NCASES && ok; i++)
+    {
+        string expected= makeReply(i), tcp, http;
+        double t= getTime();
+        bool tcpOk= admin.send(format("list-successors %d\n", i)) && admin.reply(tcp);
+        double ttcp= getTime()-t;
+        t= getTime();
+        bool httpOk= httpGet(port+1, format("/relaybench/list-successors+%d", i), http);
+        double thttp= getTime()-t;
+        // the next command only gets through once the server has seen the end of the data set.
+        unsigned long long relayed;
+        bool ended= tcpOk && serverStat(admin, "RelayedBytes", relayed);
+
+        if(!tcpOk || !httpOk || !ended)
+            printf("FAIL: %s: %s\n", cases[i].name, !tcpOk? "no TCP reply": !httpOk? "no HTTP reply": "the reply did not end");
+        else if(tcp!=expected || http!=expected)
+            printf("FAIL: %s: %s output differs from the data set the core sent\n", cases[i].name, tcp!=expected? "TCP": "HTTP");
+        else
+        {
+            printf("  %-16s %8zu bytes, TCP %8.1f MB/s, HTTP %8.1f MB/s\n", cases[i].name, expected.size(),
+                   expected.size()/ttcp/1e6, expected.size()/thttp/1e6);
+            continue;
+        }
+        ok= false;
+    }
+    if(ok && serverStat(admin, "RelayedBytes", relayedAfter))
+    {
+        if(crlfCore && relayedAfter!=relayedBefore) printf("FAIL: output of a core which sends CRs was relayed\n"), ok= false;
+        if(!crlfCore && relayedAfter==relayedBefore) printf("FAIL: nothing was relayed\n"), ok= false;
+    }
+    admin.close();
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *graphserv= (argc>1? argv[1]: "../../graphserv");
+    int port= (argc>2? atoi(argv[2]): 6683);
+    signal(SIGPIPE, SIG_IGN);
+
+    char tmpl[]= "/tmp/relaybenchXXXXXX";
+    if(!mkdtemp(tmpl)) { perror("mkdtemp"); return 1; }
+    dir= tmpl;
+    for(int i= 0; i<NCASES; i++)
+        if(!writeFile(format("reply%d", i), makeReply(i)) || !writeFile(format("reply-crlf%d", i), crlf(makeReply(i)))) return 1;
+
+    bool ok= runServer(graphserv, port, false) && runServer(graphserv, port+2, true);
+
+    system(("rm -r " + dir).c_str());
+    return (ok? 0: 1);
+}
@@ -0,0 +1,179 @@
+// read replica benchmark.
+// creates a graph with 0, 1 and 3 read replicas on a running graphserv, loads the same arcs into each,
+// then measures list-successors throughput from parallel connections. the server has to be started with
+// the example password and group files, the benchmark authorizes as fred (admin).
+// use: replica_bench [host [port [connections [requests]]]]
+// also checks that writes are seen by the next read on the same connection, whichever instance serves it.
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+static double getTime()
+{
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*0.000001;
+}
+
+static sockaddr_in addr;
+
+// a blocking connection which reads replies line by line.
+struct Conn
+{
+    int fd;
+    string buf;
+
+    bool open()
+    {
+        fd= socket(AF_INET, SOCK_STREAM, 0);
+        if(fd<0 || connect(fd, (sockaddr*)&addr, sizeof(addr))<0) { perror("connect"); return false; }
+        int one= 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return true;
+    }
+
+    bool send(const string& s)
+    {
+        return write(fd, s.data(), s.size())==(ssize_t)s.size();
+    }
+
+    bool readLine(string& line)
+    {
+        size_t nl;
+        while((nl= buf.find('\n'))==string::npos)
+        {
+            char tmp[65536];
+            ssize_t sz= read(fd, tmp, sizeof(tmp));
+            if(sz<=0) return false;
+            buf.append(tmp, sz);
+        }
+        line.assign(buf, 0, nl);
+        buf.erase(0, nl+1);
+        return true;
+    }
+
+    // read a reply. returns the status line, data set lines go to 'data' if given.
+    string reply(vector<string> *data= NULL)
+    {
+        string status, line;
+        if(!readLine(status)) return "";
+        if(status.size() && status[status.size()-1]==':')
+            while(readLine(line) && line.size())
+                if(data) data->push_back(line);
+        return status;
+    }
+
+    bool command(const string& cmd)
+    {
+        if(!send(cmd)) return false;
+        string status= reply();
+        if(status.compare(0, 2, "OK")) { fprintf(stderr, "%s-> %s\n", cmd.c_str(), status.c_str()); return false; }
+        return true;
+    }
+};
+
+static const char *graphName= "replicabench";
+static const size_t nnodes= 10000;
+
+// create the graph and load arcs: every node has ten successors.
+static bool setup(Conn& admin, int nreplicas)
+{
+    admin.send(string("drop-graph ") + graphName + "\n");
+    admin.reply();
+    usleep(200000);
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "create-graph %s %d\n", graphName, nreplicas);
+    if(!admin.command(cmd) || !admin.command(string("use-graph ") + graphName + "\n")) return false;
+    string arcs= "add-arcs:\n";
+    for(size_t i= 1; i<=nnodes; i++)
+        for(size_t k= 1; k<=10; k++)
+            arcs+= to_string(i) + "," + to_string((i*k*7919)%nnodes+1) + "\n";
+    arcs+= "\n";
+    return admin.command(arcs);
+}
+
+// returns requests per second, 0 on failure.
+static double run(size_t nconns, size_t nrequests)
+{
+    atomic<size_t> failed(0);
+    vector<thread> threads;
+    double t= getTime();
+    for(size_t c= 0; c<nconns; c++)
+        threads.push_back(thread([&, c] ()
+            {
+                Conn conn;
+                if(!conn.open() || !conn.command(string("use-graph ") + graphName + "\n")) { failed++; return; }
+                vector<string> data;
+                for(size_t i= 0; i<nrequests; i++)
+                {
+                    data.clear();
+                    conn.send("list-successors " + to_string((c*nrequests+i)%nnodes+1) + "\n");
+                    if(conn.reply(&data).compare(0, 2, "OK") || data.empty()) { failed++; break; }
+                }
+                close(conn.fd);
+            }));
+    for(thread& th: threads) th.join();
+    t= getTime()-t;
+    return (failed? 0: nconns*nrequests/t);
+}
+
+// a write followed by a read on one connection must see the write.
+static bool readYourWrites(Conn& admin)
+{
+    for(size_t i= 0; i<20; i++)
+    {
+        size_t node= nnodes+100+i;
+        if(!admin.command("add-arcs:\n" + to_string(node) + "," + to_string(node+1) + "\n\n")) return false;
+        vector<string> data;
+        admin.send("list-successors " + to_string(node) + "\n");
+        if(admin.reply(&data).compare(0, 2, "OK") || data.size()!=1) return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *host= (argc>1? argv[1]: "127.0.0.1");
+    int port= (argc>2? atoi(argv[2]): 6666);
+    size_t nconns= (argc>3? atol(argv[3]): 16);
+    size_t nrequests= (argc>4? atol(argv[4]): 2000);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family= AF_INET;
+    addr.sin_port= htons(port);
+    hostent *he= gethostbyname(host);
+    if(!he) { fprintf(stderr, "can't resolve %s\n", host); return 1; }
+    memcpy(&addr.sin_addr, he->h_addr, sizeof(addr.sin_addr));
+
+    Conn admin;
+    if(!admin.open() || !admin.command("authorize password fred:test\n")) return 1;
+
+    printf("%zu connections, %zu requests each\n", nconns, nrequests);
+    int replicas[]= { 0, 1, 3 };
+    double base= 0;
+    for(int r: replicas)
+    {
+        if(!setup(admin, r)) { printf("FAIL: couldn't set up graph with %d replicas\n", r); return 1; }
+        double rps= run(nconns, nrequests);
+        if(!rps) { printf("FAIL: requests failed with %d replicas\n", r); return 1; }
+        if(!base) base= rps;
+        printf("%d replicas: %10.0f requests/s (%.2fx)\n", r, rps, rps/base);
+        if(!readYourWrites(admin)) { printf("FAIL: a read didn't see the preceding write with %d replicas\n", r); return 1; }
+    }
+    admin.send(string("drop-graph ") + graphName + "\n");
+    admin.reply();
+    return 0;
+}
@@ -0,0 +1,135 @@
+// result cache benchmark.
+// replays read commands whose popularity follows a Zipf distribution, like tools asking for the same popular
+// categories over and over, through the ResultCache, with a write to the graph every so often. prints the hit
+// ratio, the bytes which didn't have to come from the core, and the time per lookup.
+// fails if the cache grows beyond its budget, if a reply is found after its graph was invalidated, if a reply
+// comes back for the wrong command, or if the most recently used entries are evicted first.
+// use: resultcache_bench [budget KiB [commands [distinct commands]]]
+
+#include <libintl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <new>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+using namespace std;
+
+#include "clibase.h"
+#include "const.h"
+#include "utils.h"
+
+uint32_t logMask= 0;
+
+// the reply a core would send: node IDs derived from the command's node, as many as the node is popular.
+static void makeReply(unsigned node, string& status, string& data)
+{
+    unsigned n= 1 + 2000/(node+1);
+    status= format("%s %u successors:\n", SUCCESS_STR, n);
+    data.clear();
+    for(unsigned i= 0; i<n; i++) data+= format("%u\n", node*7919+i);
+    data+= "\n";
+}
+
+int main(int argc, char **argv)
+{
+    size_t budget= (argc>1? atol(argv[1]): 4096)*1024;
+    size_t ncommands= (argc>2? atol(argv[2]): 1000000);
+    unsigned ndistinct= (argc>3? atol(argv[3]): 100000);
+    unsigned writeInterval= 10000;     // a write every this many commands
+    printf("budget %zu KiB, %zu commands, %u distinct, a write every %u\n", budget/1024, ncommands, ndistinct, writeInterval);
+
+    // zipf, s=1
+    vector<double> cdf(ndistinct);
+    double sum= 0;
+    for(unsigned i= 0; i<ndistinct; i++) cdf[i]= (sum+= 1.0/(i+1));
+    srand(1);
+
+    ResultCache cache(budget);
+    uint32_t graph= 1;
+    string key, status, data;
+    size_t maxBytes= 0, wrong= 0, bytesFromCore= 0;
+    double tLookup= 0;
+    for(size_t i= 0; i<ncommands; i++)
+    {
+        if(i%writeInterval==writeInterval-1) { cache.invalidate(graph); continue; }
+        double r= rand()/(RAND_MAX+1.0)*sum;
+        unsigned node= lower_bound(cdf.begin(), cdf.end(), r)-cdf.begin();
+        char line[64];
+        snprintf(line, sizeof(line), "list-successors  %u\n", node);    // normalized to one space
+        CommandTokens tokens;
+        tokens.parse(line, strlen(line));
+        double t= getTime();
+        cache.makeKey(graph, line, tokens, key);
+        const ResultCache::Entry *e= cache.find(key);
+        tLookup+= getTime()-t;
+        makeReply(node, status, data);
+        if(e)
+        {
+            if(e->status!=status || e->data!=data) wrong++;
+        }
+        else
+        {
+            bytesFromCore+= status.size()+data.size();
+            cache.insert(key, status, data);
+        }
+        maxBytes= max(maxBytes, cache.bytes());
+    }
+    uint64_t lookups= cache.stats.hits+cache.stats.misses;
+    printf("hit ratio %.3f, %llu bytes saved, %zu bytes from the core, %zu entries, %zu bytes cached (max %zu), %llu evictions\n",
+           double(cache.stats.hits)/lookups, (unsigned long long)cache.stats.bytesSaved, bytesFromCore, cache.size(), cache.bytes(),
+           maxBytes, (unsigned long long)cache.stats.evictions);
+    printf("%.1f ns per lookup\n", tLookup*1e9/lookups);
+
+    if(wrong) { printf("FAIL: %zu wrong replies\n", wrong); return 1; }
+    if(maxBytes>budget) { printf("FAIL: cache grew to %zu bytes\n", maxBytes); return 1; }
+
+    // invalidation: nothing of the graph is found any more, other graphs keep their entries.
+    CommandTokens tokens;
+    const char *cmd= "list-successors 1\n";
+    tokens.parse(cmd, strlen(cmd));
+    makeReply(1, status, data);
+    string key2;
+    cache.makeKey(2, cmd, tokens, key2);
+    cache.insert(key2, status, data);
+    cache.makeKey(graph, cmd, tokens, key);
+    cache.insert(key, status, data);
+    cache.invalidate(graph);
+    cache.makeKey(graph, cmd, tokens, key);
+    if(cache.find(key)) { printf("FAIL: reply found after invalidation\n"); return 1; }
+    if(!cache.find(key2)) { printf("FAIL: another graph's reply was invalidated\n"); return 1; }
+
+    // lru: fill a small cache, use the first entry, add more. the first one stays, the second goes.
+    ResultCache small(64*1024);
+    vector<string> keys;
+    for(unsigned i= 0; small.stats.evictions==0; i++)
+    {
+        char line[64];
+        snprintf(line, sizeof(line), "list-successors %u\n", 100000+i);
+        tokens.parse(line, strlen(line));
+        small.makeKey(1, line, tokens, key);
+        keys.push_back(key);
+        small.insert(key, "OK.\n", string(1000, 'x'));
+        if(keys.size()>2) small.find(keys[0]);
+    }
+    if(!small.find(keys[0]) || small.find(keys[1])) { printf("FAIL: not evicted in LRU order\n"); return 1; }
+
+    return 0;
+}
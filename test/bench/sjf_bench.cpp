@@ -0,0 +1,197 @@
+// shortest expected job first scheduling benchmark.
+// simulates a core serving a mixed catgraph workload: interactive clients doing cheap lookups, clients doing
+// shallow and deep traversals one at a time, and a batch client pipelining traversals. the scheduler doesn't know
+// what commands cost: it learns that with CommandCosts from the times of finished commands, and picks commands
+// like CoreInstance does in each scheduling mode. prints response times per kind of command for fair queueing
+// and for shortest expected job first.
+// fails if a client's commands run out of order, if sjf does not lower the median response time, or if deep
+// traversals or the batch client starve.
+
+#include <libintl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <new>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <event2/event.h>
+
+using namespace std;
+
+#include "clibase.h"
+#include "const.h"
+#include "utils.h"
+#include "coreinstance.h"
+
+uint32_t logMask= 0;
+
+// a kind of client. it keeps 'pipelined' commands queued, or sends one at a time with exponential think times.
+struct ClientKind
+{
+    const char *name;
+    const char *command;    // printf format, the node ID goes in
+    double cost;            // mean run time, seconds. each command takes 0.5 to 1.5 times that.
+    unsigned clients;
+    double think;
+    unsigned pipelined;
+    unsigned weight;
+};
+
+static const unsigned weights[]= FAIRQ_WEIGHTS;
+static ClientKind kinds[]=
+{
+    { "lookup",   "list-successors %u",        0.001, 12, 0.1, 0, weights[0]*FAIRQ_HTTP_FACTOR },
+    { "shallow",  "traverse-successors %u 3",  0.015,  4, 0.3, 0, weights[0]*FAIRQ_HTTP_FACTOR },
+    { "deep",     "traverse-successors %u 8",  0.120,  2, 0.2, 0, weights[0] },
+    { "batch",    "traverse-predecessors %u 6", 0.040, 1, 0,   100, weights[1] },
+};
+enum { NKINDS= sizeof(kinds)/sizeof(kinds[0]) };
+
+struct Client
+{
+    int kind;
+    uint32_t lastSeq, nextSeq;
+    double arrival;         // of the next command, -1 if it waits for a reply
+    unsigned queued;
+};
+
+struct Result
+{
+    vector<double> latencies[NKINDS];   // ms
+    vector<double> all;                 // of the clients which wait for their replies
+    bool ordered;
+};
+
+static double percentile(vector<double> v, double p)
+{
+    if(v.empty()) return 0;
+    size_t idx= min(v.size()-1, size_t(v.size()*p));
+    nth_element(v.begin(), v.begin()+idx, v.end());
+    return v[idx];
+}
+
+static double think(double mean)
+{
+    return -log(1-rand()/(RAND_MAX+1.0))*mean;
+}
+
+static Result simulate(SchedulingMode mode, double duration)
+{
+    Result res;
+    res.ordered= true;
+    srand(1);
+    FairQueue<CommandQEntry*> q(FAIRQ_QUANTUM);
+    CommandCosts costs;
+    vector<Client> clients(1);      // no client 0
+    for(int k= 0; k<NKINDS; k++)
+        for(unsigned i= 0; i<kinds[k].clients; i++)
+        {
+            Client c= { k, 0, 0, (kinds[k].pipelined? 0: think(kinds[k].think)), 0 };
+            clients.push_back(c);
+        }
+
+    double now= 0;
+    char line[256];
+    auto queue= [&] (uint32_t id)
+    {
+        Client& c= clients[id];
+        snprintf(line, sizeof(line), kinds[c.kind].command, (unsigned)rand()%1000000+1);
+        CommandQEntry *ce= CommandQEntry::create(id, line);
+        ce->orderSeq= ++c.nextSeq;      // to check the order
+        ce->sendBeginTime= now;
+        CommandCosts::shape(*ce, ce->costKey);
+        ce->expectedCost= max(costs.estimate(ce->costKey), 1e-6);
+        ce->waitingSince= now;
+        q.push(id, ce, kinds[c.kind].weight);
+        c.queued++;
+    };
+    auto eligible= [] (CommandQEntry *ce) { return true; };
+
+    while(now<duration)
+    {
+        for(uint32_t id= 1; id<clients.size(); id++)
+        {
+            Client& c= clients[id];
+            if(kinds[c.kind].pipelined)
+                while(c.queued<kinds[c.kind].pipelined) queue(id);
+            else if(c.arrival>=0 && c.arrival<=now)
+                queue(id), c.arrival= -1;
+        }
+        if(q.empty())
+        {
+            double next= duration;
+            for(uint32_t id= 1; id<clients.size(); id++)
+                if(clients[id].arrival>=0) next= min(next, clients[id].arrival);
+            now= next;
+            continue;
+        }
+        auto urgency= [now] (CommandQEntry *ce) { return SJF_AGING*(now-ce->waitingSince) - ce->expectedCost; };
+        uint32_t id= (mode==SCHED_SHORTEST? q.best(urgency, eligible): q.next(eligible));
+        CommandQEntry *ce= q.front(id);
+        q.pop(id);
+        if(q.last(id)) q.front(id)->waitingSince= now;
+        Client& c= clients[id];
+        if(ce->orderSeq!=c.lastSeq+1) res.ordered= false;
+        c.lastSeq= ce->orderSeq;
+        c.queued--;
+
+        double t= kinds[c.kind].cost*(0.5+rand()/(double)RAND_MAX);
+        now+= t;
+        q.charge(id, t);
+        costs.update(ce->costKey, t);
+        double latency= (now-ce->sendBeginTime)*1000;
+        res.latencies[c.kind].push_back(latency);
+        if(!kinds[c.kind].pipelined)
+            res.all.push_back(latency),
+            c.arrival= now+think(kinds[c.kind].think);
+        CommandQEntry::recycle(ce);
+    }
+    return res;
+}
+
+static void report(const char *name, Result& r, double duration)
+{
+    printf("%s: median response %.1f ms, mean %.1f ms\n", name, percentile(r.all, 0.5),
+           accumulate(r.all.begin(), r.all.end(), 0.0)/max(r.all.size(), (size_t)1));
+    for(int k= 0; k<NKINDS; k++)
+        printf("  %-8s %6zu commands, %6.1f/s, ms: p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f\n", kinds[k].name,
+               r.latencies[k].size(), r.latencies[k].size()/duration, percentile(r.latencies[k], 0.5),
+               percentile(r.latencies[k], 0.9), percentile(r.latencies[k], 0.99), percentile(r.latencies[k], 1));
+}
+
+int main(int argc, char **argv)
+{
+    double duration= (argc>1? atof(argv[1]): 120);
+    printf("%.0f s simulated\n", duration);
+
+    Result fair= simulate(SCHED_FAIR, duration);
+    report("fair", fair, duration);
+    Result sjf= simulate(SCHED_SHORTEST, duration);
+    report("sjf ", sjf, duration);
+
+    if(!fair.ordered || !sjf.ordered) { printf("FAIL: commands of a client were run out of order\n"); return 1; }
+    if(percentile(sjf.all, 0.5)>=percentile(fair.all, 0.5)) { printf("FAIL: sjf does not lower the median response time\n"); return 1; }
+    // aging: the longest commands still run, and don't wait for more than a few seconds.
+    if(sjf.latencies[3].empty() || percentile(sjf.latencies[2], 1)>5000) { printf("FAIL: long commands starve with sjf\n"); return 1; }
+    return 0;
+}
@@ -0,0 +1,156 @@
+// session and core lookup benchmark.
+// registers many sessions, then looks each one up by ID and by socket fd, as the main loops do for every
+// line relayed. compares the previous std::map tables against SlotTable and FdTable, and a linear scan of
+// core names against the name index used by findNamedInstance.
+// fails if a lookup misses, or if a removed session's ID is found again after its slot was reused.
+
+#include <libintl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <new>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+using namespace std;
+
+#include "clibase.h"
+#include "const.h"
+#include "utils.h"
+
+uint32_t logMask= 0;
+
+struct Session { uint32_t id; int fd; };
+struct Core { uint32_t id; string name; };
+
+// count heap bytes, to compare the table overhead per session.
+static size_t heapBytes;
+
+void *operator new(size_t size)
+{
+    heapBytes+= size;
+    void *p= malloc(size);
+    if(!p) throw bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+
+int main(int argc, char **argv)
+{
+    size_t nsessions= (argc>1? atol(argv[1]): 100000);
+    size_t ncores= (argc>2? atol(argv[2]): 1000);
+    size_t rounds= 10;
+    printf("%zu sessions, %zu cores\n", nsessions, ncores);
+
+    vector<Session> sessions(nsessions);
+    size_t heap= heapBytes;
+    map<uint32_t,Session*> idMap;
+    map<int,Session*> fdMap;
+    for(size_t i= 0; i<nsessions; i++)
+    {
+        sessions[i].id= i+1;
+        sessions[i].fd= i+10;
+        idMap[sessions[i].id]= &sessions[i];
+        fdMap[sessions[i].fd]= &sessions[i];
+    }
+    size_t mapBytes= heapBytes-heap;
+
+    heap= heapBytes;
+    SlotTable<Session> idTable;
+    FdTable<Session> fdTable;
+    vector<uint32_t> ids(nsessions);
+    for(size_t i= 0; i<nsessions; i++)
+    {
+        ids[i]= idTable.add(&sessions[i]);
+        fdTable.set(sessions[i].fd, &sessions[i]);
+    }
+    size_t tableBytes= heapBytes-heap;
+
+    // look up in a scattered order, like lines arriving from many clients.
+    vector<size_t> order(nsessions);
+    for(size_t i= 0; i<nsessions; i++) order[i]= (i*7919)%nsessions;
+
+    size_t foundMap= 0, foundTable= 0;
+    double t= getTime();
+    for(size_t r= 0; r<rounds; r++)
+        for(size_t i: order)
+        {
+            map<uint32_t,Session*>::iterator a= idMap.find(sessions[i].id);
+            map<int,Session*>::iterator b= fdMap.find(sessions[i].fd);
+            if(a!=idMap.end() && b!=fdMap.end() && a->second==b->second) foundMap++;
+        }
+    double tMap= getTime()-t;
+
+    t= getTime();
+    for(size_t r= 0; r<rounds; r++)
+        for(size_t i: order)
+        {
+            Session *a= idTable.find(ids[i]);
+            Session *b= fdTable.find(sessions[i].fd);
+            if(a && a==b) foundTable++;
+        }
+    double tTable= getTime()-t;
+
+    size_t nlookups= rounds*nsessions;
+    printf("map:   %8.1f ns per id+fd lookup, %6.1f bytes per session\n", tMap*1e9/nlookups, (double)mapBytes/nsessions);
+    printf("table: %8.1f ns per id+fd lookup, %6.1f bytes per session\n", tTable*1e9/nlookups, (double)tableBytes/nsessions);
+
+    // core names: unnamed cores had their name formatted for every comparison.
+    vector<Core> cores(ncores);
+    unordered_map<string,Core*> coreNames;
+    for(size_t i= 0; i<ncores; i++)
+    {
+        cores[i].id= i+1;
+        if(i%2) cores[i].name= format("graph%zu", i);
+        coreNames[cores[i].name.length()? cores[i].name: format("Core%02u", cores[i].id)]= &cores[i];
+    }
+    vector<string> names;
+    for(size_t i= 0; i<ncores; i+= 7)
+        names.push_back(cores[i].name.length()? cores[i].name: format("Core%02u", cores[i].id));
+
+    size_t foundScan= 0, foundIndex= 0;
+    t= getTime();
+    for(const string& name: names)
+        for(Core& c: cores)
+            if((c.name.length()? c.name: format("Core%02u", c.id))==name) { foundScan++; break; }
+    double tScan= getTime()-t;
+
+    t= getTime();
+    for(size_t r= 0; r<rounds; r++)
+        for(const string& name: names)
+            if(coreNames.find(name)!=coreNames.end()) foundIndex++;
+    double tIndex= getTime()-t;
+
+    printf("name scan:  %10.1f ns per lookup\n", tScan*1e9/names.size());
+    printf("name index: %10.1f ns per lookup\n", tIndex*1e9/(rounds*names.size()));
+
+    if(foundMap!=nlookups || foundTable!=nlookups || foundScan!=names.size() || foundIndex!=rounds*names.size())
+    {
+        printf("FAIL: lookups missed\n");
+        return 1;
+    }
+
+    // removed IDs must stay invalid, even once their slots are handed out again.
+    for(size_t i= 0; i<nsessions; i++) idTable.erase(ids[i]);
+    for(size_t i= 0; i<nsessions; i++) idTable.add(&sessions[i]);
+    for(size_t i= 0; i<nsessions; i++)
+        if(idTable.find(ids[i])) { printf("FAIL: stale ID %u found\n", ids[i]); return 1; }
+    if(idTable.size()!=nsessions) { printf("FAIL: table size %zu\n", idTable.size()); return 1; }
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+// command parsing benchmark.
+// compares the cost of dispatching a command line the old way (Cli::splitString in processCommand and again
+// in forwardToCore, string searches for redirection, lineIndicatesDataset, lookups in a map<string>) against
+// CommandTokens and NameTable, and counts heap allocations per command.
+// fails if parsing and looking up a command allocates.
+
+#include <libintl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <new>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+using namespace std;
+
+#include "clibase.h"
+#include "const.h"
+#include "utils.h"
+
+uint32_t logMask= 0;
+
+static size_t allocs;
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    allocs++;
+    void *p= malloc(size);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+// a mix of server and core commands, as clients send them.
+static const char *commandLines[]=
+{
+    "list-successors 123456\n",
+    "traverse-predecessors-withdepth 77 3\n",
+    "add-arcs:\n",
+    "list-predecessors 99 > /tmp/out\n",
+    "use-graph enwiki\n",
+    "traverse-successors-without 1 2 3 4 5 6 7 8\n",
+    "stats\n",
+    "remove-arcs:\n",
+};
+#define NCOMMANDLINES (sizeof(commandLines)/sizeof(commandLines[0]))
+
+static const char *serverCommands[]=
+{ "create-graph", "use-graph", "drop-graph", "list-graphs", "authorize", "help", "info", "session-info", "server-stats" };
+
+static const char *coreCommands[]=
+{
+    "add-arcs", "remove-arcs", "replace-arcs", "clear", "shutdown", "stats", "protocol-version",
+    "list-roots", "list-leaves", "list-successors", "list-predecessors", "list-neighbors",
+    "traverse-successors", "traverse-predecessors", "traverse-neighbors",
+    "traverse-successors-without", "traverse-predecessors-without", "traverse-neighbors-without",
+    "traverse-successors-withdepth", "traverse-predecessors-withdepth", "traverse-neighbors-withdepth",
+    "find-path", "find-root", "list-by-head", "list-by-tail", "add-arcs-from-file", "dump-graph", "load-graph",
+};
+
+struct Result { size_t allocs; double seconds; unsigned found; };
+
+static size_t iterations;
+static string lines[NCOMMANDLINES];
+
+static Result oldParse()
+{
+    map<string,int> serv, core;
+    for(unsigned i= 0; i<sizeof(serverCommands)/sizeof(serverCommands[0]); i++) serv[serverCommands[i]]= i;
+    for(unsigned i= 0; i<sizeof(coreCommands)/sizeof(coreCommands[0]); i++) core[coreCommands[i]]= i;
+
+    Result r= { allocs, getTime(), 0 };
+    for(size_t n= 0; n<iterations; n++)
+    {
+        const string& line= lines[n%NCOMMANDLINES];
+        bool dataset= lineIndicatesDataset(line);
+        vector<string> words= Cli::splitString(line.c_str(), " \t\n");
+        if(words.empty()) continue;
+        if(serv.find(words[0])!=serv.end()) { r.found++; continue; }
+        vector<string> coreWords= Cli::splitString(line.c_str(), " \t\n:<>");
+        bool redirected= line.find(">")!=string::npos || line.find("<")!=string::npos;
+        if(core.find(coreWords[0])!=core.end()) r.found+= 1+dataset+redirected;
+    }
+    r.allocs= allocs-r.allocs;
+    r.seconds= getTime()-r.seconds;
+    return r;
+}
+
+static Result newParse()
+{
+    NameTable<int> serv, core;
+    for(unsigned i= 0; i<sizeof(serverCommands)/sizeof(serverCommands[0]); i++) serv.insert(serverCommands[i], i);
+    for(unsigned i= 0; i<sizeof(coreCommands)/sizeof(coreCommands[0]); i++) core.insert(coreCommands[i], i);
+
+    Result r= { allocs, getTime(), 0 };
+    CommandTokens tokens;
+    for(size_t n= 0; n<iterations; n++)
+    {
+        const string& line= lines[n%NCOMMANDLINES];
+        tokens.parse(line);
+        if(!tokens.nwords) continue;
+        if(serv.find(tokens.word(line, 0))) { r.found++; continue; }
+        if(core.find(tokens.name(line))) r.found+= 1+tokens.dataset+tokens.redirected;
+    }
+    r.allocs= allocs-r.allocs;
+    r.seconds= getTime()-r.seconds;
+    return r;
+}
+
+static void print(const char *name, const Result& r)
+{
+    printf("%-5s %6.1f ns per command, %.2f allocations per command\n",
+           name, r.seconds*1e9/iterations, double(r.allocs)/iterations);
+}
+
+int main(int argc, char **argv)
+{
+    iterations= (argc>1? atol(argv[1]): 2000000);
+    for(unsigned i= 0; i<NCOMMANDLINES; i++) lines[i]= commandLines[i];
+    printf("%zu commands\n", iterations);
+
+    Result o= oldParse();
+    Result n= newParse();
+    print("old:", o);
+    print("new:", n);
+
+    if(o.found!=n.found) { printf("FAIL: results differ (%u, %u)\n", o.found, n.found); return 1; }
+    if(n.allocs) { printf("FAIL: parsing allocates\n"); return 1; }
+    return 0;
+}